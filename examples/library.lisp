@@ -1,46 +1,8 @@
 ;;
 ;;  Simple library of useful functions and macros
-;; 
-
-;; (and e1 e2 ...)
-;; => (if e1 (and e2 ...))
-;; (and e1)
-;; => e1
-(defmacro and (expr . rest)
-  (if rest
-      (list 'if expr (cons 'and rest)) 
-      expr))
-
-;; (or e1 e2 ...)
-;; => (let <tmp> e1
-;;      (if <tmp> <tmp> (or e2 ...)))
-;; (or e1)
-;; => e1
 ;;
-;; The reason to use the temporary variables is to avoid evaluating the
-;; arguments more than once.
-(defmacro or (expr . rest)
-  (if rest
-      (let var (gensym)
-	    (list 'let var expr
-		  (list 'if var var (cons 'or rest))))
-    expr))
-
-;; (let var val body ...)
-;; => ((lambda (var) body ...) val)
-(defmacro let (var val . body)
-  (cons (cons 'lambda (cons (list var) body))
-	(list val)))
-
-;; (when expr body ...)
-;; => (if expr (progn body ...))
-(defmacro when (expr . body)
-  (cons 'if (cons expr (list (cons 'progn body)))))
-
-;; (unless expr body ...)
-;; => (if expr () body ...)
-(defmacro unless (expr . body)
-  (cons 'if (cons expr (cons () body))))
+;;  let, and, or, when, unless and cond are special forms of the interpreter.
+;;
 
 ;;;
 ;;; List operators
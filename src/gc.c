@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
 #include <stdint.h>
@@ -15,9 +16,19 @@ void *memory;
 // The pointer pointing to the beginning of the old heap
 static void *from_space;
 
+// The sizes of the current heap, of the old heap, and of the heap to be allocated by the next GC
+size_t memory_size = MEMORY_SIZE;
+static size_t from_size;
+static size_t next_size = MEMORY_SIZE;
+
 // The number of bytes allocated from the heap
 size_t mem_nused = 0;
 
+size_t alloc_left = SIZE_MAX;
+
+Obj *value_registers[MAX_VALUES];
+int nvalues = 0;
+
 // Flags to debug GC
  bool gc_running = false;
  bool debug_gc = false;
@@ -49,6 +60,10 @@ Obj *alloc(void *root, int type, size_t size) {
     // boundary as the pointer.
     size = roundup(size, sizeof(void *));
 
+    if (size > alloc_left)
+        error("Allocation limit exceeded", filepos.line_num);
+    alloc_left -= size;
+
     // If the debug flag is on, allocate a new memory space to force all the existing objects to
     // move to new addresses, to invalidate the old addresses. By doing this the GC behavior becomes
     // more predictable and repeatable. If there's a memory bug that the C variable has a direct
@@ -58,12 +73,18 @@ Obj *alloc(void *root, int type, size_t size) {
         gc(root);
 
     // Otherwise, run GC only when the available memory is not large enough.
-    if (!always_gc && MEMORY_SIZE < mem_nused + size)
+    if (!always_gc && memory_size < mem_nused + size)
+        gc(root);
+
+    // If there are too many live objects, run GC again to move them to a larger heap.
+    while (memory_size < mem_nused + size && memory_size < MAX_MEMORY_SIZE) {
+        next_size = memory_size * 2;
         gc(root);
+    }
 
-    // Terminate the program if we couldn't satisfy the memory request. This can happen if the
-    // requested size was too large or the from-space was filled with too many live objects.
-    if (MEMORY_SIZE < mem_nused + size)
+    // Give up if we couldn't satisfy the memory request. This can happen if the requested size was
+    // too large or the heap has reached its maximum size.
+    if (memory_size < mem_nused + size)
         error("Memory exhausted", filepos.line_num);
 
     // Allocate the object.
@@ -92,7 +113,7 @@ static inline Obj *forward(Obj *obj) {
     // If the object's address is not in the from-space, the object is not managed by GC nor it
     // has already been moved to the to-space.
     ptrdiff_t offset = (uint8_t *)obj - (uint8_t *)from_space;
-    if (offset < 0 || MEMORY_SIZE <= offset)
+    if (offset < 0 || from_size <= (size_t)offset)
         return obj;
 
     // The pointer is pointing to the from-space, but the object there was a tombstone. Follow the
@@ -113,18 +134,113 @@ static inline Obj *forward(Obj *obj) {
 }
 
 void *alloc_semispace() {
-    return mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    return mmap(NULL, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
 }
 
-// Copies the root objects.
-static void forward_root_objects(void *root) {
-    Symbols = forward(Symbols);
-    for (void **frame = root; frame; frame = *(void ***)frame)
+// Copies the objects referenced by the object.
+static void scan(Obj *obj) {
+    switch (obj->type) {
+    case TINT:
+    case TSYMBOL:
+    case TPRIMITIVE:
+    case TSTRING:
+    case TGENERATOR:
+        // Any of the above types does not contain a pointer to a GC-managed object.
+        break;
+    case TCELL:
+        obj->car = forward(obj->car);
+        obj->cdr = forward(obj->cdr);
+        break;
+    case TFUNCTION:
+    case TMACRO:
+        obj->params = forward(obj->params);
+        obj->body = forward(obj->body);
+        obj->env = forward(obj->env);
+        obj->memo = forward(obj->memo);
+        break;
+    case TPROMISE:
+        obj->thunk = forward(obj->thunk);
+        obj->thunk_args = forward(obj->thunk_args);
+        break;
+    case TENV:
+        obj->vars = forward(obj->vars);
+        obj->up = forward(obj->up);
+        break;
+    case TTABLE:
+        for (long i = 0; i < obj->len; i++)
+            obj->slots[i] = forward(obj->slots[i]);
+        break;
+    default:
+        error("Bug: copy: unknown type %d", 0, obj->type);
+    }
+}
+
+// Copies the objects of the root frames.
+static void forward_frames(void *root) {
+    for (void **frame = root; frame; frame = *(void ***)frame) {
+        if (frame[1] == ROOT_OBJECTS) {
+            // Objects on the C stack
+            Obj *objs = frame[2];
+            for (int i = 0; i < (intptr_t)frame[3]; i++)
+                scan(&objs[i]);
+            continue;
+        }
         for (int i = 1; frame[i] != ROOT_END; i++)
             if (frame[i])
                 frame[i] = forward(frame[i]);
+    }
+}
+
+// Copies the root objects.
+static void forward_root_objects(void *root) {
+    Symbols = forward(Symbols);
+    for (int i = 0; i < nvalues; i++)
+        value_registers[i] = forward(value_registers[i]);
+    forward_frames(root);
 }
 
+// The suspended stacks
+static Stack *stacks;
+
+void add_stack(Stack *stack) {
+    stack->next = stacks;
+    stacks = stack;
+}
+
+// Copies the objects referenced by the objects between scan1 and scan2, and so on.
+static void scan_copied(void) {
+    while (scan1 < scan2) {
+        scan(scan1);
+        scan1 = (Obj *)((uint8_t *)scan1 + scan1->size);
+    }
+}
+
+// Copies the objects referenced from the suspended stacks whose owners are live. An owner is live
+// if it has been copied, which may happen while scanning another stack, so this is repeated
+// until no more stacks are found live. The other stacks are released.
+static void forward_stacks(void) {
+    for (bool found = true; found; ) {
+        found = false;
+        for (Stack *s = stacks; s; s = s->next) {
+            if (s->scanned || s->owner->type != TMOVED)
+                continue;
+            s->scanned = found = true;
+            forward_frames(s->root);
+            scan_copied();
+        }
+    }
+    for (Stack **p = &stacks; *p; ) {
+        Stack *s = *p;
+        if (s->scanned) {
+            s->owner = s->owner->moved;
+            s->scanned = false;
+            p = &s->next;
+        } else {
+            *p = s->next;
+            s->release(s);
+        }
+    }
+}
 
 // Returns true if the environment variable is defined and not the empty string.
 static bool getEnvFlag(char *name) {
@@ -142,9 +258,19 @@ void gc(void *root) {
     debug_gc = getEnvFlag("MINILISP_DEBUG_GC");
     always_gc = getEnvFlag("MINILISP_ALWAYS_GC");
 
-    // Allocate a new semi-space.
+    // Allocate a new semi-space. Keep the current size if the system is out of memory.
     from_space = memory;
+    from_size = memory_size;
+    memory_size = next_size;
     memory = alloc_semispace();
+    if (memory == MAP_FAILED) {
+        memory_size = next_size = from_size;
+        memory = alloc_semispace();
+        if (memory == MAP_FAILED) {
+            fputs("Out of memory\n", stderr);
+            exit(1);
+        }
+    }
 
     // Initialize the two pointers for GC. Initially they point to the beginning of the to-space.
     scan1 = scan2 = memory;
@@ -155,39 +281,19 @@ void gc(void *root) {
     // Copy the objects referenced by the GC root objects located between scan1 and scan2. Once it's
     // finished, all live objects (i.e. objects reachable from the root) will have been copied to
     // the to-space.
-    while (scan1 < scan2) {
-        switch (scan1->type) {
-        case TINT:
-        case TSYMBOL:
-        case TPRIMITIVE:
-        case TSTRING:
-            // Any of the above types does not contain a pointer to a GC-managed object.
-            break;
-        case TCELL:
-            scan1->car = forward(scan1->car);
-            scan1->cdr = forward(scan1->cdr);
-            break;
-        case TFUNCTION:
-        case TMACRO:
-            scan1->params = forward(scan1->params);
-            scan1->body = forward(scan1->body);
-            scan1->env = forward(scan1->env);
-            break;
-        case TENV:
-            scan1->vars = forward(scan1->vars);
-            scan1->up = forward(scan1->up);
-            break;
-        default:
-            error("Bug: copy: unknown type %d", scan1->type);
-        }
-        scan1 = (Obj *)((uint8_t *)scan1 + scan1->size);
-    }
+    scan_copied();
+    forward_stacks();
 
     // Finish up GC.
-    munmap(from_space, MEMORY_SIZE);
+    munmap(from_space, from_size);
     size_t old_nused = mem_nused;
     mem_nused = (size_t)((uint8_t *)scan1 - (uint8_t *)memory);
     if (debug_gc)
         fprintf(stderr, "GC: %zu bytes out of %zu bytes copied.\n", mem_nused, old_nused);
+
+    // Make the next heap larger if more than half of this one is live, so that GC doesn't run
+    // over and over for a few bytes.
+    if (mem_nused > memory_size / 2 && memory_size < MAX_MEMORY_SIZE)
+        next_size = memory_size * 2;
     gc_running = false;
 }
@@ -3,14 +3,30 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "minilisp.h"
 
 //======================================================================
 // Memory management
 //======================================================================
 
-// The size of the heap in byte
+// The initial size of the heap in byte. The heap grows as needed, up to MAX_MEMORY_SIZE.
 #define MEMORY_SIZE 65536 * 4
+#define MAX_MEMORY_SIZE ((size_t)256 * 1024 * 1024)
+
+// The current size of the heap in byte
+extern size_t memory_size;
+
+// The number of bytes that may still be allocated by the current evaluation (see "Limits" in
+// minilisp.c)
+extern size_t alloc_left;
+
+// The values returned by the last call of values, and their number, which is 0 once another form
+// has been evaluated (see "Multiple values" in minilisp.c). They are GC roots.
+#define MAX_VALUES 16
+
+extern Obj *value_registers[MAX_VALUES];
+extern int nvalues;
 
 extern void *gc_root;    // root of memory
 
@@ -68,6 +84,47 @@ static inline void** add_root_frame(void **prev_frame, int size, void *frame[])
     Obj **var3 = (Obj **)(root_frame + 3);      \
     Obj **var4 = (Obj **)(root_frame + 4);
 
+#define DEFINE5(prev_frame, var1, var2, var3, var4, var5)   \
+    void *root_frame[7];                        \
+    prev_frame = add_root_frame(prev_frame, 5, root_frame); \
+    Obj **var1 = (Obj **)(root_frame + 1);      \
+    Obj **var2 = (Obj **)(root_frame + 2);      \
+    Obj **var3 = (Obj **)(root_frame + 3);      \
+    Obj **var4 = (Obj **)(root_frame + 4);      \
+    Obj **var5 = (Obj **)(root_frame + 5);
+
+// Objects can also be allocated on the C stack when they are known not to be referenced once the
+// function that allocated them returns, e.g. the environment frame of a let form whose body cannot
+// create a closure. GC doesn't move them, but updates the pointers they contain. They are
+// registered in a root frame of the form {prev_frame, ROOT_OBJECTS, objs, n}.
+#define ROOT_OBJECTS ((void *)-2)
+
+static inline void** add_stack_objects(void **prev_frame, Obj *objs, int n, void *frame[4]) {
+    frame[0] = prev_frame;
+    frame[1] = ROOT_OBJECTS;
+    frame[2] = objs;
+    frame[3] = (void *)(intptr_t)n;
+    return frame;
+}
+
+// Returns true if the object is in the heap, i.e. it's neither a constant nor on the C stack.
+static inline bool in_heap(Obj *obj) {
+    extern void *memory;
+    return (size_t)((char *)obj - (char *)memory) < memory_size;
+}
+
+// A stack on which code is suspended, such as the stack of a generator. Its root frames are not
+// linked to the ones of the running code, so GC scans them separately, as long as owner, the
+// object the stack belongs to, is live. Once the owner is dead, release is called.
+typedef struct Stack {
+    Obj *owner;
+    void *root;  // The innermost root frame on the stack, or NULL if there is nothing to scan
+    void (*release)(struct Stack *stack);
+    bool scanned;
+    struct Stack *next;
+} Stack;
+
+void add_stack(Stack *stack);
 
 void *alloc_semispace();
 Obj *alloc(void *root, int type, size_t size);
@@ -2,29 +2,69 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <setjmp.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
 #include "minilisp.h"
 #include "gc.h"
 
-jmp_buf context;
+// The places an error or a throw can jump to form a stack of handlers, the innermost one being
+// context. A handler is set up with setjmp by the code that has to clean up after an error, e.g.
+// load, or that stops it, like the REPL. It's passed on to the next handler by jumping to context
+// again once the handler is removed. A catch form is a handler with a tag, which a throw to the tag
+// jumps to, through the handlers set up since.
+typedef struct Handler {
+    jmp_buf jmp;
+    struct Handler *prev;
+    // The tag of a catch, the root holding the value thrown to it, and the depth of the function
+    // calls it's in
+    Obj **tag, **value;
+    long call_depth;
+    // True if the handler stops the errors rather than passing them on
+    bool stops_errors;
+} Handler;
+
+Handler *context;
+
+// The catch the throw in progress goes to, or NULL if it's an error
+static Handler *thrown;
 
 extern filepos_t filepos;
 
+// The message of the last error
+static char error_message[256];
+
+// Returns true if the handler is a catch of the errors, i.e. a catch with the tag error.
+static bool catches_errors(Handler *h) {
+    return h->tag && (*h->tag)->type == TSYMBOL && strcmp((*h->tag)->name, "error") == 0;
+}
+
 void error(char *fmt, int line_num, ...) {
     va_list ap;
     va_start(ap, line_num);
-    fprintf(stderr, "%s[%d]: ", filepos.filename, line_num);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
+    vsnprintf(error_message, sizeof(error_message), fmt, ap);
     va_end(ap);
+    // The error is only reported if a catch doesn't handle it first.
+    Handler *h = context;
+    while (h && !h->stops_errors && !catches_errors(h))
+        h = h->prev;
+    if (!h || !catches_errors(h))
+        fprintf(stderr, "%s[%d]: %s\n", filepos.filename, line_num, error_message);
     // Jump right back to the end of eval 
-    longjmp(context, 1);
+    thrown = NULL;
+    longjmp(context->jmp, 1);
 }
 
 // Constants
@@ -33,6 +73,171 @@ static Obj *Nil = &(Obj){ .type = TNIL, .size = sizeof(Obj) };
 static Obj *Dot = &(Obj){ .type = TDOT, .size = sizeof(Obj) };
 static Obj *Cparen = &(Obj){ .type = TCPAREN, .size = sizeof(Obj) };
 
+//======================================================================
+// Control stack
+//======================================================================
+
+// Lisp functions are evaluated by C functions that call each other recursively, so the depth of
+// Lisp recursion is bounded by the C stack. The interpreter runs on a large stack allocated with
+// mmap, whose pages are committed by the system only when they are touched, and eval checks the
+// remaining space so that a runaway recursion raises an error instead of crashing.
+
+// The space kept below the limit for error() and the C library.
+#define STACK_MARGIN (256 * 1024)
+
+// The lowest address the stack may grow to. The stack grows downward.
+static char *stack_limit;
+
+static void check_stack(int line_num) {
+    char here;
+    if (&here < stack_limit)
+        error("Stack overflow", line_num);
+}
+
+// Raises an error unless size more bytes fit on the stack.
+static void check_stack_space(size_t size, int line_num) {
+    char here;
+    if ((uintptr_t)&here < (uintptr_t)stack_limit + size)
+        error("Stack overflow", line_num);
+}
+
+// Sets the limit below the current position, for the native stack of the process.
+static void limit_native_stack(void) {
+    char here;
+    struct rlimit rl;
+    size_t size = 8 * 1024 * 1024;
+    if (getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+        size = rl.rlim_cur;
+    stack_limit = size > 2 * STACK_MARGIN ? &here - size + 2 * STACK_MARGIN : NULL;
+}
+
+// Calls fn on a new stack of the given size in bytes. The lowest page is left unmapped so that an
+// overflow past the limit faults instead of overwriting memory. If size is 0, or if the stack
+// cannot be allocated, fn is called on the native stack.
+void run_on_stack(size_t size, void (*fn)(void)) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) / page * page;
+    char *stack = size ? mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0) : MAP_FAILED;
+    if (stack == MAP_FAILED || size <= 2 * STACK_MARGIN) {
+        if (stack != MAP_FAILED)
+            munmap(stack, size + page);
+        limit_native_stack();
+        fn();
+        return;
+    }
+    mprotect(stack, page, PROT_NONE);
+    ucontext_t caller, callee;
+    getcontext(&callee);
+    callee.uc_stack.ss_sp = stack + page;
+    callee.uc_stack.ss_size = size;
+    callee.uc_link = &caller;
+    makecontext(&callee, fn, 0);
+    stack_limit = stack + page + STACK_MARGIN;
+    swapcontext(&caller, &callee);
+    munmap(stack, size + page);
+}
+
+//======================================================================
+// Limits
+//
+// The evaluation of each top-level form may be limited in the number of eval steps, the number of
+// bytes allocated and the depth of function calls, with --max-steps, --max-alloc and --max-depth,
+// and within a form with (with-limits (steps n alloc n depth n) expr ...). A step is the
+// evaluation of a form other than a constant or a variable, so that a loop takes at least one step
+// per iteration. Going over a limit is an error. Each limit is a counter, which eval, alloc and
+// call_func decrement or compare, so that they cost next to nothing when there is no limit.
+//
+// Evaluation can also be stopped from outside: by Ctrl-C in the REPL, or when the deadline set by
+// --timeout for each top-level form, or by (with-timeout ms expr ...), has passed. A timer raises
+// SIGALRM at the deadline. The signal handlers only set pending_signal, which is polled along with
+// the step counter, so that the error is raised where the interpreter is in a consistent state.
+// SIGINT aborts the whole top-level form: pending_signal stays set until the next one starts.
+//======================================================================
+
+long long max_steps = 0, max_alloc = 0;
+long max_depth = 0, timeout_ms = 0;
+
+// The signal received but not handled yet, or 0
+static volatile sig_atomic_t pending_signal = 0;
+
+// The deadline of the current evaluation, or 0 if there is none, in ms of CLOCK_MONOTONIC
+static long long deadline = 0;
+
+// The number of steps left. The number of bytes left is alloc_left in gc.c.
+static long long steps_left = LLONG_MAX;
+
+// The depth of the function calls being evaluated, and the maximum depth
+static long call_depth = 0, depth_limit = LONG_MAX;
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void on_signal(int sig) {
+    pending_signal = sig;
+}
+
+// Sets the deadline, and the timer to raise SIGALRM then. A deadline of 0 stops the timer.
+static void set_deadline(long long ms) {
+    static bool installed = false;
+    if (!installed) {
+        struct sigaction sa = { .sa_handler = on_signal, .sa_flags = SA_RESTART };
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGALRM, &sa, NULL);
+        installed = true;
+    }
+    deadline = ms;
+    struct itimerval timer = { { 0, 0 }, { 0, 0 } };
+    setitimer(ITIMER_REAL, &timer, NULL);
+    if (pending_signal == SIGALRM)
+        pending_signal = 0;
+    if (!deadline)
+        return;
+    long long left = deadline - now_ms();
+    if (left <= 0) {
+        pending_signal = SIGALRM;
+        return;
+    }
+    timer.it_value.tv_sec = left / 1000;
+    timer.it_value.tv_usec = left % 1000 * 1000;
+    setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+// If on is true, makes Ctrl-C interrupt the evaluation instead of killing the process. The REPL
+// turns it on only while it evaluates, so that Ctrl-C at the prompt still quits.
+void catch_interrupts(bool on) {
+    struct sigaction sa = { .sa_handler = on ? on_signal : SIG_DFL, .sa_flags = SA_RESTART };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+}
+
+static void stop(int line_num) {
+    if (pending_signal == SIGINT)
+        error("Interrupted", line_num);
+    if (pending_signal == SIGALRM)
+        error("Timeout", line_num);
+    error("Step limit exceeded", line_num);
+}
+
+static inline void count_step(int line_num) {
+    if (--steps_left < 0 || pending_signal)
+        stop(line_num);
+}
+
+// Sets the limits for a top-level form.
+static void reset_limits(void) {
+    steps_left = max_steps > 0 ? max_steps : LLONG_MAX;
+    alloc_left = max_alloc > 0 ? (size_t)max_alloc : SIZE_MAX;
+    call_depth = 0;
+    depth_limit = max_depth > 0 ? max_depth : LONG_MAX;
+    pending_signal = 0;
+    if (timeout_ms > 0 || deadline)
+        set_deadline(timeout_ms > 0 ? now_ms() + timeout_ms : 0);
+}
+
 //======================================================================
 // Constructors
 //======================================================================
@@ -45,13 +250,38 @@ void *gc_root = NULL;    // root of memory
 
 extern Obj *alloc(void *root, int type, size_t size);
 
+// The integers from MIN_SMALL_INT to MAX_SMALL_INT are made once, outside of the heap, so that the
+// common small results don't allocate. GC leaves them alone, like the other objects that are not
+// in the heap.
+#define MIN_SMALL_INT -128
+#define MAX_SMALL_INT 1023
+
+static Obj small_ints[MAX_SMALL_INT - MIN_SMALL_INT + 1];
+
+static void init_small_ints(void) {
+    for (int i = MIN_SMALL_INT; i <= MAX_SMALL_INT; i++) {
+        Obj *r = &small_ints[i - MIN_SMALL_INT];
+        r->type = TINT;
+        r->size = sizeof(Obj);
+        r->value = i;
+    }
+}
+
 static Obj *make_int(void *root, long long value) {
+    if (MIN_SMALL_INT <= value && value <= MAX_SMALL_INT)
+        return &small_ints[value - MIN_SMALL_INT];
     Obj *r = alloc(root, TINT, sizeof(long long));
     r->value = value;
     r->line_num = filepos.line_num;
     return r;
 }
 
+// Returns a new integer that a loop can update in place. It's in the heap, since its value goes out
+// of the range of the small integers, which must not change.
+static Obj *make_counter(void *root) {
+    return make_int(root, MAX_SMALL_INT + 1);
+}
+
 static Obj *cons(void *root, Obj **car, Obj **cdr) {
     Obj *cell = alloc(root, TCELL, sizeof(Obj *) * 2);
     cell->car = *car;
@@ -67,27 +297,79 @@ static Obj *make_symbol(void *root, char *name) {
     return sym;
 }
 
-static Obj *make_primitive(void *root, Primitive *fn) {
-    Obj *r = alloc(root, TPRIMITIVE, sizeof(Primitive *));
-    r->fn = fn;
+static Obj *make_primitive(void *root, char *name, int arity) {
+    Obj *r = alloc(root, TPRIMITIVE, sizeof(Primitive *) + sizeof(int) + sizeof(char *));
+    r->arity = arity;
+    r->prim_name = name;
     r->line_num = filepos.line_num;
     return r;
 }
 
+// Returns a new frame. It's open unless the caller knows that no define will add a variable to it.
+struct Obj *make_env(void *root, Obj **vars, Obj **up) {
+    Obj *r = alloc(root, TENV, offsetof(Obj, open) + sizeof(bool) - offsetof(Obj, vars));
+    r->vars = *vars;
+    r->up = *up;
+    r->open = true;
+    return r;
+}
+
+static Obj *reverse(Obj *p);
+
+// Moves the binding to the heap.
+static Obj *copy_binding(void *root, Obj **bind) {
+    DEFINE2(root, sym, val);
+    *sym = (*bind)->car;
+    *val = (*bind)->cdr;
+    return cons(root, sym, val);
+}
+
+// A frame on the C stack is released when its let form or function returns, so it must not be
+// captured. The compiler only puts a frame on the stack if its code cannot create a function, but
+// that can't be known for sure: a function called there may be redefined as a macro. In that
+// case, the frames on the stack are copied to the heap, along with the frames above them. The
+// bindings themselves are moved to the heap and shared by both copies, so that setq in either is
+// seen by the other. A variable defined in the frame after the copy is not.
+static Obj *promote_env(void *root, Obj **env) {
+    if (*env == Nil)
+        return Nil;
+    DEFINE4(root, up, vars, cell, bind);
+    *up = (*env)->up;
+    *up = promote_env(root, up);
+    if (in_heap(*env) && *up == (*env)->up)
+        return *env;
+    *vars = Nil;
+    for (*cell = (*env)->vars; *cell != Nil; *cell = (*cell)->cdr) {
+        *bind = (*cell)->car;
+        if (!in_heap(*bind)) {
+            *bind = copy_binding(root, bind);
+            (*cell)->car = *bind;
+        }
+        *vars = cons(root, bind, vars);
+    }
+    *vars = reverse(*vars);
+    bool open = (*env)->open;
+    Obj *r = make_env(root, vars, up);
+    r->open = open;
+    return r;
+}
+
 static Obj *make_function(void *root, Obj **env, int type, Obj **params, Obj **body) {
     assert(type == TFUNCTION || type == TMACRO);
-    Obj *r = alloc(root, type, sizeof(Obj *) * 3);
+    DEFINE1(root, fenv);
+    *fenv = promote_env(root, env);
+    Obj *r = alloc(root, type, offsetof(Obj, memo_epoch) + sizeof(long long) - offsetof(Obj, params));
     r->line_num = filepos.line_num;
     r->params = *params;
     r->body = *body;
-    r->env = *env;
-    return r;
-}
-
-struct Obj *make_env(void *root, Obj **vars, Obj **up) {
-    Obj *r = alloc(root, TENV, sizeof(Obj *) * 2);
-    r->vars = *vars;
-    r->up = *up;
+    r->env = *fenv;
+    r->calls = 0;
+    r->stack_frame = false;
+    r->open_frame = true;
+    r->pure = false;
+    r->code = NULL;
+    r->memo = NULL;
+    r->memo_epoch = -1;
     return r;
 }
 
@@ -175,6 +457,7 @@ static void skip_line(void) {
 
 // Reads a list. Note that '(' has already been read.
 static Obj *read_list(void *root) {
+    check_stack(filepos.line_num);
     DEFINE3(root, obj, head, last);
     *head = Nil;
     for (;;) {
@@ -207,10 +490,12 @@ static Obj *intern(void *root, char *name) {
     return *sym;
 }
 
-// Reader marcro ' (single quote). It reads an expression and returns (quote <expr>).
-static Obj *read_quote(void *root) {
+// Reader marcro ' (single quote). It reads an expression and returns (quote <expr>). The reader
+// macros ` (backquote), , (comma) and ,@ return (quasiquote <expr>), (unquote <expr>) and
+// (unquote-splicing <expr>) the same way.
+static Obj *read_quote(void *root, char *name) {
     DEFINE2(root, sym, tmp);
-    *sym = intern(root, "quote");
+    *sym = intern(root, name);
     *tmp = read_expr(root);
     *tmp = cons(root, tmp, &Nil);
     *tmp = cons(root, sym, tmp);
@@ -276,7 +561,15 @@ static Obj *read_expr(void *root) {
         if (c == '.')
             return Dot;
         if (c == '\'')
-            return read_quote(root);
+            return read_quote(root, "quote");
+        if (c == '`')
+            return read_quote(root, "quasiquote");
+        if (c == ',') {
+            if (peek() != '@')
+                return read_quote(root, "unquote");
+            read_char();
+            return read_quote(root, "unquote-splicing");
+        }
         if (c == '"')
             return read_string(root);
         if (isdigit(c))
@@ -294,8 +587,14 @@ static Obj *read_expr(void *root) {
 
 // Prints the given object.
 static void print(Obj *obj) {
+    check_stack(obj->line_num);
     switch (obj->type) {
     case TCELL:
+        // Compiled code is printed as it was written.
+        if (obj->car->type == TNODE) {
+            print(obj->cdr->car);
+            break;
+        }
         fputc('(', stdout);
         for (;;) {
             print(obj->car);
@@ -324,6 +623,14 @@ static void print(Obj *obj) {
         break;
     case TMOVED : fputs("<moved>", stdout);
         break;
+    case TNODE  : fputs("<node>", stdout);
+        break;
+    case TTABLE : fputs("<table>", stdout);
+        break;
+    case TGENERATOR : fputs("<generator>", stdout);
+        break;
+    case TPROMISE : fputs("<promise>", stdout);
+        break;
     case TTRUE  : fputc('t', stdout);
         break;
     case TNIL   : fputs("()", stdout);
@@ -384,6 +691,7 @@ static Obj *push_env(void *root, Obj **env, Obj **vars, Obj **vals) {
 // Evaluates the list elements from head and returns the last return value.
 static Obj *progn(void *root, Obj **env, Obj **list) {
     DEFINE2(root, lp, r);
+    *r = Nil;
     for (*lp = *list; *lp != Nil; *lp = (*lp)->cdr) {
         *r = (*lp)->car;
         *r = eval(root, env, r);
@@ -407,30 +715,245 @@ static bool is_list(Obj *obj) {
     return obj == Nil || obj->type == TCELL;
 }
 
-static Obj *apply_func(void *root, Obj **env, Obj **fn, Obj **args) {
-    DEFINE3(root, params, newenv, body);
-    *params = (*fn)->params;
-    *newenv = (*fn)->env;
-    *newenv = push_env(root, newenv, params, args);
+#ifndef MINILISP_NO_OPTIMIZE_HOT
+static void optimize_function(Obj *fn);
+#endif
+#ifndef MINILISP_NO_JIT
+static void jit_function(Obj *fn);
+static void init_jit(void);
+#endif
+
+// The maximum number of objects of a frame on the C stack. Larger frames are allocated in the heap.
+#define MAX_STACK_OBJECTS 65
+
+// Initializes an array of objects on the C stack, in which an environment frame is to be made.
+static void clear_objects(Obj *objs, unsigned n) {
+    for (unsigned i = 0; i < n; i++) {
+        objs[i].type = TCELL;
+        objs[i].size = sizeof(Obj);
+        objs[i].car = objs[i].cdr = Nil;
+    }
+}
+
+// Binds the symbol in the frame made in objs, using the binding cell and the list cell at index i.
+// The bindings are in the same order as push_env() makes them.
+static void bind_in_stack(Obj *objs, int i, Obj *sym, Obj *val) {
+    Obj *bind = &objs[i * 2 + 1], *cell = &objs[i * 2 + 2];
+    bind->car = sym;
+    bind->cdr = val;
+    cell->car = bind;
+    cell->cdr = objs[0].vars;
+    objs[0].vars = cell;
+}
+
+static Obj *run_body(void *root, Obj **fn, Obj **newenv) {
+    DEFINE1(root, body);
     *body = (*fn)->body;
+#ifndef MINILISP_NO_OPTIMIZE_HOT
+    if (optimize_hot && (*fn)->calls == HOT_THRESHOLD)
+        optimize_function(*fn);
+#endif
+#ifndef MINILISP_NO_JIT
+    if (jit && (*fn)->calls == JIT_THRESHOLD)
+        jit_function(*fn);
+#endif
+    // The values left by the arguments are not those of the function.
+    nvalues = 0;
     return progn(root, newenv, body);
 }
 
+// Evaluates the arguments into argv, which must be an array in a GC root frame.
+static void eval_args(void *root, Obj **env, Obj **list, Obj **argv, int nargs) {
+    DEFINE2(root, lp, expr);
+    *lp = *list;
+    for (int i = 0; i < nargs; i++, *lp = (*lp)->cdr) {
+        *expr = (*lp)->car;
+        argv[i] = eval(root, env, expr);
+    }
+}
+
+// Calls the native code of a function compiled by --compile-c. The arguments are evaluated, or
+// copied, into an array on the C stack registered as a root frame.
+static Obj *call_native(void *root, Obj **env, Obj **fn, Obj **args, bool evaluate) {
+    int nargs = length(*args);
+    if (nargs < 0)
+        error("argument must be a list", (*fn)->line_num);
+    if (nargs < length((*fn)->params))
+        error("Cannot apply function: number of argument does not match", (*fn)->line_num);
+    check_stack((*fn)->line_num);
+    void *frame[nargs + 2];
+    root = add_root_frame(root, nargs, frame);
+    Obj **argv = (Obj **)(frame + 1);
+    if (evaluate) {
+        eval_args(root, env, args, argv, nargs);
+    } else {
+        Obj *p = *args;
+        for (int i = 0; i < nargs; i++, p = p->cdr)
+            argv[i] = p->car;
+    }
+    return (*fn)->code(root, argv, nargs, (*fn)->line_num);
+}
+
+static bool may_capture_list(Obj **env, Obj *params, Obj *list);
+static bool may_define_list(Obj **env, Obj *params, Obj *list);
+
+// Applies the function to the arguments. If evaluate is true, the arguments are expressions,
+// which are evaluated in env. If the body of the function cannot capture the environment frame
+// of the call, the frame is made on the C stack, and the arguments are evaluated straight into
+// it, so that the call allocates nothing.
+//
+// The body is analyzed on the first call rather than when the function is created, because the
+// functions it calls, including itself, are usually not defined yet at that time. The frame is
+// open only if the body may define a variable in it (see "Closures").
+static Obj *call_body(void *root, Obj **env, Obj **fn, Obj **args, bool evaluate) {
+    if ((*fn)->code)
+        return call_native(root, env, fn, args, evaluate);
+    if ((*fn)->calls++ == 0) {
+        Obj *fenv = (*fn)->env;
+        (*fn)->stack_frame = !may_capture_list(&fenv, (*fn)->params, (*fn)->body);
+        (*fn)->open_frame = may_define_list(&fenv, (*fn)->params, (*fn)->body);
+    }
+    unsigned nparams = 0;
+    Obj *p = (*fn)->params;
+    for (; p->type == TCELL; p = p->cdr)
+        nparams++;
+    unsigned n = (nparams + (p != Nil)) * 2 + 1;
+    if (!(*fn)->stack_frame || n > MAX_STACK_OBJECTS) {
+        DEFINE3(root, params, vals, newenv);
+        *params = (*fn)->params;
+        *vals = evaluate ? eval_list(root, env, args) : *args;
+        *newenv = (*fn)->env;
+        *newenv = push_env(root, newenv, params, vals);
+        (*newenv)->open = (*fn)->open_frame;
+        return run_body(root, fn, newenv);
+    }
+    Obj objs[n];
+    clear_objects(objs, n);
+    void *frame[4];
+    root = add_stack_objects(root, objs, n, frame);
+    DEFINE4(root, params, lp, val, newenv);
+    objs[0].type = TENV;
+    objs[0].vars = Nil;
+    objs[0].up = (*fn)->env;
+    objs[0].open = (*fn)->open_frame;
+    int i = 0;
+    for (*params = (*fn)->params, *lp = *args; (*params)->type == TCELL;
+         *params = (*params)->cdr, *lp = (*lp)->cdr) {
+        if ((*lp)->type != TCELL)
+            error("Cannot apply function: number of argument does not match",
+                  (*params)->line_num);
+        *val = (*lp)->car;
+        if (evaluate)
+            *val = eval(root, env, val);
+        bind_in_stack(objs, i++, (*params)->car, *val);
+    }
+    if (*params != Nil) {
+        *val = evaluate ? eval_list(root, env, lp) : *lp;
+        bind_in_stack(objs, i, *params, *val);
+    } else if (evaluate) {
+        // Extra arguments are ignored, but still evaluated.
+        progn(root, env, lp);
+    }
+    *newenv = &objs[0];
+    return run_body(root, fn, newenv);
+}
+
+static Obj *call_memo(void *root, Obj **env, Obj **fn, Obj **args, bool evaluate);
+
+// Functions defined with defun-memo look up their cache first. The depth is not restored when an
+// error unwinds the call, but it is whenever the error is handled.
+static Obj *call_func(void *root, Obj **env, Obj **fn, Obj **args, bool evaluate) {
+    if (++call_depth > depth_limit)
+        error("Depth limit exceeded", (*fn)->line_num);
+    Obj *r = (*fn)->memo ? call_memo(root, env, fn, args, evaluate)
+        : call_body(root, env, fn, args, evaluate);
+    call_depth--;
+    return r;
+}
+
+static Obj *apply_func(void *root, Obj **env, Obj **fn, Obj **args) {
+    return call_func(root, env, fn, args, false);
+}
+
+static Subr prim_funcall, prim_apply, prim_values;
+
+// Returns r, the value of the primitive prim. The values left by a function it calls are not its
+// own, so they are cleared, except for funcall and apply, which return those of the function.
+static Obj *primitive_value(Obj *prim, Obj *r) {
+    if (prim->subr != prim_values && prim->subr != prim_funcall && prim->subr != prim_apply)
+        nvalues = 0;
+    return r;
+}
+
+// Applies a primitive. Special forms take the argument list as is. The arguments of the other
+// primitives are evaluated into an array on the C stack, which is registered as a GC root frame,
+// so that calling them doesn't allocate any list.
+static Obj *apply_primitive(void *root, Obj **env, Obj **prim, Obj **args, int line_num) {
+    int arity = (*prim)->arity;
+    if (arity == SPECIAL_FORM)
+        return (*prim)->fn(root, env, args);
+    int nargs = length(*args);
+    if (nargs < 0)
+        error("argument must be a list", line_num);
+    if (arity != VARIADIC && arity != nargs)
+        error("Wrong number of arguments to %s", line_num, (*prim)->prim_name);
+    if (arity == 1) {
+        DEFINE1(root, x);
+        eval_args(root, env, args, x, 1);
+        nvalues = 0;
+        return primitive_value(*prim, (*prim)->subr1(root, x, line_num));
+    }
+    if (arity == 2) {
+        DEFINE2(root, x, y);
+        eval_args(root, env, args, x, 2);
+        nvalues = 0;
+        return primitive_value(*prim, (*prim)->subr2(root, x, y, line_num));
+    }
+    check_stack(line_num);
+    void *frame[nargs + 2];
+    root = add_root_frame(root, nargs, frame);
+    Obj **argv = (Obj **)(frame + 1);
+    eval_args(root, env, args, argv, nargs);
+    nvalues = 0;
+    return primitive_value(*prim, (*prim)->subr(root, argv, nargs, line_num));
+}
+
 // Apply fn with args.
-static Obj *apply(void *root, Obj **env, Obj **fn, Obj **args) {
+static Obj *apply(void *root, Obj **env, Obj **fn, Obj **args, int line_num) {
     if (!is_list(*args))
-        error("argument must be a list", (*args)->line_num);
+        error("argument must be a list", line_num);
     if ((*fn)->type == TPRIMITIVE)
-        return (*fn)->fn(root, env, args);
-    if ((*fn)->type == TFUNCTION) {
-        DEFINE1(root, eargs);
-        *eargs = eval_list(root, env, args);
-        return apply_func(root, env, fn, eargs);
-    }
+        return apply_primitive(root, env, fn, args, line_num);
+    if ((*fn)->type == TFUNCTION)
+        return call_func(root, env, fn, args, true);
     error("not supported", (*args)->line_num);
     return Nil; //fix warning
 }
 
+// Calls fn with the arguments in argv, which have been evaluated already. argv must be in a root
+// frame.
+static Obj *call_values(void *root, Obj **fn, Obj **argv, int nargs, int line_num) {
+    if ((*fn)->type == TPRIMITIVE && (*fn)->arity != SPECIAL_FORM) {
+        int arity = (*fn)->arity;
+        if (arity != VARIADIC && arity != nargs)
+            error("Wrong number of arguments to %s", line_num, (*fn)->prim_name);
+        nvalues = 0;
+        if (arity == 1)
+            return primitive_value(*fn, (*fn)->subr1(root, argv, line_num));
+        if (arity == 2)
+            return primitive_value(*fn, (*fn)->subr2(root, argv, argv + 1, line_num));
+        return primitive_value(*fn, (*fn)->subr(root, argv, nargs, line_num));
+    }
+    if ((*fn)->type != TFUNCTION)
+        error("The head of a list must be a function", line_num);
+    DEFINE2(root, args, env);
+    *args = Nil;
+    for (int i = nargs - 1; i >= 0; i--)
+        *args = cons(root, &argv[i], args);
+    *env = Nil;
+    return apply_func(root, env, fn, args);
+}
+
 // Searches for a variable by symbol. Returns null if not found.
 static Obj *find(Obj **env, Obj *sym) {
     for (Obj *p = *env; p != Nil; p = p->up) { // search all environments
@@ -456,619 +979,5517 @@ static Obj *macroexpand(void *root, Obj **env, Obj **obj) {
     return apply_func(root, env, macro, args);
 }
 
-// Evaluates the S expression.
-static Obj *eval(void *root, Obj **env, Obj **obj) {
-    switch ((*obj)->type) {
-    case TINT:
-    case TPRIMITIVE:
-    case TFUNCTION:
-    case TTRUE:
-    case TSTRING:
-    case TNIL:
-        // Self-evaluating objects
-        return *obj;
-    case TSYMBOL: {
-        // Variable
-        Obj *bind = find(env, *obj);
-        if (!bind) {
-            error("Undefined symbol: %s", (*obj)->line_num, (*obj)->name);
-        }
-        return bind->cdr;
-    }
-    case TCELL: {
-        // Function application form
-        DEFINE3(root, fn, expanded, args);
-        *expanded = macroexpand(root, env, obj);
-        if (*expanded != *obj)
-            return eval(root, env, expanded);
-        *fn = (*obj)->car;
-        *fn = eval(root, env, fn);
-        *args = (*obj)->cdr;
-        if ((*fn)->type != TPRIMITIVE && (*fn)->type != TFUNCTION)
-            error("The head of a list must be a function", (*obj)->line_num);
-        return apply(root, env, fn, args);
-    }
-    default:
-        error("Bug: eval: Unknown tag type: %d", (*obj)->line_num, (*obj)->type);
-    }
-    return Nil; // fix warning
-}
-
 //======================================================================
-// Primitive functions and special forms
+// Compiler
+//
+// Evaluating a form straight from its S-expression is slow: every variable reference walks the
+// whole environment with find(), and every application looks up its head symbol twice, once to
+// check whether it's a macro and once to get the function. To avoid that, eval() compiles a form
+// in place the first time it evaluates it. The car of the form is replaced with a node handler,
+// which is a statically allocated object of type TNODE holding a C function, and the cdr with the
+// node's operands, whose variable references are resolved in advance. From then on, eval() just
+// calls the handler.
+//
+// An application form is compiled into
+//
+//   (<handler> original epoch . operands)
+//
+// The original form is kept so that the node can be reverted to it once the assumptions made at
+// compile time no longer hold: the compiled code caches the bindings of global variables and
+// assumes that global functions, macros and special forms stay what they were. Defining a
+// variable that's already bound or setting a variable whose value is a function, a macro or a
+// special form with setq bumps the epoch, and a node compiled in an older epoch reverts itself and
+// is compiled again by eval().
+//
+// Applications of global functions work as inline caches: the node remembers the function and
+// whether it's a primitive, so calling it involves no lookup and no type dispatch.
+//
+// Variable references and quoted objects among the operands are compiled into
+//
+//   (<gvar> symbol . binding)        a global variable. binding is the (symbol . value) cell.
+//   (<lvar> symbol depth . index)    a local variable at a fixed position in the environment.
+//   (<const> original . value)       a quoted object.
+//
+// These don't need to check the epoch themselves because they are only reached through the node
+// they are operands of. Forms that cannot be compiled, e.g. the ones whose head is a lambda
+// expression, are evaluated by eval() the usual way.
 //======================================================================
 
-// (list expr ...)
-static Obj *prim_list(void *root, Obj **env, Obj **list) {
-    DEFINE1(root, values);
-    *values = eval_list(root, env, list);  // Evaluate all arguments
-    return *values;                         // Return them as a list
-}
+static long long epoch = 0;
 
-// 'expr
-static Obj *prim_quote(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 1)
-        error("Malformed quote", (*list)->line_num);
-    return (*list)->car;
+static bool is_special_form(Obj *obj) {
+    return obj->type == TPRIMITIVE && obj->arity == SPECIAL_FORM;
 }
 
-static Obj *prim_atom(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 1)
-        error("atom takes ontly 1 argument", (*list)->line_num);
-    return ((*list)->car->type != TCELL) ? True : Nil;
+// Must be called before setq changes the value of a variable.
+static void invalidate_value(Obj *old) {
+    if (old->type == TMACRO || old->type == TFUNCTION || old->type == TPRIMITIVE)
+        epoch++;
 }
 
-// (cons expr expr)
-static Obj *prim_cons(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 2)
-        error("Malformed cons", (*list)->line_num);
-    Obj *cell = eval_list(root, env, list);
-    cell->cdr = cell->cdr->car;
-    return cell;
+// Must be called before a variable is defined. Redefining or shadowing a variable invalidates the
+// cached bindings.
+static void invalidate_binding(Obj **env, Obj *sym) {
+    if (find(env, sym))
+        epoch++;
 }
 
-// (car <cell>)
-static Obj *prim_car(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-    if (args->car->type != TCELL || args->cdr != Nil)
-        error("Malformed car", (*list)->line_num);
-    return args->car->car;
+static Obj *run_gvar(void *root, Obj **env, Obj **node);
+static Obj *run_lvar(void *root, Obj **env, Obj **node);
+static Obj *run_const(void *root, Obj **env, Obj **node);
+static Obj *run_call(void *root, Obj **env, Obj **node);
+static Obj *run_call_function(void *root, Obj **env, Obj **node);
+static Obj *run_call_primitive(void *root, Obj **env, Obj **node);
+static Obj *run_call_subr1(void *root, Obj **env, Obj **node);
+static Obj *run_call_subr2(void *root, Obj **env, Obj **node);
+static Obj *run_if(void *root, Obj **env, Obj **node);
+static Obj *run_special(void *root, Obj **env, Obj **node);
+static Obj *run_expanded(void *root, Obj **env, Obj **node);
+static Obj *run_let(void *root, Obj **env, Obj **node);
+static Obj *run_lambda(void *root, Obj **env, Obj **node);
+static Obj *run_case(void *root, Obj **env, Obj **node);
+static Obj *run_delay(void *root, Obj **env, Obj **node);
+static Obj *run_cons_stream(void *root, Obj **env, Obj **node);
+static Obj *run_quasiquote(void *root, Obj **env, Obj **node);
+static Obj *run_template_cons(void *root, Obj **env, Obj **node);
+static Obj *run_splice(void *root, Obj **env, Obj **node);
+
+static Obj *Gvar = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_gvar };
+static Obj *Lvar = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_lvar };
+static Obj *Const = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_const };
+static Obj *Call = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_call };
+static Obj *CallFunction = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_call_function };
+static Obj *CallPrimitive = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_call_primitive };
+static Obj *CallSubr1 = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_call_subr1 };
+static Obj *CallSubr2 = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_call_subr2 };
+static Obj *If = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_if };
+static Obj *Special = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_special };
+static Obj *Expanded = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_expanded };
+static Obj *Inlined = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_expanded };
+static Obj *Let = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_let };
+static Obj *Lambda = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_lambda };
+static Obj *Case = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_case };
+static Obj *Delay = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_delay };
+static Obj *ConsStream = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_cons_stream };
+static Obj *Quasiquote = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_quasiquote };
+static Obj *TemplateCons = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_template_cons };
+static Obj *Splice = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_splice };
+
+static bool inline_call(void *root, Obj **env, Obj **obj, Obj **fn);
+static bool is_let(Obj *fn);
+static bool is_loop(Obj *fn);
+static void compile_let(void *root, Obj **env, Obj **obj, Obj **fn);
+static void compile_lambda(void *root, Obj **env, Obj **obj);
+static bool compile_case(void *root, Obj **env, Obj **obj);
+static Obj *prim_case(void *root, Obj **env, Obj **list);
+static Obj *prim_lambda(void *root, Obj **env, Obj **list);
+static void compile_delay(void *root, Obj **env, Obj **obj, Obj **fn);
+static Obj *prim_multiple_value_bind(void *root, Obj **env, Obj **list);
+static void compile_mvb(void *root, Obj **env, Obj **obj);
+static void compile_loop(void *root, Obj **env, Obj **obj, Obj **fn);
+static Obj *prim_delay(void *root, Obj **env, Obj **list);
+static Obj *prim_cons_stream(void *root, Obj **env, Obj **list);
+static Obj *unquoted(Obj *tmpl, int *depth);
+static void compile_quasiquote(void *root, Obj **env, Obj **obj);
+static Obj *prim_quasiquote(void *root, Obj **env, Obj **list);
+
+static Obj *prim_quote(void *root, Obj **env, Obj **list);
+static Obj *prim_if(void *root, Obj **env, Obj **list);
+
+// Like find(), but also returns where the binding is. *depth is the number of frames to go up, or
+// -1 if the binding is in the global environment. *index is the position in the frame.
+static Obj *find_slot(Obj **env, Obj *sym, int *depth, int *index) {
+    *depth = 0;
+    for (Obj *p = *env; p != Nil; p = p->up, (*depth)++) {
+        *index = 0;
+        for (Obj *cell = p->vars; cell != Nil; cell = cell->cdr, (*index)++) {
+            if (sym == cell->car->car) {
+                if (p->up == Nil)
+                    *depth = -1;
+                return cell->car;
+            }
+        }
+    }
+    return NULL;
 }
 
-// (cdr <cell>)
-static Obj *prim_cdr(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-    if (args->car->type != TCELL || args->cdr != Nil)
-        error("Malformed cdr", (*list)->line_num);
-    return args->car->cdr;
+// Returns true if the symbol is one of the parameters of a function.
+static bool is_param(Obj *params, Obj *sym) {
+    for (; params->type == TCELL; params = params->cdr)
+        if (params->car == sym)
+            return true;
+    return params == sym;
 }
 
-// (setq <symbol> expr)
-static Obj *prim_setq(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 2 || (*list)->car->type != TSYMBOL)
-        error("Malformed setq", (*list)->line_num);
-    DEFINE2(root, bind, value);
-    *bind = find(env, (*list)->car);
-    if (!*bind)
-        error("Unbound variable %s", (*list)->line_num, (*list)->car->name);
-    *value = (*list)->cdr->car;
-    *value = eval(root, env, value);
-    (*bind)->cdr = *value;
-    return *value;
+static Obj *make_node(void *root, Obj *handler, Obj **original, Obj **operands) {
+    DEFINE2(root, node, tmp);
+    *tmp = cons(root, original, operands);
+    *node = handler;
+    return cons(root, node, tmp);
 }
 
-// (setcar <cell> expr)
-static Obj *prim_setcar(void *root, Obj **env, Obj **list) {
-    DEFINE1(root, args);
-    *args = eval_list(root, env, list);
-    if (length(*args) != 2 || (*args)->car->type != TCELL)
-        error("Malformed setcar", (*list)->line_num);
-    (*args)->car->car = (*args)->cdr->car;
-    return (*args)->car;
+// Compiles an expression appearing as an operand of a node.
+static Obj *compile_operand(void *root, Obj **env, Obj **obj) {
+    DEFINE2(root, tmp, val);
+    if ((*obj)->type == TSYMBOL) {
+        int depth, index;
+        Obj *bind = find_slot(env, *obj, &depth, &index);
+        // Unbound variables are left to eval(), which reports them if they are still undefined
+        // when evaluated.
+        if (!bind)
+            return *obj;
+        if (depth < 0) {
+            *tmp = bind;
+            return make_node(root, Gvar, obj, tmp);
+        }
+        *tmp = make_int(root, depth);
+        *val = make_int(root, index);
+        *tmp = cons(root, tmp, val);
+        return make_node(root, Lvar, obj, tmp);
+    }
+    if ((*obj)->type == TCELL && (*obj)->car->type == TSYMBOL && length(*obj) == 2) {
+        Obj *bind = find(env, (*obj)->car);
+        if (bind && is_special_form(bind->cdr) && bind->cdr->fn == prim_quote) {
+            *val = (*obj)->cdr->car;
+            return make_node(root, Const, obj, val);
+        }
+    }
+    return *obj;
 }
 
-// (while cond expr ...)
-static Obj *prim_while(void *root, Obj **env, Obj **list) {
-    if (length(*list) < 2)
-        error("Malformed while", (*list)->line_num);
-    DEFINE2(root, cond, exprs);
-    *cond = (*list)->car;
-    while (eval(root, env, cond) != Nil) {
-        *exprs = (*list)->cdr;
-        eval_list(root, env, exprs);
+// Returns a new list of the compiled elements of the list.
+static Obj *compile_list(void *root, Obj **env, Obj **list) {
+    DEFINE3(root, head, lp, expr);
+    *head = Nil;
+    for (*lp = *list; *lp != Nil; *lp = (*lp)->cdr) {
+        *expr = (*lp)->car;
+        *expr = compile_operand(root, env, expr);
+        *head = cons(root, expr, head);
     }
-    return Nil;
+    return reverse(*head);
 }
 
-// (gensym)
-static Obj *prim_gensym(void *root, Obj **env, Obj **list) {
-  static int count = 0;
-  char buf[10];
-  snprintf(buf, sizeof(buf), "G__%d", count++);
-  return make_symbol(root, buf);
+// Replaces the form with (<handler> original epoch . operands).
+static void compile_into(void *root, Obj **obj, Obj *handler, Obj **operands) {
+    DEFINE2(root, original, tmp);
+    *original = (*obj)->car;
+    *tmp = (*obj)->cdr;
+    *original = cons(root, original, tmp);
+    *tmp = make_int(root, epoch);
+    *tmp = cons(root, tmp, operands);
+    *tmp = cons(root, original, tmp);
+    (*obj)->car = handler;
+    (*obj)->cdr = *tmp;
 }
 
-// (length <cell> | length <string> | length ...)
-static Obj *prim_length(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-    int len = length(args);
-    if (len == 1) {
-        Obj *car = args->car;
-        if (car != Nil) { 
-            if (car->type == TSTRING) {
-                len = strlen(car->name);
-            }
-            else if (car->type == TCELL) {
-                for (len = 0; car != Nil && car->type == TCELL; car = car->cdr) 
-                    len++;
-            }
-            else {
-                error("When length has a single argument, it must be a list or a string", 
-                (*list)->line_num);
-            }
+// Compiles the application form in place. Returns false if the form is left as is.
+static bool compile(void *root, Obj **env, Obj **obj) {
+    if ((*obj)->car->type != TSYMBOL || length((*obj)->cdr) < 0)
+        return false;
+    int depth, index;
+    Obj *bind = find_slot(env, (*obj)->car, &depth, &index);
+    if (!bind)
+        return false;
+    DEFINE3(root, ops, tmp, fn);
+    *fn = bind->cdr;
+    if (is_special_form(*fn)) {
+        // Special forms bound to local variables are too unusual to bother with.
+        if (depth >= 0)
+            return false;
+        if (is_let(*fn)) {
+            compile_let(root, env, obj, fn);
+            return true;
         }
+        if ((*fn)->fn == prim_lambda) {
+            compile_lambda(root, env, obj);
+            return true;
+        }
+        if ((*fn)->fn == prim_case && compile_case(root, env, obj))
+            return true;
+        if (((*fn)->fn == prim_delay && length((*obj)->cdr) == 1)
+            || ((*fn)->fn == prim_cons_stream && length((*obj)->cdr) == 2)) {
+            compile_delay(root, env, obj, fn);
+            return true;
+        }
+        if ((*fn)->fn == prim_quasiquote && length((*obj)->cdr) == 1) {
+            compile_quasiquote(root, env, obj);
+            return true;
+        }
+        if ((*fn)->fn == prim_multiple_value_bind) {
+            compile_mvb(root, env, obj);
+            return true;
+        }
+        if (is_loop(*fn)) {
+            compile_loop(root, env, obj, fn);
+            return true;
+        }
+        if ((*fn)->fn == prim_if && length((*obj)->cdr) >= 2) {
+            // (<if> original epoch cond then . else)
+            *tmp = (*obj)->cdr->cdr->cdr;
+            *ops = compile_list(root, env, tmp);
+            *tmp = (*obj)->cdr->cdr->car;
+            *tmp = compile_operand(root, env, tmp);
+            *ops = cons(root, tmp, ops);
+            *tmp = (*obj)->cdr->car;
+            *tmp = compile_operand(root, env, tmp);
+            *ops = cons(root, tmp, ops);
+            compile_into(root, obj, If, ops);
+            return true;
+        }
+        // (<special> original epoch binding . args)
+        *ops = bind;
+        *tmp = (*obj)->cdr;
+        *ops = cons(root, ops, tmp);
+        compile_into(root, obj, Special, ops);
+        return true;
     }
-
-    return make_int(root, len);
+    if ((*fn)->type != TPRIMITIVE && (*fn)->type != TFUNCTION)
+        return false;
+    *tmp = (*obj)->cdr;
+    *ops = compile_list(root, env, tmp);
+    if (depth < 0 && (*fn)->type == TFUNCTION && inline_call(root, env, obj, fn))
+        return true;
+    if (depth < 0) {
+        // (<callf> original epoch fn . args) or (<callp> original epoch fn . args)
+        Obj *handler = CallFunction;
+        if ((*fn)->type == TPRIMITIVE) {
+            int nargs = length(*ops);
+            handler = ((*fn)->arity == 1 && nargs == 1) ? CallSubr1
+                : ((*fn)->arity == 2 && nargs == 2) ? CallSubr2
+                : CallPrimitive;
+        }
+        *ops = cons(root, fn, ops);
+        compile_into(root, obj, handler, ops);
+        return true;
+    }
+    // (<call> original epoch fn . args)
+    *tmp = (*obj)->car;
+    *tmp = compile_operand(root, env, tmp);
+    *ops = cons(root, tmp, ops);
+    compile_into(root, obj, Call, ops);
+    return true;
 }
 
-// (reverse ... | reverse <cell>)
-static Obj *prim_reverse(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-    int len = length(args);
-    if (len != 1) {
-        return reverse(args);
+// Returns a copy of the cons cells of the code, except for quoted objects and compiled nodes which
+// are shared. A macro may return the same list every time it's expanded, e.g. a quoted list. Since
+// the compiled code depends on the environment it's evaluated in, each expansion has to be
+// compiled separately.
+static Obj *copy_code(void *root, Obj **obj) {
+    if ((*obj)->type != TCELL || (*obj)->car->type == TNODE)
+        return *obj;
+    if ((*obj)->car->type == TSYMBOL && strcmp((*obj)->car->name, "quote") == 0)
+        return *obj;
+    DEFINE3(root, head, lp, expr);
+    *head = Nil;
+    for (*lp = *obj; (*lp)->type == TCELL; *lp = (*lp)->cdr) {
+        *expr = (*lp)->car;
+        *expr = copy_code(root, expr);
+        *head = cons(root, expr, head);
+    }
+    Obj *ret = reverse(*head);
+    (*head)->cdr = *lp;
+    ret->line_num = (*obj)->line_num;
+    return ret;
+}
+
+static bool is_stale(Obj *node) {
+    return node->cdr->cdr->car->value != epoch;
+}
+
+// Restores the original form of the node, and evaluates it.
+static Obj *revert(void *root, Obj **env, Obj **node) {
+    Obj *original = (*node)->cdr->car;
+    (*node)->car = original->car;
+    (*node)->cdr = original->cdr;
+    return eval(root, env, node);
+}
+
+static Obj *operands(Obj *node) {
+    return node->cdr->cdr->cdr;
+}
+
+// (<gvar> symbol . binding)
+static Obj *run_gvar(void *root, Obj **env, Obj **node) {
+    return (*node)->cdr->cdr->cdr;
+}
+
+// (<lvar> symbol depth . index)
+static Obj *run_lvar(void *root, Obj **env, Obj **node) {
+    Obj *sym = (*node)->cdr->car;
+    Obj *frame = *env;
+    for (long long depth = (*node)->cdr->cdr->car->value; depth > 0; depth--)
+        frame = frame->up;
+    Obj *cell = frame->vars;
+    for (long long index = (*node)->cdr->cdr->cdr->value; index > 0 && cell != Nil; index--)
+        cell = cell->cdr;
+    if (cell != Nil && cell->car->car == sym)
+        return cell->car->cdr;
+    // Variables defined in the frame after the node was compiled have shifted the binding.
+    return eval(root, env, &sym);
+}
+
+// (<const> original . value)
+static Obj *run_const(void *root, Obj **env, Obj **node) {
+    return (*node)->cdr->cdr;
+}
+
+// (<call> original epoch fn . args)
+static Obj *run_call(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE2(root, fn, args);
+    *fn = operands(*node)->car;
+    *fn = eval(root, env, fn);
+    *args = operands(*node)->cdr;
+    if ((*fn)->type == TFUNCTION)
+        return call_func(root, env, fn, args, true);
+    if ((*fn)->type == TPRIMITIVE && !is_special_form(*fn))
+        return apply_primitive(root, env, fn, args, (*node)->line_num);
+    // The variable has been set to something else than a function.
+    return revert(root, env, node);
+}
+
+// (<callf> original epoch fn . args)
+static Obj *run_call_function(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE2(root, fn, args);
+    *fn = operands(*node)->car;
+    *args = operands(*node)->cdr;
+    return call_func(root, env, fn, args, true);
+}
+
+// (<callp> original epoch fn . args)
+static Obj *run_call_primitive(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE2(root, fn, args);
+    *fn = operands(*node)->car;
+    *args = operands(*node)->cdr;
+    return apply_primitive(root, env, fn, args, (*node)->line_num);
+}
+
+// (<callp1> original epoch fn arg)
+static Obj *run_call_subr1(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE2(root, fn, x);
+    *fn = operands(*node)->car;
+    *x = operands(*node)->cdr->car;
+    *x = eval(root, env, x);
+    nvalues = 0;
+    return primitive_value(*fn, (*fn)->subr1(root, x, (*node)->line_num));
+}
+
+// (<callp2> original epoch fn arg arg)
+static Obj *run_call_subr2(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE3(root, fn, x, y);
+    *fn = operands(*node)->car;
+    *x = operands(*node)->cdr->car;
+    *y = operands(*node)->cdr->cdr->car;
+    *x = eval(root, env, x);
+    *y = eval(root, env, y);
+    nvalues = 0;
+    return primitive_value(*fn, (*fn)->subr2(root, x, y, (*node)->line_num));
+}
+
+// (<if> original epoch cond then . else)
+static Obj *run_if(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE2(root, expr, rest);
+    *expr = operands(*node)->car;
+    *rest = operands(*node)->cdr;
+    if (eval(root, env, expr) != Nil) {
+        *expr = (*rest)->car;
+        return eval(root, env, expr);
+    }
+    *expr = (*rest)->cdr;
+    return *expr == Nil ? Nil : progn(root, env, expr);
+}
+
+// (<special> original epoch binding . args)
+static Obj *run_special(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE1(root, args);
+    *args = operands(*node)->cdr;
+    return operands(*node)->car->cdr->fn(root, env, args);
+}
+
+// (<expanded> original epoch . expansion)
+//
+// A macro application form. Since a macro application always expands to the same code, it's
+// wasteful to run the macro every time the form is evaluated, e.g. in every iteration of a loop.
+// Instead, the expansion is cached in the node.
+static Obj *run_expanded(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE1(root, expansion);
+    *expansion = operands(*node);
+    return eval(root, env, expansion);
+}
+
+//======================================================================
+// Let
+//
+// let, let* and letrec bind local variables in a new environment frame without creating a
+// function:
+//
+//   (let ((var val) ...) body ...)     the vals are evaluated in the enclosing environment,
+//   (let* ((var val) ...) body ...)    each val is evaluated with the previous variables bound,
+//   (letrec ((var val) ...) body ...)  the vals are evaluated with all the variables bound, so
+//                                      that functions defined there can call each other.
+//
+// (let var val body ...) is the same as (let ((var val)) body ...).
+//
+// A let form is compiled into
+//
+//   (<let> original epoch mode bindings . body)
+//
+// where bindings is a list of (var . val). A frame can be referenced after the let form returns
+// only by the functions created in it. If the body creates no function, which is checked when
+// the form is compiled, mode includes STACK_FRAME and the frame and its bindings are allocated on
+// the C stack instead of the heap. It includes OPEN_FRAME if the body may define a variable in the
+// frame (see "Closures").
+//======================================================================
+
+enum { LET, LET_STAR, LETREC };
+
+#define STACK_FRAME 4
+#define OPEN_FRAME 8
+
+static Primitive prim_progn, prim_while, prim_setq, prim_define;
+static Primitive prim_let, prim_let_star, prim_letrec;
+static Primitive prim_and, prim_or, prim_when, prim_unless, prim_cond;
+static Primitive prim_dotimes, prim_dolist;
+static Primitive prim_declare, prim_catch;
+
+static bool is_let(Obj *fn) {
+    return fn->fn == prim_let || fn->fn == prim_let_star || fn->fn == prim_letrec;
+}
+
+// Returns true if the special form is a loop binding a variable, e.g. (dotimes (var n) expr ...).
+static bool is_loop(Obj *fn) {
+    return fn->fn == prim_dotimes || fn->fn == prim_dolist;
+}
+
+// Returns true if the special form evaluates its arguments as expressions, in some order and
+// some number of times, like if or and.
+static bool is_control(Obj *fn) {
+    return fn->fn == prim_if || fn->fn == prim_progn || fn->fn == prim_while
+        || fn->fn == prim_and || fn->fn == prim_or || fn->fn == prim_when
+        || fn->fn == prim_unless || fn->fn == prim_catch;
+}
+
+// Returns true if evaluating the code may create a function in the current environment, which
+// would keep a reference to the environment frame. Anything the compiler doesn't know, such as a
+// macro or an unbound function, may create one. params are the parameters of the function whose
+// body the code is in, if any. They are assumed to be bound to functions when applied.
+static bool may_capture_template(Obj **env, Obj *params, Obj *tmpl, int depth);
+
+static bool may_capture(Obj **env, Obj *params, Obj *code) {
+    if (code->type != TCELL)
+        return false;
+    check_stack(code->line_num);
+    if (code->car == Gvar || code->car == Lvar || code->car == Const)
+        return false;
+    if (code->car->type == TNODE)
+        return may_capture(env, params, code->cdr->car);
+    if (is_param(params, code->car))
+        return may_capture_list(env, params, code->cdr);
+    Obj *bind = code->car->type == TSYMBOL ? find(env, code->car) : NULL;
+    if (!bind)
+        return true;
+    Obj *fn = bind->cdr;
+    if (fn->type == TFUNCTION || (fn->type == TPRIMITIVE && !is_special_form(fn)))
+        return may_capture_list(env, params, code->cdr);
+    if (!is_special_form(fn))
+        return true;
+    if (fn->fn == prim_quote || fn->fn == prim_declare)
+        return false;
+    if (is_control(fn) || fn->fn == prim_setq || fn->fn == prim_define)
+        return may_capture_list(env, params, code->cdr);
+    if (fn->fn == prim_cond) {
+        for (Obj *p = code->cdr; p->type == TCELL; p = p->cdr)
+            if (may_capture_list(env, params, p->car))
+                return true;
+        return false;
+    }
+    if (is_let(fn) && code->cdr->type == TCELL) {
+        if (code->cdr->car->type == TSYMBOL)
+            return may_capture_list(env, params, code->cdr->cdr);
+        for (Obj *p = code->cdr->car; p->type == TCELL; p = p->cdr)
+            if (p->car->type == TCELL && may_capture_list(env, params, p->car->cdr))
+                return true;
+        return may_capture_list(env, params, code->cdr->cdr);
+    }
+    if (is_loop(fn) && code->cdr->type == TCELL && code->cdr->car->type == TCELL)
+        return may_capture_list(env, params, code->cdr->car->cdr)
+            || may_capture_list(env, params, code->cdr->cdr);
+    if (fn->fn == prim_case && code->cdr->type == TCELL) {
+        if (may_capture(env, params, code->cdr->car))
+            return true;
+        for (Obj *p = code->cdr->cdr; p->type == TCELL; p = p->cdr)
+            if (p->car->type == TCELL && may_capture_list(env, params, p->car->cdr))
+                return true;
+        return false;
+    }
+    if (fn->fn == prim_quasiquote && code->cdr->type == TCELL)
+        return may_capture_template(env, params, code->cdr->car, 1);
+    if (fn->fn == prim_multiple_value_bind && code->cdr->type == TCELL)
+        return may_capture_list(env, params, code->cdr->cdr);
+    return true;
+}
+
+static bool may_capture_list(Obj **env, Obj *params, Obj *list) {
+    for (; list->type == TCELL; list = list->cdr)
+        if (may_capture(env, params, list->car))
+            return true;
+    return false;
+}
+
+// Only the expressions a quasiquote template unquotes are evaluated.
+static bool may_capture_template(Obj **env, Obj *params, Obj *tmpl, int depth) {
+    if (tmpl->type != TCELL)
+        return false;
+    check_stack(tmpl->line_num);
+    Obj *expr = unquoted(tmpl, &depth);
+    if (expr)
+        return may_capture(env, params, expr);
+    return may_capture_template(env, params, tmpl->car, depth)
+        || may_capture_template(env, params, tmpl->cdr, depth);
+}
+
+// Returns true if evaluating the code may add a variable to the current environment frame, i.e.
+// evaluate a define, defun or defmacro form in it. The bodies of functions, let forms and loops run
+// in frames of their own, so only the expressions evaluated in the current frame count. Anything
+// the compiler doesn't know, such as a macro or an unbound function, may define one.
+static bool may_define_template(Obj **env, Obj *params, Obj *tmpl, int depth);
+
+static bool may_define(Obj **env, Obj *params, Obj *code) {
+    if (code->type != TCELL)
+        return false;
+    check_stack(code->line_num);
+    if (code->car == Gvar || code->car == Lvar || code->car == Const)
+        return false;
+    if (code->car->type == TNODE)
+        return may_define(env, params, code->cdr->car);
+    if (is_param(params, code->car))
+        return may_define_list(env, params, code->cdr);
+    Obj *bind = code->car->type == TSYMBOL ? find(env, code->car) : NULL;
+    if (!bind)
+        return true;
+    Obj *fn = bind->cdr;
+    if (fn->type == TFUNCTION || (fn->type == TPRIMITIVE && !is_special_form(fn)))
+        return may_define_list(env, params, code->cdr);
+    if (!is_special_form(fn))
+        return true;
+    if (fn->fn == prim_quote || fn->fn == prim_declare || fn->fn == prim_lambda)
+        return false;
+    if (is_control(fn) || fn->fn == prim_setq)
+        return may_define_list(env, params, code->cdr);
+    if (fn->fn == prim_cond) {
+        for (Obj *p = code->cdr; p->type == TCELL; p = p->cdr)
+            if (may_define_list(env, params, p->car))
+                return true;
+        return false;
+    }
+    if (is_let(fn) && code->cdr->type == TCELL) {
+        if (code->cdr->car->type == TSYMBOL)
+            return code->cdr->cdr->type == TCELL && may_define(env, params, code->cdr->cdr->car);
+        for (Obj *p = code->cdr->car; p->type == TCELL; p = p->cdr)
+            if (p->car->type == TCELL && may_define_list(env, params, p->car->cdr))
+                return true;
+        return false;
+    }
+    if (is_loop(fn) && code->cdr->type == TCELL && code->cdr->car->type == TCELL)
+        return code->cdr->car->cdr->type == TCELL
+            && may_define(env, params, code->cdr->car->cdr->car);
+    if (fn->fn == prim_case && code->cdr->type == TCELL) {
+        if (may_define(env, params, code->cdr->car))
+            return true;
+        for (Obj *p = code->cdr->cdr; p->type == TCELL; p = p->cdr)
+            if (p->car->type == TCELL && may_define_list(env, params, p->car->cdr))
+                return true;
+        return false;
+    }
+    if (fn->fn == prim_quasiquote && code->cdr->type == TCELL)
+        return may_define_template(env, params, code->cdr->car, 1);
+    if (fn->fn == prim_multiple_value_bind && code->cdr->type == TCELL)
+        return code->cdr->cdr->type == TCELL && may_define(env, params, code->cdr->cdr->car);
+    return true;
+}
+
+static bool may_define_list(Obj **env, Obj *params, Obj *list) {
+    for (; list->type == TCELL; list = list->cdr)
+        if (may_define(env, params, list->car))
+            return true;
+    return false;
+}
+
+static bool may_define_template(Obj **env, Obj *params, Obj *tmpl, int depth) {
+    if (tmpl->type != TCELL)
+        return false;
+    check_stack(tmpl->line_num);
+    Obj *expr = unquoted(tmpl, &depth);
+    if (expr)
+        return may_define(env, params, expr);
+    return may_define_template(env, params, tmpl->car, depth)
+        || may_define_template(env, params, tmpl->cdr, depth);
+}
+
+// Returns the bindings of the let form as a list of (var . val), and sets *body to its body.
+static Obj *let_bindings(void *root, Obj **list, Obj **body) {
+    if (length(*list) < 2)
+        error("Malformed let", (*list)->line_num);
+    DEFINE4(root, head, lp, var, val);
+    *head = Nil;
+    if ((*list)->car->type == TSYMBOL) {
+        // (let var val body ...)
+        if (length(*list) < 3)
+            error("Malformed let", (*list)->line_num);
+        *var = (*list)->car;
+        *val = (*list)->cdr->car;
+        *val = cons(root, var, val);
+        *body = (*list)->cdr->cdr;
+        return cons(root, val, head);
+    }
+    for (*lp = (*list)->car; *lp != Nil; *lp = (*lp)->cdr) {
+        Obj *b = (*lp)->type == TCELL ? (*lp)->car : Nil;
+        if (b->type != TCELL || b->car->type != TSYMBOL || (length(b) != 1 && length(b) != 2))
+            error("Malformed let", (*list)->line_num);
+        *var = b->car;
+        *val = b->cdr == Nil ? Nil : b->cdr->car;
+        *val = cons(root, var, val);
+        *head = cons(root, val, head);
+    }
+    *body = (*list)->cdr;
+    return reverse(*head);
+}
+
+// Binds the variable in the frame. If objs is not NULL, the binding is made of the objects at
+// index i of the array.
+static void let_bind(void *root, Obj **frame, Obj **var, Obj **val, Obj *objs, int i) {
+    if (!objs) {
+        add_variable(root, frame, var, val);
+        return;
+    }
+    bind_in_stack(objs, i, *var, *val);
+}
+
+// Returns a new environment frame. If objs is not NULL, it's an array of objects on the C stack,
+// registered as a root frame, in which the environment frame is made: the frame itself, then a
+// binding cell and a list cell for each variable.
+static Obj *let_frame(void *root, Obj **env, Obj *objs, bool open) {
+    Obj *r = objs ? &objs[0] : make_env(root, &Nil, env);
+    if (objs) {
+        objs[0].type = TENV;
+        objs[0].vars = Nil;
+        objs[0].up = *env;
+    }
+    r->open = open;
+    return r;
+}
+
+// Evaluates a let form. If objs is not NULL, the frame is made in it.
+static Obj *eval_let(void *root, Obj **env, int mode, Obj **bindings, Obj **body, Obj *objs) {
+    DEFINE4(root, frame, bp, var, val);
+    *frame = let_frame(root, env, objs, mode & OPEN_FRAME);
+    mode &= ~OPEN_FRAME;
+    int i = 0;
+    if (mode == LETREC) {
+        for (*bp = *bindings; *bp != Nil; *bp = (*bp)->cdr) {
+            *var = (*bp)->car->car;
+            let_bind(root, frame, var, &Nil, objs, i++);
+        }
+    }
+    for (*bp = *bindings; *bp != Nil; *bp = (*bp)->cdr) {
+        *var = (*bp)->car->car;
+        *val = (*bp)->car->cdr;
+        *val = eval(root, mode == LET ? env : frame, val);
+        if (mode != LETREC) {
+            let_bind(root, frame, var, val, objs, i++);
+            continue;
+        }
+        for (Obj *p = (*frame)->vars; p != Nil; p = p->cdr) {
+            if (p->car->car == *var) {
+                p->car->cdr = *val;
+                break;
+            }
+        }
+    }
+    return progn(root, frame, body);
+}
+
+static int let_mode(Obj *fn) {
+    return fn->fn == prim_let ? LET : fn->fn == prim_let_star ? LET_STAR : LETREC;
+}
+
+static void compile_let(void *root, Obj **env, Obj **obj, Obj **fn) {
+    DEFINE4(root, list, bindings, body, ops);
+    *list = (*obj)->cdr;
+    *bindings = let_bindings(root, list, body);
+    int mode = let_mode(*fn);
+    if (!may_capture_list(env, Nil, *bindings) && !may_capture_list(env, Nil, *body))
+        mode |= STACK_FRAME;
+    for (Obj *p = *bindings; !(mode & OPEN_FRAME) && p != Nil; p = p->cdr)
+        if (may_define(env, Nil, p->car->cdr))
+            mode |= OPEN_FRAME;
+    if (may_define_list(env, Nil, *body))
+        mode |= OPEN_FRAME;
+    *ops = cons(root, bindings, body);
+    *list = make_int(root, mode);
+    *ops = cons(root, list, ops);
+    compile_into(root, obj, Let, ops);
+}
+
+// (<let> original epoch mode bindings . body)
+static Obj *run_let(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE2(root, bindings, body);
+    int mode = operands(*node)->car->value;
+    *bindings = operands(*node)->cdr->car;
+    *body = operands(*node)->cdr->cdr;
+    unsigned n = length(*bindings) * 2 + 1;
+    if (!(mode & STACK_FRAME) || n > MAX_STACK_OBJECTS)
+        return eval_let(root, env, mode & ~STACK_FRAME, bindings, body, NULL);
+    Obj objs[n];
+    clear_objects(objs, n);
+    void *frame[4];
+    root = add_stack_objects(root, objs, n, frame);
+    return eval_let(root, env, mode & ~STACK_FRAME, bindings, body, objs);
+}
+
+//======================================================================
+// Multiple values
+//
+// (values expr ...) returns the value of its first argument, or () if there is none, so that it
+// can be used anywhere a single value is expected. The values of all its arguments are also left
+// in value_registers, a fixed array that is a GC root, and their number in nvalues, which
+// (multiple-value-bind (var ...) expr body ...) reads to bind each var to the corresponding value,
+// or to () if there are fewer values than variables. Nothing is allocated to return them.
+//
+// The registers are only meaningful right after the form returning them. eval clears nvalues
+// before evaluating anything, a function call clears it before running the body, and a primitive
+// clears it both before it's applied and when it returns, except for values, funcall and apply.
+// A form thus returns the values of the last form it evaluated, e.g. the body of a function, and
+// a single value otherwise. As a last check, the registers are used only if the first one holds the
+// primary value, so the code compiled by --compile-c, which does arithmetic without calling the
+// primitives, can't leave stale values behind.
+//
+// A multiple-value-bind form is compiled into
+//
+//   (<mvb> original epoch mode vars expr . body)
+//
+// where mode includes STACK_FRAME and OPEN_FRAME as for a let form.
+//======================================================================
+
+static Obj *run_mvb(void *root, Obj **env, Obj **node);
+
+static Obj *Mvb = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_mvb };
+
+// (values expr ...)
+static Obj *prim_values(void *root, Obj **args, int nargs, int line_num) {
+    if (nargs > MAX_VALUES)
+        error("values: too many values", line_num);
+    for (int i = 0; i < nargs; i++)
+        value_registers[i] = args[i];
+    nvalues = nargs;
+    return nargs ? args[0] : Nil;
+}
+
+static void check_mvb(Obj **list) {
+    if (length(*list) < 2 || length((*list)->car) < 0)
+        error("Malformed multiple-value-bind", (*list)->line_num);
+    for (Obj *p = (*list)->car; p != Nil; p = p->cdr)
+        if (p->car->type != TSYMBOL)
+            error("multiple-value-bind: variable must be a symbol", (*list)->line_num);
+}
+
+// Evaluates a multiple-value-bind form. If objs is not NULL, the frame is made in it.
+static Obj *eval_mvb(void *root, Obj **env, int mode, Obj **vars, Obj **expr, Obj **body,
+                     Obj *objs) {
+    DEFINE4(root, frame, vp, var, val);
+    *val = eval(root, env, expr);
+    if (nvalues == 0 || value_registers[0] != *val) {
+        value_registers[0] = *val;
+        nvalues = 1;
+    }
+    // The registers stay GC roots while the frame is made, since nothing is evaluated.
+    *frame = let_frame(root, env, objs, mode & OPEN_FRAME);
+    int i = 0;
+    for (*vp = *vars; *vp != Nil; *vp = (*vp)->cdr, i++) {
+        *var = (*vp)->car;
+        *val = i < nvalues ? value_registers[i] : Nil;
+        let_bind(root, frame, var, val, objs, i);
+    }
+    return progn(root, frame, body);
+}
+
+// (multiple-value-bind (<symbol> ...) expr expr ...)
+static Obj *prim_multiple_value_bind(void *root, Obj **env, Obj **list) {
+    check_mvb(list);
+    DEFINE3(root, vars, expr, body);
+    *vars = (*list)->car;
+    *expr = (*list)->cdr->car;
+    *body = (*list)->cdr->cdr;
+    return eval_mvb(root, env, OPEN_FRAME, vars, expr, body, NULL);
+}
+
+static void compile_mvb(void *root, Obj **env, Obj **obj) {
+    DEFINE2(root, list, ops);
+    *list = (*obj)->cdr;
+    check_mvb(list);
+    int mode = may_capture_list(env, Nil, (*list)->cdr) ? 0 : STACK_FRAME;
+    if (may_define_list(env, Nil, (*list)->cdr->cdr))
+        mode |= OPEN_FRAME;
+    *ops = make_int(root, mode);
+    *ops = cons(root, ops, list);
+    compile_into(root, obj, Mvb, ops);
+}
+
+static Obj *run_mvb(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE3(root, vars, expr, body);
+    int mode = operands(*node)->car->value;
+    *vars = operands(*node)->cdr->car;
+    *expr = operands(*node)->cdr->cdr->car;
+    *body = operands(*node)->cdr->cdr->cdr;
+    unsigned n = length(*vars) * 2 + 1;
+    if (!(mode & STACK_FRAME) || n > MAX_STACK_OBJECTS)
+        return eval_mvb(root, env, mode, vars, expr, body, NULL);
+    Obj objs[n];
+    clear_objects(objs, n);
+    void *frame[4];
+    root = add_stack_objects(root, objs, n, frame);
+    return eval_mvb(root, env, mode, vars, expr, body, objs);
+}
+
+bool optimize_hot = false;
+int safety = 1;
+
+static Subr prim_plus, prim_minus, prim_mult, prim_div, prim_modulo;
+static Subr1 prim_car, prim_cdr, prim_not, prim_atom;
+static Subr2 prim_num_eq, prim_lt, prim_lte, prim_gt, prim_gte, prim_eq;
+
+#ifndef MINILISP_NO_OPTIMIZE_HOT
+//======================================================================
+// Optimizer
+//
+// With --optimize-hot, a function is optimized once it has been called HOT_THRESHOLD times. By
+// then, the forms of its body that are actually run have been compiled. The nodes calling the
+// global arithmetic and comparison primitives with two arguments, and car and cdr, are switched to
+// handlers that do the operation inline when the arguments have the right type, instead of
+// calling the primitive with the arguments in an array. Arguments of any other type are passed to
+// the primitive, which reports the error. No machine code is generated: the function is still run
+// by the interpreter, with fewer calls and checks.
+//
+// The handlers take the same operands as the nodes they replace, so optimizing a function doesn't
+// allocate anything, and an optimized node reverts itself to the original form when it's stale
+// like any other node.
+//
+// The parameters declared with (declare (fixnum <symbol> ...)) at the start of the body are known
+// to hold integers, and so are integer literals and the sums, differences and products of
+// integers. The operations on arguments known to be integers don't check their types. With
+// --safety 1, the default, declare checks the values of the parameters on each call, and a
+// parameter is only trusted if everything the body may assign to it is known to be an integer.
+// With --safety 0, declarations are trusted, and declare does nothing.
+//======================================================================
+
+static Obj *run_fixnum(void *root, Obj **env, Obj **node);
+static Obj *run_unchecked(void *root, Obj **env, Obj **node);
+static Obj *run_cxr(void *root, Obj **env, Obj **node);
+
+static Obj *Fixnum = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_fixnum };
+static Obj *Unchecked = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_unchecked };
+static Obj *Cxr = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_cxr };
+
+#define MAX_FIXNUM_VARS 16
+
+static bool binds_list(Obj **env, Obj *list, Obj *sym);
+
+// The function being optimized, and those of its parameters that always hold integers
+static Obj *fixnum_fn;
+static Obj *fixnum_vars[MAX_FIXNUM_VARS];
+static int nfixnum_vars;
+
+static bool is_fixnum_op(Obj *fn) {
+    return fn->subr == prim_plus || fn->subr == prim_minus || fn->subr == prim_mult
+        || fn->subr2 == prim_num_eq || fn->subr2 == prim_lt || fn->subr2 == prim_lte
+        || fn->subr2 == prim_gt || fn->subr2 == prim_gte;
+}
+
+static bool is_fixnum_var(Obj *sym) {
+    for (int i = 0; i < nfixnum_vars; i++)
+        if (fixnum_vars[i] == sym)
+            return true;
+    return false;
+}
+
+static void remove_fixnum_var(Obj *sym) {
+    for (int i = 0; i < nfixnum_vars; i++)
+        if (fixnum_vars[i] == sym)
+            fixnum_vars[i] = fixnum_vars[--nfixnum_vars];
+}
+
+// Returns true if the variable may be bound in the body of the function being optimized, other
+// than as a parameter.
+static bool is_rebound(Obj *sym) {
+    Obj *env = fixnum_fn->env;
+    return binds_list(&env, fixnum_fn->body, sym);
+}
+
+// Returns true if the code, in the body of the function being optimized, always evaluates to an
+// integer.
+static bool is_fixnum(Obj *code) {
+    if (code->type == TINT)
+        return true;
+    if (code->type == TSYMBOL)
+        return is_fixnum_var(code);
+    if (code->type != TCELL || code->car == Gvar || code->car == Const)
+        return false;
+    if (code->car == Lvar)
+        return is_fixnum_var(code->cdr->car);
+    Obj *fn, *args;
+    if (code->car->type == TNODE) {
+        if (is_stale(code))
+            return false;
+        if (code->car == Expanded || code->car == Inlined)
+            return is_fixnum(operands(code));
+        if (code->car != Fixnum && code->car != Unchecked && code->car != CallPrimitive
+            && code->car != CallSubr2)
+            return false;
+        fn = operands(code)->car;
+        args = operands(code)->cdr;
+    } else {
+        if (!fixnum_fn || code->car->type != TSYMBOL || is_param(fixnum_fn->params, code->car)
+            || is_rebound(code->car))
+            return false;
+        Obj *bind = find(&fixnum_fn->env, code->car);
+        if (!bind)
+            return false;
+        fn = bind->cdr;
+        args = code->cdr;
+    }
+    return fn->type == TPRIMITIVE
+        && (fn->subr == prim_plus || fn->subr == prim_minus || fn->subr == prim_mult)
+        && length(args) == 2 && is_fixnum(args->car) && is_fixnum(args->cdr->car);
+}
+
+static bool check_assignments_list(Obj **env, Obj *list, bool *changed);
+
+// Stops trusting the parameters the code may set to something other than an integer, and sets
+// *changed if there are any. Returns false if the code may set variables in a way that can't be
+// seen, e.g. through a macro that has not been expanded yet.
+static bool check_assignments(Obj **env, Obj *code, bool *changed) {
+    if (code->type != TCELL || code->car == Lvar || code->car == Gvar || code->car == Const)
+        return true;
+    check_stack(code->line_num);
+    if (code->car->type == TNODE) {
+        if ((code->car == Expanded || code->car == Inlined) && !is_stale(code))
+            return check_assignments(env, operands(code), changed);
+        return check_assignments(env, code->cdr->car, changed);
+    }
+    Obj *bind = code->car->type == TSYMBOL && !is_param(fixnum_fn->params, code->car)
+        ? find(env, code->car) : NULL;
+    if (bind && bind->cdr->type == TMACRO)
+        return false;
+    if (bind && is_special_form(bind->cdr)) {
+        Obj *args = code->cdr;
+        if (bind->cdr->fn == prim_quote)
+            return true;
+        if (bind->cdr->fn == prim_setq && length(args) == 2 && is_fixnum_var(args->car)
+            && !is_fixnum(args->cdr->car)) {
+            remove_fixnum_var(args->car);
+            *changed = true;
+        }
+    }
+    return check_assignments_list(env, code, changed);
+}
+
+static bool check_assignments_list(Obj **env, Obj *list, bool *changed) {
+    for (; list->type == TCELL; list = list->cdr)
+        if (!check_assignments(env, list->car, changed))
+            return false;
+    return true;
+}
+
+// Returns the type specifiers of the declare form, or NULL if the code is not one.
+static Obj *declaration(Obj **env, Obj *code) {
+    if (code->type != TCELL || code->car == Lvar || code->car == Gvar || code->car == Const)
+        return NULL;
+    if (code->car->type == TNODE)
+        code = code->cdr->car;
+    if (code->car->type != TSYMBOL)
+        return NULL;
+    Obj *bind = find(env, code->car);
+    if (!bind || !is_special_form(bind->cdr) || bind->cdr->fn != prim_declare)
+        return NULL;
+    return code->cdr;
+}
+
+static void optimize_list(Obj *list);
+
+static void optimize_function(Obj *fn) {
+    Obj *env = fn->env;
+    fixnum_fn = fn;
+    nfixnum_vars = 0;
+    for (Obj *body = fn->body; body->type == TCELL; body = body->cdr) {
+        Obj *specs = declaration(&env, body->car);
+        if (!specs)
+            break;
+        for (; specs->type == TCELL; specs = specs->cdr) {
+            if (specs->car->type != TCELL)
+                continue;
+            for (Obj *p = specs->car->cdr; p->type == TCELL; p = p->cdr)
+                if (is_param(fn->params, p->car) && !is_rebound(p->car)
+                    && nfixnum_vars < MAX_FIXNUM_VARS)
+                    fixnum_vars[nfixnum_vars++] = p->car;
+        }
+    }
+    // Trusting a parameter may make other values integers, and so on, until nothing changes.
+    for (bool changed = true; safety > 0 && nfixnum_vars > 0 && changed; ) {
+        changed = false;
+        if (!check_assignments_list(&env, fn->body, &changed))
+            nfixnum_vars = 0;
+    }
+    optimize_list(fn->body);
+    fixnum_fn = NULL;
+    nfixnum_vars = 0;
+}
+
+static void optimize(Obj *obj) {
+    if (obj->type != TCELL)
+        return;
+    check_stack(obj->line_num);
+    Obj *handler = obj->car;
+    if (handler->type != TNODE) {
+        // Code that has not been run yet. The nodes in it may have been compiled, though, e.g. in
+        // the body of a local lambda.
+        if (handler->type == TSYMBOL && strcmp(handler->name, "quote") == 0)
+            return;
+        optimize_list(obj);
+        return;
+    }
+    if (handler == Gvar || handler == Lvar || handler == Const || is_stale(obj))
+        return;
+    Obj *ops = operands(obj);
+    if (handler == Expanded || handler == Inlined) {
+        optimize(ops);
+        return;
+    }
+    if (handler == Special) {
+        if (ops->car->cdr->fn != prim_quote)
+            optimize_list(ops->cdr);
+        return;
+    }
+    int nargs = length(ops->cdr);
+    // The arguments are optimized first, so that the types of their values are known.
+    optimize_list(ops);
+    if (handler == CallSubr1 && (ops->car->subr1 == prim_car || ops->car->subr1 == prim_cdr))
+        obj->car = Cxr;
+    else if ((handler == CallPrimitive || handler == CallSubr2) && nargs == 2
+             && is_fixnum_op(ops->car))
+        obj->car = is_fixnum(ops->cdr->car) && is_fixnum(ops->cdr->cdr->car) ? Unchecked : Fixnum;
+}
+
+static void optimize_list(Obj *list) {
+    for (; list->type == TCELL; list = list->cdr)
+        optimize(list->car);
+}
+
+static Obj *fixnum_op(void *root, Obj *fn, long long x, long long y) {
+    if (fn->subr == prim_plus)
+        return make_int(root, x + y);
+    if (fn->subr == prim_minus)
+        return make_int(root, x - y);
+    if (fn->subr == prim_mult)
+        return make_int(root, x * y);
+    if (fn->subr2 == prim_num_eq)
+        return x == y ? True : Nil;
+    if (fn->subr2 == prim_lt)
+        return x < y ? True : Nil;
+    if (fn->subr2 == prim_lte)
+        return x <= y ? True : Nil;
+    if (fn->subr2 == prim_gt)
+        return x > y ? True : Nil;
+    return x >= y ? True : Nil;
+}
+
+// (<fixnum> original epoch fn arg arg)
+static Obj *run_fixnum(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE1(root, fn);
+    void *frame[4];
+    root = add_root_frame(root, 2, frame);
+    Obj **args = (Obj **)(frame + 1);
+    *fn = operands(*node)->car;
+    args[0] = operands(*node)->cdr->car;
+    args[1] = operands(*node)->cdr->cdr->car;
+    args[0] = eval(root, env, &args[0]);
+    args[1] = eval(root, env, &args[1]);
+    if (args[0]->type == TINT && args[1]->type == TINT)
+        return fixnum_op(root, *fn, args[0]->value, args[1]->value);
+    if ((*fn)->arity == 2)
+        return (*fn)->subr2(root, &args[0], &args[1], (*node)->line_num);
+    return (*fn)->subr(root, args, 2, (*node)->line_num);
+}
+
+// (<unchecked> original epoch fn arg arg)
+//
+// A fixnum node whose arguments are known to be integers
+static Obj *run_unchecked(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE2(root, x, y);
+    *x = operands(*node)->cdr->car;
+    *y = operands(*node)->cdr->cdr->car;
+    *x = eval(root, env, x);
+    *y = eval(root, env, y);
+    return fixnum_op(root, operands(*node)->car, (*x)->value, (*y)->value);
+}
+
+// (<cxr> original epoch fn arg)
+static Obj *run_cxr(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE2(root, fn, x);
+    *fn = operands(*node)->car;
+    *x = operands(*node)->cdr->car;
+    *x = eval(root, env, x);
+    if ((*x)->type == TCELL)
+        return (*fn)->subr1 == prim_car ? (*x)->car : (*x)->cdr;
+    return (*fn)->subr1(root, x, (*node)->line_num);
+}
+#endif
+
+//======================================================================
+// Constant folding
+//
+// With -O1 or higher, the body of a function is simplified when the function is created. The
+// applications of arithmetic, comparison, eq, not and atom to constants are evaluated once and
+// replaced with
+//
+//   (<folded> original epoch . value)
+//
+// and an if whose condition is a constant is replaced with the branch that would be taken, in an
+// <expanded> node. Both depend on the global bindings of the primitives and of if, so they revert
+// to the original form when the epoch changes like compiled nodes do. Literals other than the
+// last expression of the body, such as documentation strings, are removed.
+//
+// Only the forms whose head is bound to a function or a primitive in the global environment, and
+// not shadowed by a parameter, are looked into. The arguments of macros and of special forms
+// other than if, progn, while, setq and define are left alone since we can't know what they mean.
+// Nested lambdas are folded when they are created.
+//======================================================================
+
+int optimize_level = 0;
+
+static Obj *run_folded(void *root, Obj **env, Obj **node);
+
+static Obj *Folded = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_folded };
+
+// Returns the global value of the head of the form, or NULL if it's not a global variable.
+static Obj *global_head(Obj **env, Obj *params, Obj *obj) {
+    Obj *sym = obj->car;
+    if (sym->type != TSYMBOL || is_param(params, sym) || length(obj->cdr) < 0)
+        return NULL;
+    int depth, index;
+    Obj *bind = find_slot(env, sym, &depth, &index);
+    return (bind && depth < 0) ? bind->cdr : NULL;
+}
+
+// Returns the value of the expression if it's a constant, or NULL.
+static Obj *constant_value(Obj **env, Obj *params, Obj *obj) {
+    switch (obj->type) {
+    case TINT:
+    case TSTRING:
+    case TNIL:
+        return obj;
+    case TCELL: {
+        if (obj->car == Folded)
+            return is_stale(obj) ? NULL : operands(obj);
+        if (obj->car->type == TNODE)
+            return NULL;
+        Obj *fn = global_head(env, params, obj);
+        if (fn && is_special_form(fn) && fn->fn == prim_quote && length(obj->cdr) == 1)
+            return obj->cdr->car;
+        return NULL;
+    }
+    default:
+        return NULL;
+    }
+}
+
+// Returns true if the primitive can be applied to the arguments at compile time. It must have no
+// side effect, and must not raise an error.
+static bool is_foldable(Obj *fn, Obj **args, int nargs) {
+    bool numeric = fn->subr == prim_plus || fn->subr == prim_minus || fn->subr == prim_mult
+        || fn->subr2 == prim_num_eq || fn->subr2 == prim_lt || fn->subr2 == prim_lte
+        || fn->subr2 == prim_gt || fn->subr2 == prim_gte;
+    if (numeric) {
+        if (nargs == 0 || (fn->arity != VARIADIC && fn->arity != nargs))
+            return false;
+        for (int i = 0; i < nargs; i++)
+            if (args[i]->type != TINT)
+                return false;
+        return true;
+    }
+    bool pure = fn->subr2 == prim_eq || fn->subr1 == prim_not || fn->subr1 == prim_atom;
+    return pure && fn->arity == nargs;
+}
+
+static void fold(void *root, Obj **env, Obj **params, Obj **obj);
+
+static void fold_list(void *root, Obj **env, Obj **params, Obj **list) {
+    DEFINE2(root, lp, expr);
+    for (*lp = *list; (*lp)->type == TCELL; *lp = (*lp)->cdr) {
+        *expr = (*lp)->car;
+        fold(root, env, params, expr);
+    }
+}
+
+// Folds the arguments of an application of a primitive, then the application itself.
+static void fold_call(void *root, Obj **env, Obj **params, Obj **obj, Obj **fn) {
+    DEFINE2(root, args, value);
+    *args = (*obj)->cdr;
+    fold_list(root, env, params, args);
+    int nargs = length(*args);
+    void *frame[nargs + 2];
+    root = add_root_frame(root, nargs, frame);
+    Obj **argv = (Obj **)(frame + 1);
+    for (int i = 0; i < nargs; i++, *args = (*args)->cdr)
+        if (!(argv[i] = constant_value(env, *params, (*args)->car)))
+            return;
+    if (!is_foldable(*fn, argv, nargs))
+        return;
+    int line_num = (*obj)->line_num;
+    if ((*fn)->arity == 1)
+        *value = (*fn)->subr1(root, &argv[0], line_num);
+    else if ((*fn)->arity == 2)
+        *value = (*fn)->subr2(root, &argv[0], &argv[1], line_num);
+    else
+        *value = (*fn)->subr(root, argv, nargs, line_num);
+    compile_into(root, obj, Folded, value);
+}
+
+// (if cond then else ...)
+static void fold_if(void *root, Obj **env, Obj **params, Obj **obj) {
+    DEFINE2(root, args, branch);
+    *args = (*obj)->cdr;
+    fold_list(root, env, params, args);
+    Obj *cond = constant_value(env, *params, (*args)->car);
+    if (!cond)
+        return;
+    if (cond != Nil) {
+        *branch = (*args)->cdr->car;
+    } else {
+        // An else part with several expressions would need a progn, which may be rebound.
+        *branch = (*args)->cdr->cdr;
+        if (*branch != Nil && (*branch)->cdr != Nil)
+            return;
+        if (*branch != Nil)
+            *branch = (*branch)->car;
+    }
+    compile_into(root, obj, Expanded, branch);
+}
+
+// (cond (cond expr ...) ...)
+static void fold_cond(void *root, Obj **env, Obj **params, Obj **clauses) {
+    DEFINE2(root, lp, clause);
+    for (*lp = *clauses; (*lp)->type == TCELL; *lp = (*lp)->cdr) {
+        *clause = (*lp)->car;
+        fold_list(root, env, params, clause);
+    }
+}
+
+static void fold(void *root, Obj **env, Obj **params, Obj **obj) {
+    if ((*obj)->type != TCELL || (*obj)->car->type == TNODE)
+        return;
+    check_stack((*obj)->line_num);
+    DEFINE2(root, fn, args);
+    *fn = global_head(env, *params, *obj);
+    if (!*fn)
+        return;
+    *args = (*obj)->cdr;
+    if ((*fn)->type == TFUNCTION) {
+        fold_list(root, env, params, args);
+        return;
+    }
+    if ((*fn)->type != TPRIMITIVE)
+        return;
+    if (!is_special_form(*fn)) {
+        fold_call(root, env, params, obj, fn);
+        return;
+    }
+    if ((*fn)->fn == prim_if && length(*args) >= 2) {
+        fold_if(root, env, params, obj);
+        return;
+    }
+    if (is_control(*fn)) {
+        fold_list(root, env, params, args);
+        return;
+    }
+    if ((*fn)->fn == prim_cond) {
+        fold_cond(root, env, params, args);
+        return;
+    }
+    if (((*fn)->fn == prim_setq || (*fn)->fn == prim_define) && length(*args) == 2) {
+        *args = (*args)->cdr;
+        fold_list(root, env, params, args);
+        return;
+    }
+    if (is_loop(*fn) && *args != Nil && (*args)->car->type == TCELL) {
+        *fn = (*args)->car->cdr;
+        fold_list(root, env, params, fn);
+        *args = (*args)->cdr;
+        fold_list(root, env, params, args);
+    }
+}
+
+static bool is_literal(Obj *obj) {
+    return obj->type == TINT || obj->type == TSTRING || obj == Nil;
+}
+
+// Simplifies the body of a function. Returns the new body.
+static Obj *fold_body(void *root, Obj **env, Obj **params, Obj **body) {
+    fold_list(root, env, params, body);
+    Obj *r = *body;
+    while (r->cdr != Nil && is_literal(r->car))
+        r = r->cdr;
+    for (Obj *p = r; p->cdr != Nil; ) {
+        if (p->cdr->cdr != Nil && is_literal(p->cdr->car))
+            p->cdr = p->cdr->cdr;
+        else
+            p = p->cdr;
+    }
+    return r;
+}
+
+//======================================================================
+// Inliner
+//
+// With -O2 or higher, an application of a small global function is replaced with the body of the
+// function, in which the parameters are substituted with the arguments:
+//
+//   (<inlined> original epoch . body)
+//
+// which is evaluated like an <expanded> node. This saves creating an environment frame and looking
+// up the variables in it. The substitution is only correct in a few cases, so a function is
+// inlined only if
+//
+//  - it's defined in the global environment and is not recursive, even through other functions,
+//  - its body is a single expression of at most inline_limit symbols and constants, made of
+//    applications of global functions and primitives, if, progn and quote,
+//  - the arguments are constants or variables, so that it doesn't matter how many times and in
+//    which order they are evaluated, and
+//  - the global variables it refers to are not shadowed at the call site.
+//
+// Redefining the function, or any global variable, reverts the inlined code to the original call.
+//======================================================================
+
+int inline_limit = 20;
+
+// The maximum number of functions looked into to find out whether a function is recursive
+#define INLINE_MAX_CALLEES 64
+
+// Returns a copy of the source code of the compiled code.
+static Obj *copy_source(void *root, Obj **obj) {
+    if ((*obj)->type != TCELL)
+        return *obj;
+    if ((*obj)->car->type == TNODE) {
+        // The original of <gvar> and <lvar> is the symbol, of <const> the quote form.
+        DEFINE1(root, original);
+        *original = (*obj)->cdr->car;
+        return copy_source(root, original);
+    }
+    if ((*obj)->car->type == TSYMBOL && strcmp((*obj)->car->name, "quote") == 0)
+        return *obj;
+    DEFINE3(root, head, lp, expr);
+    *head = Nil;
+    for (*lp = *obj; (*lp)->type == TCELL; *lp = (*lp)->cdr) {
+        *expr = (*lp)->car;
+        *expr = copy_source(root, expr);
+        *head = cons(root, expr, head);
+    }
+    Obj *ret = reverse(*head);
+    (*head)->cdr = *lp;
+    ret->line_num = (*obj)->line_num;
+    return ret;
+}
+
+// Returns true if the form, whose head is known to be bound globally, is a quote form.
+static bool is_quote(Obj **env, Obj *form) {
+    Obj *fn = find(env, form->car)->cdr;
+    return is_special_form(fn) && fn->fn == prim_quote;
+}
+
+// Returns true if fn is one of the functions the code may call, directly or indirectly.
+static bool reaches(Obj **env, Obj *code, Obj *fn, Obj **seen, int *nseen) {
+    check_stack(code->line_num);
+    if (code->type == TSYMBOL) {
+        Obj *bind = find(env, code);
+        return bind && reaches(env, bind->cdr, fn, seen, nseen);
+    }
+    if (code->type == TFUNCTION) {
+        if (code == fn)
+            return true;
+        for (int i = 0; i < *nseen; i++)
+            if (seen[i] == code)
+                return false;
+        // Give up and assume it's recursive.
+        if (*nseen == INLINE_MAX_CALLEES)
+            return true;
+        seen[(*nseen)++] = code;
+        return reaches(env, code->body, fn, seen, nseen);
+    }
+    if (code->type != TCELL)
+        return false;
+    if (code->car == Const)
+        return false;
+    if (code->car->type == TNODE)
+        return reaches(env, code->cdr->car, fn, seen, nseen);
+    if (code->car->type == TSYMBOL && strcmp(code->car->name, "quote") == 0)
+        return false;
+    for (; code->type == TCELL; code = code->cdr)
+        if (reaches(env, code->car, fn, seen, nseen))
+            return true;
+    return reaches(env, code, fn, seen, nseen);
+}
+
+// Returns true if the source code can be inlined at the call site, and adds its size to *size.
+static bool can_inline(Obj **env, Obj *params, Obj *code, bool is_head, int *size) {
+    (*size)++;
+    switch (code->type) {
+    case TINT:
+    case TSTRING:
+    case TNIL:
+        return !is_head;
+    case TSYMBOL: {
+        if (is_param(params, code))
+            return !is_head;
+        int depth, index;
+        Obj *bind = find_slot(env, code, &depth, &index);
+        if (!bind || depth >= 0)
+            return false;
+        Obj *fn = bind->cdr;
+        if (!is_head || fn->type == TFUNCTION)
+            return true;
+        return fn->type == TPRIMITIVE && (!is_special_form(fn) || is_control(fn)
+                                          || fn->fn == prim_quote);
+    }
+    case TCELL: {
+        if (is_head || length(code) < 0 || !can_inline(env, params, code->car, true, size))
+            return false;
+        // Quoted objects are not looked into.
+        if (is_quote(env, code))
+            return true;
+        for (Obj *p = code->cdr; p != Nil; p = p->cdr)
+            if (!can_inline(env, params, p->car, false, size) || *size > inline_limit)
+                return false;
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+static bool is_trivial(Obj **env, Obj *obj) {
+    if (obj->type == TINT || obj->type == TSTRING || obj->type == TSYMBOL || obj == Nil)
+        return true;
+    if (obj->type != TCELL || obj->car->type != TSYMBOL || length(obj) != 2)
+        return false;
+    int depth, index;
+    Obj *bind = find_slot(env, obj->car, &depth, &index);
+    return bind && depth < 0 && is_special_form(bind->cdr) && bind->cdr->fn == prim_quote;
+}
+
+// Replaces the parameters in the code with the arguments.
+static void substitute(Obj **env, Obj *code, Obj *params, Obj *args) {
+    if (is_quote(env, code))
+        return;
+    for (Obj *p = code->cdr; p != Nil; p = p->cdr) {
+        if (p->car->type == TCELL) {
+            substitute(env, p->car, params, args);
+            continue;
+        }
+        Obj *a = args;
+        for (Obj *q = params; q != Nil; q = q->cdr, a = a->cdr) {
+            if (p->car == q->car) {
+                p->car = a->car;
+                break;
+            }
+        }
+    }
+}
+
+// Compiles the application of a global function into an <inlined> node if possible.
+static bool inline_call(void *root, Obj **env, Obj **obj, Obj **fn) {
+    if (optimize_level < 2 || (*fn)->env->up != Nil || (*fn)->body->cdr != Nil
+        || (*fn)->memo)
+        return false;
+    int nargs = length((*obj)->cdr);
+    if (length((*fn)->params) != nargs)
+        return false;
+    for (Obj *p = (*obj)->cdr; p != Nil; p = p->cdr)
+        if (!is_trivial(env, p->car))
+            return false;
+    Obj *seen[INLINE_MAX_CALLEES];
+    int nseen = 0;
+    if (reaches(&(*fn)->env, (*fn)->body, *fn, seen, &nseen))
+        return false;
+    DEFINE3(root, body, params, args);
+    *body = (*fn)->body->car;
+    *body = copy_source(root, body);
+    int size = 0;
+    if (!can_inline(env, (*fn)->params, *body, false, &size) || size > inline_limit)
+        return false;
+    *params = (*fn)->params;
+    *args = (*obj)->cdr;
+    if ((*body)->type == TCELL) {
+        substitute(env, *body, *params, *args);
+    } else {
+        // A function returning one of its parameters or a constant.
+        for (Obj *p = *params, *a = *args; p != Nil; p = p->cdr, a = a->cdr) {
+            if (*body == p->car) {
+                *body = a->car;
+                break;
+            }
+        }
+    }
+    compile_into(root, obj, Inlined, body);
+    return true;
+}
+
+// (<folded> original epoch . value)
+static Obj *run_folded(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    return operands(*node);
+}
+
+// Evaluates the S expression.
+static Obj *eval(void *root, Obj **env, Obj **obj) {
+    nvalues = 0;
+    switch ((*obj)->type) {
+    case TINT:
+    case TPRIMITIVE:
+    case TFUNCTION:
+    case TTRUE:
+    case TSTRING:
+    case TNIL:
+        // Self-evaluating objects
+        return *obj;
+    case TSYMBOL: {
+        // Variable
+        Obj *bind = find(env, *obj);
+        if (!bind) {
+            error("Undefined symbol: %s", (*obj)->line_num, (*obj)->name);
+        }
+        return bind->cdr;
+    }
+    case TCELL: {
+        check_stack((*obj)->line_num);
+        count_step((*obj)->line_num);
+        // Compiled code
+        if ((*obj)->car->type == TNODE)
+            return (*obj)->car->fn(root, env, obj);
+        // Function application form
+        DEFINE3(root, fn, expanded, args);
+        *expanded = macroexpand(root, env, obj);
+        if (*expanded != *obj) {
+            *expanded = copy_code(root, expanded);
+            compile_into(root, obj, Expanded, expanded);
+            return eval(root, env, obj);
+        }
+        if (compile(root, env, obj))
+            return eval(root, env, obj);
+        *fn = (*obj)->car;
+        *fn = eval(root, env, fn);
+        *args = (*obj)->cdr;
+        if ((*fn)->type != TPRIMITIVE && (*fn)->type != TFUNCTION)
+            error("The head of a list must be a function", (*obj)->line_num);
+        return apply(root, env, fn, args, (*obj)->line_num);
+    }
+    default:
+        error("Bug: eval: Unknown tag type: %d", (*obj)->line_num, (*obj)->type);
+    }
+    return Nil; // fix warning
+}
+
+//======================================================================
+// Closures
+//
+// A function needs the environment it's created in, so that its body can refer to the local
+// variables there. Keeping the whole chain of frames would retain every variable of every
+// enclosing frame, and lookups from the body would walk all of them. Instead, a function created
+// in a local environment gets a single frame holding the bindings of the local variables its
+// body refers to, right above the global frame. The bindings are shared with the frames they
+// come from, so they act as boxes: setq on a variable is seen both by the function and by the
+// code around it.
+//
+// This is only done if every variable the body refers to is known when the function is created:
+// a local or global variable, or one the function binds itself. Otherwise, e.g. if the body calls
+// a macro, whose expansion may refer to anything, or a local function defined afterwards, the
+// function keeps the whole environment.
+//
+// A variable defined in an enclosing frame after the function is created, e.g. with the name of a
+// global variable the function refers to, must still be seen by it. A frame whose code may
+// evaluate a define in it, which is found when the code is analyzed for a stack frame, is marked
+// open. The function's frame is put right above the innermost open frame instead, so that only
+// the frames from there up are kept. The define bumps the epoch, so the compiled body resolves
+// the name again.
+//
+// Finding the free variables of the body takes a walk over it, which would make creating a
+// function much slower than allocating it. A lambda form is therefore compiled into
+//
+//   (<lambda> original epoch free params . body)
+//
+// where free is the list of the local variables the body refers to, or t if the function keeps
+// the whole environment.
+//======================================================================
+
+static Primitive prim_defun, prim_defmacro, prim_macroexpand, prim_load;
+
+// Returns the special form the head of the form refers to, or NULL.
+static Obj *special_head(Obj **env, Obj *form) {
+    if (form->car->type != TSYMBOL)
+        return NULL;
+    Obj *bind = find(env, form->car);
+    return bind && is_special_form(bind->cdr) ? bind->cdr : NULL;
+}
+
+static bool binds_list(Obj **env, Obj *list, Obj *sym);
+static bool binds_template(Obj **env, Obj *tmpl, Obj *sym, int depth);
+
+// Returns true if the code binds the symbol somewhere, as a parameter, a let variable or with
+// define.
+static bool binds(Obj **env, Obj *code, Obj *sym) {
+    if (code->type != TCELL)
+        return false;
+    check_stack(code->line_num);
+    if (code->car->type == TNODE)
+        return binds(env, code->cdr->car, sym);
+    Obj *fn = special_head(env, code);
+    if (fn && fn->fn == prim_quote)
+        return false;
+    if (fn && fn->fn == prim_quasiquote)
+        return code->cdr->type == TCELL && binds_template(env, code->cdr->car, sym, 1);
+    if (fn && code->cdr->type == TCELL) {
+        Obj *arg = code->cdr->car;
+        if (fn->fn == prim_lambda && is_param(arg, sym))
+            return true;
+        if ((fn->fn == prim_defun || fn->fn == prim_defmacro || fn->fn == prim_define)
+            && arg == sym)
+            return true;
+        if ((fn->fn == prim_defun || fn->fn == prim_defmacro) && code->cdr->cdr->type == TCELL
+            && is_param(code->cdr->cdr->car, sym))
+            return true;
+        if (is_let(fn)) {
+            if (arg == sym)
+                return true;
+            for (; arg->type == TCELL; arg = arg->cdr)
+                if (arg->car->type == TCELL && arg->car->car == sym)
+                    return true;
+        }
+        if (is_loop(fn) && arg->type == TCELL && arg->car == sym)
+            return true;
+        if (fn->fn == prim_multiple_value_bind && is_param(arg, sym))
+            return true;
+    }
+    return binds_list(env, code, sym);
+}
+
+static bool binds_list(Obj **env, Obj *list, Obj *sym) {
+    for (; list->type == TCELL; list = list->cdr)
+        if (binds(env, list->car, sym))
+            return true;
+    return false;
+}
+
+static bool binds_template(Obj **env, Obj *tmpl, Obj *sym, int depth) {
+    if (tmpl->type != TCELL)
+        return false;
+    check_stack(tmpl->line_num);
+    Obj *expr = unquoted(tmpl, &depth);
+    if (expr)
+        return binds(env, expr, sym);
+    return binds_template(env, tmpl->car, sym, depth) || binds_template(env, tmpl->cdr, sym, depth);
+}
+
+static bool is_closed_template(Obj **env, Obj *params, Obj *body, Obj *tmpl, int depth);
+
+// Returns true if every variable the code refers to is either bound in the environment, or a
+// parameter of the function, or bound by its body.
+static bool is_closed(Obj **env, Obj *params, Obj *body, Obj *code) {
+    if (code->type == TSYMBOL)
+        return find(env, code) || is_param(params, code) || binds_list(env, body, code);
+    if (code->type != TCELL)
+        return true;
+    check_stack(code->line_num);
+    if (code->car->type == TNODE)
+        return is_closed(env, params, body, code->cdr->car);
+    if (code->car->type == TSYMBOL) {
+        Obj *bind = find(env, code->car);
+        if (bind && bind->cdr->type == TMACRO)
+            return false;
+        Obj *fn = bind ? bind->cdr : Nil;
+        if (is_special_form(fn) && fn->fn == prim_quote)
+            return true;
+        // The type names of a declare form are not variables.
+        if (is_special_form(fn) && fn->fn == prim_declare) {
+            for (Obj *p = code->cdr; p->type == TCELL; p = p->cdr)
+                if (p->car->type == TCELL && !is_closed(env, params, body, p->car->cdr))
+                    return false;
+            return true;
+        }
+        if (is_special_form(fn) && (fn->fn == prim_macroexpand || fn->fn == prim_load))
+            return false;
+        // The keys of a case form are not variables.
+        if (is_special_form(fn) && fn->fn == prim_case && code->cdr->type == TCELL) {
+            if (!is_closed(env, params, body, code->cdr->car))
+                return false;
+            for (Obj *p = code->cdr->cdr; p->type == TCELL; p = p->cdr)
+                if (p->car->type == TCELL && !is_closed(env, params, body, p->car->cdr))
+                    return false;
+            return true;
+        }
+        // Neither are the constant parts of a quasiquote template.
+        if (is_special_form(fn) && fn->fn == prim_quasiquote && code->cdr->type == TCELL)
+            return is_closed_template(env, params, body, code->cdr->car, 1);
+    }
+    for (; code->type == TCELL; code = code->cdr)
+        if (!is_closed(env, params, body, code->car))
+            return false;
+    return is_closed(env, params, body, code);
+}
+
+static bool is_closed_template(Obj **env, Obj *params, Obj *body, Obj *tmpl, int depth) {
+    if (tmpl->type != TCELL)
+        return true;
+    check_stack(tmpl->line_num);
+    Obj *expr = unquoted(tmpl, &depth);
+    if (expr)
+        return is_closed(env, params, body, expr);
+    return is_closed_template(env, params, body, tmpl->car, depth)
+        && is_closed_template(env, params, body, tmpl->cdr, depth);
+}
+
+// Returns true if the symbol appears in the code.
+static bool occurs(Obj *code, Obj *sym) {
+    if (code == sym)
+        return true;
+    if (code->type != TCELL)
+        return false;
+    check_stack(code->line_num);
+    if (code->car->type == TNODE)
+        return occurs(code->cdr->car, sym);
+    for (; code->type == TCELL; code = code->cdr)
+        if (occurs(code->car, sym))
+            return true;
+    return code == sym;
+}
+
+// Returns the list of the local variables of env that the body of a function created there refers
+// to, or t if the function has to keep the whole environment.
+static Obj *free_variables(void *root, Obj **env, Obj **params, Obj **body) {
+    if ((*env)->up == Nil || !is_closed(env, *params, *body, *body))
+        return True;
+    DEFINE4(root, syms, frame, cell, sym);
+    *syms = Nil;
+    for (*frame = *env; (*frame)->up != Nil; *frame = (*frame)->up) {
+        for (*cell = (*frame)->vars; *cell != Nil; *cell = (*cell)->cdr) {
+            *sym = (*cell)->car->car;
+            if (!is_param(*params, *sym) && !is_param(*syms, *sym) && occurs(*body, *sym))
+                *syms = cons(root, sym, syms);
+        }
+    }
+    return *syms;
+}
+
+// Returns the environment of a function created in env, given its free variables.
+static Obj *closure_env(void *root, Obj **env, Obj **free) {
+    if (*free == True)
+        return *env;
+    DEFINE4(root, vars, sp, frame, bind);
+    *vars = Nil;
+    for (*sp = *free; *sp != Nil; *sp = (*sp)->cdr) {
+        Obj *cell = Nil;
+        for (*frame = *env; cell == Nil && (*frame)->up != Nil; *frame = (*frame)->up)
+            for (cell = (*frame)->vars; cell != Nil; cell = cell->cdr)
+                if (cell->car->car == (*sp)->car)
+                    break;
+        if (cell == Nil)
+            continue; // Not defined yet, so it's in an open frame
+        *bind = cell->car;
+        if (!in_heap(*bind)) {
+            // The binding is in a frame on the C stack, and so is the cell referring to it. Move
+            // the binding to the heap.
+            *bind = copy_binding(root, bind);
+            cell->car = *bind;
+        }
+        *vars = cons(root, bind, vars);
+    }
+    for (*frame = *env; (*frame)->up != Nil && !(*frame)->open; *frame = (*frame)->up)
+        ;
+    Obj *r = make_env(root, vars, frame);
+    r->open = false;
+    return r;
+}
+
+static Obj *handle_function(void *root, Obj **env, Obj **list, int type, Obj **free);
+
+static void compile_lambda(void *root, Obj **env, Obj **obj) {
+    DEFINE3(root, params, body, ops);
+    *ops = (*obj)->cdr;
+    if (length(*ops) < 2 || !is_list((*ops)->car)) {
+        *params = True;
+    } else {
+        *params = (*ops)->car;
+        *body = (*ops)->cdr;
+        *params = free_variables(root, env, params, body);
+    }
+    *ops = cons(root, params, ops);
+    compile_into(root, obj, Lambda, ops);
+}
+
+// (<lambda> original epoch free params . body)
+static Obj *run_lambda(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE2(root, free, list);
+    *free = operands(*node)->car;
+    *list = operands(*node)->cdr;
+    return handle_function(root, env, list, TFUNCTION, free);
+}
+
+//======================================================================
+// Case
+//
+//   (case key
+//     ((k1 k2 ...) expr ...)
+//     (k expr ...)
+//     (otherwise expr ...))
+//
+// evaluates key, then the body of the first clause that lists its value. The keys are integers,
+// symbols or strings, which are not evaluated. Integers and strings are compared by value, and
+// symbols by identity. The last clause can be written (t expr ...) or (otherwise expr ...) to
+// match anything. case returns () if no clause matches.
+//
+// Testing the keys one by one would take time proportional to the number of clauses. Instead, a
+// case form is compiled into
+//
+//   (<case> original epoch key table . default)
+//
+// where table is a hash table from the keys to the bodies of their clauses, and default the body
+// of the otherwise clause.
+//======================================================================
+
+static bool is_case_key(Obj *obj) {
+    return obj->type == TINT || obj->type == TSYMBOL || obj->type == TSTRING;
+}
+
+static bool is_otherwise(Obj *keys) {
+    return keys->type == TSYMBOL
+        && (strcmp(keys->name, "t") == 0 || strcmp(keys->name, "otherwise") == 0);
+}
+
+// Checks the form of the case clauses. Returns the number of keys, or -1 if they are malformed.
+static int case_keys(Obj *clauses) {
+    int n = 0;
+    for (; clauses != Nil; clauses = clauses->cdr) {
+        if (clauses->type != TCELL || clauses->car->type != TCELL || length(clauses->car) < 0)
+            return -1;
+        Obj *keys = clauses->car->car;
+        if (is_otherwise(keys) || keys == Nil)
+            continue;
+        if (keys->type != TCELL) {
+            if (!is_case_key(keys))
+                return -1;
+            n++;
+            continue;
+        }
+        for (; keys->type == TCELL; keys = keys->cdr, n++)
+            if (!is_case_key(keys->car))
+                return -1;
+        if (keys != Nil)
+            return -1;
+    }
+    return n;
+}
+
+static bool case_match(Obj *key, Obj *obj) {
+    if (key->type != obj->type)
+        return false;
+    if (key->type == TINT)
+        return key->value == obj->value;
+    if (key->type == TSTRING)
+        return strcmp(key->name, obj->name) == 0;
+    return key == obj;
+}
+
+// Symbols move when GC runs, so they are hashed by name.
+static unsigned long case_hash(Obj *obj) {
+    if (obj->type == TINT)
+        return (unsigned long)obj->value * 2654435761UL;
+    unsigned long h = 5381;
+    for (char *p = obj->name; *p; p++)
+        h = h * 33 + (unsigned char)*p;
+    return h;
+}
+
+// Returns the slot of the table where the key is, or the empty slot where it would be.
+static Obj **case_slot(Obj *table, Obj *key) {
+    unsigned long mask = table->len / 2 - 1;
+    unsigned long i = case_hash(key) & mask;
+    while (table->slots[i * 2] && !case_match(table->slots[i * 2], key))
+        i = (i + 1) & mask;
+    return &table->slots[i * 2];
+}
+
+static void case_insert(Obj *table, Obj *key, Obj *body) {
+    Obj **slot = case_slot(table, key);
+    // The first clause with the key wins.
+    if (*slot)
+        return;
+    slot[0] = key;
+    slot[1] = body;
+}
+
+static bool compile_case(void *root, Obj **env, Obj **obj) {
+    Obj *args = (*obj)->cdr;
+    if (args->type != TCELL)
+        return false;
+    int n = case_keys(args->cdr);
+    if (n < 0)
+        return false;
+    // Keep the table at most half full.
+    long size = 2;
+    while (size < n * 2)
+        size *= 2;
+    DEFINE3(root, table, ops, tmp);
+    *table = alloc(root, TTABLE, sizeof(long) + sizeof(Obj *) * size * 2);
+    (*table)->len = size * 2;
+    for (long i = 0; i < size * 2; i++)
+        (*table)->slots[i] = NULL;
+    *ops = Nil;
+    for (Obj *p = (*obj)->cdr->cdr; p != Nil; p = p->cdr) {
+        Obj *keys = p->car->car, *body = p->car->cdr;
+        if (is_otherwise(keys)) {
+            *ops = body;
+            break;
+        }
+        if (keys->type != TCELL) {
+            if (keys != Nil)
+                case_insert(*table, keys, body);
+            continue;
+        }
+        for (; keys != Nil; keys = keys->cdr)
+            case_insert(*table, keys->car, body);
+    }
+    *ops = cons(root, table, ops);
+    *tmp = (*obj)->cdr->car;
+    *tmp = compile_operand(root, env, tmp);
+    *ops = cons(root, tmp, ops);
+    compile_into(root, obj, Case, ops);
+    return true;
+}
+
+// (<case> original epoch key table . default)
+static Obj *run_case(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE2(root, key, body);
+    *key = operands(*node)->car;
+    *key = eval(root, env, key);
+    Obj *table = operands(*node)->cdr->car;
+    *body = operands(*node)->cdr->cdr;
+    if (is_case_key(*key)) {
+        Obj **slot = case_slot(table, *key);
+        if (*slot)
+            *body = slot[1];
+    }
+    return progn(root, env, body);
+}
+
+//======================================================================
+// Memoization
+//
+// A function defined with defun-memo caches its results in a table of memo_size entries, indexed
+// by the hash of its arguments. Each entry is ((arg ...) . value). When two calls hash to the
+// same entry, the last one replaces the other, so the cache never grows beyond its size.
+//
+// Only pure functions are memoized: their body must not have any side effect, and its value must
+// only depend on the arguments. It may only call primitives other than setcar, gensym, print,
+// println and exit, and global functions that are pure too, refer to global functions and t, and
+// setq the variables the function binds. Whether a function is pure depends on the definitions of
+// the functions it calls, so it's checked again, and the cache is emptied, when the epoch changes.
+// An impure function is called as if it had been defined with defun, and so are the calls with an
+// argument other than an integer, a symbol, a string, () or t, since a list could be modified
+// after it's been cached. The purity analysis is only used to decide this: the optimizer doesn't
+// eliminate common subexpressions.
+//======================================================================
+
+#define MEMO_MAX_CALLEES 64
+
+int memo_size = 1024;
+
+static Subr prim_gensym, prim_print, prim_println, prim_funcall, prim_apply, prim_stream_fold;
+static Subr1 prim_exit, prim_make_generator, prim_next, prim_force, prim_stream_cdr;
+static Subr2 prim_setcar, prim_stream_map, prim_stream_filter;
+
+static bool is_pure_function(Obj *fn, Obj **seen, int *nseen);
+static bool is_pure_list(Obj **env, Obj *fn, Obj *list, Obj **seen, int *nseen);
+static bool is_pure_template(Obj **env, Obj *fn, Obj *tmpl, int depth, Obj **seen, int *nseen);
+
+// Returns true if the variable is bound by the function or is a global constant or function.
+static bool is_pure_variable(Obj **env, Obj *fn, Obj *sym) {
+    if (is_param(fn->params, sym) || binds_list(env, fn->body, sym))
+        return true;
+    Obj *bind = find(env, sym);
+    if (!bind)
+        return false;
+    Obj *val = bind->cdr;
+    return val == True || val->type == TFUNCTION
+        || (val->type == TPRIMITIVE && !is_special_form(val));
+}
+
+// The primitives with a side effect, and those that call a function or force a promise, which
+// may have one.
+static bool is_impure_primitive(Obj *prim) {
+    return prim->subr == prim_gensym || prim->subr == prim_print || prim->subr == prim_println
+        || prim->subr1 == prim_exit || prim->subr2 == prim_setcar
+        || prim->subr == prim_funcall || prim->subr == prim_apply
+        || prim->subr1 == prim_make_generator || prim->subr1 == prim_next
+        || prim->subr1 == prim_force || prim->subr1 == prim_stream_cdr
+        || prim->subr2 == prim_stream_map || prim->subr2 == prim_stream_filter
+        || prim->subr == prim_stream_fold || prim->subr == prim_values;
+}
+
+// Returns true if evaluating the code in the body of fn has no side effect and only depends on
+// the variables fn binds.
+static bool is_pure(Obj **env, Obj *fn, Obj *code, Obj **seen, int *nseen) {
+    if (code->type == TSYMBOL)
+        return is_pure_variable(env, fn, code);
+    if (code->type != TCELL)
+        return true;
+    check_stack(code->line_num);
+    if (code->car == Const)
+        return true;
+    if ((code->car == Expanded || code->car == Inlined) && !is_stale(code))
+        return is_pure(env, fn, operands(code), seen, nseen);
+    if (code->car->type == TNODE)
+        return is_pure(env, fn, code->cdr->car, seen, nseen);
+    Obj *head = code->car, *args = code->cdr;
+    // A function bound locally may be anything.
+    if (head->type != TSYMBOL || is_param(fn->params, head) || binds_list(env, fn->body, head))
+        return false;
+    Obj *bind = find(env, head);
+    if (!bind)
+        return false;
+    Obj *f = bind->cdr;
+    if (f->type == TFUNCTION)
+        return is_pure_function(f, seen, nseen) && is_pure_list(env, fn, args, seen, nseen);
+    if (f->type != TPRIMITIVE)
+        return false;
+    if (!is_special_form(f))
+        return !is_impure_primitive(f) && is_pure_list(env, fn, args, seen, nseen);
+    if (f->fn == prim_quote || f->fn == prim_declare)
+        return true;
+    if (is_control(f))
+        return is_pure_list(env, fn, args, seen, nseen);
+    if (args->type != TCELL)
+        return false;
+    if (f->fn == prim_setq)
+        return args->car->type == TSYMBOL
+            && (is_param(fn->params, args->car) || binds_list(env, fn->body, args->car))
+            && is_pure_list(env, fn, args->cdr, seen, nseen);
+    if (f->fn == prim_lambda)
+        return is_pure_list(env, fn, args->cdr, seen, nseen);
+    if (f->fn == prim_cond) {
+        for (; args->type == TCELL; args = args->cdr)
+            if (!is_pure_list(env, fn, args->car, seen, nseen))
+                return false;
+        return true;
+    }
+    if (is_let(f)) {
+        if (args->car->type == TSYMBOL)
+            return is_pure_list(env, fn, args->cdr, seen, nseen);
+        for (Obj *p = args->car; p->type == TCELL; p = p->cdr)
+            if (p->car->type == TCELL && !is_pure_list(env, fn, p->car->cdr, seen, nseen))
+                return false;
+        return is_pure_list(env, fn, args->cdr, seen, nseen);
+    }
+    if (is_loop(f))
+        return args->car->type == TCELL && is_pure_list(env, fn, args->car->cdr, seen, nseen)
+            && is_pure_list(env, fn, args->cdr, seen, nseen);
+    if (f->fn == prim_case) {
+        if (!is_pure(env, fn, args->car, seen, nseen))
+            return false;
+        for (Obj *p = args->cdr; p->type == TCELL; p = p->cdr)
+            if (p->car->type == TCELL && !is_pure_list(env, fn, p->car->cdr, seen, nseen))
+                return false;
+        return true;
+    }
+    if (f->fn == prim_quasiquote)
+        return is_pure_template(env, fn, args->car, 1, seen, nseen);
+    if (f->fn == prim_multiple_value_bind)
+        return is_pure_list(env, fn, args->cdr, seen, nseen);
+    return false;
+}
+
+static bool is_pure_list(Obj **env, Obj *fn, Obj *list, Obj **seen, int *nseen) {
+    for (; list->type == TCELL; list = list->cdr)
+        if (!is_pure(env, fn, list->car, seen, nseen))
+            return false;
+    return true;
+}
+
+static bool is_pure_template(Obj **env, Obj *fn, Obj *tmpl, int depth, Obj **seen, int *nseen) {
+    if (tmpl->type != TCELL)
+        return true;
+    check_stack(tmpl->line_num);
+    Obj *expr = unquoted(tmpl, &depth);
+    if (expr)
+        return is_pure(env, fn, expr, seen, nseen);
+    return is_pure_template(env, fn, tmpl->car, depth, seen, nseen)
+        && is_pure_template(env, fn, tmpl->cdr, depth, seen, nseen);
+}
+
+// Returns true if the global function is pure. The functions in seen are being checked, and are
+// assumed to be pure, so that recursive functions can be.
+static bool is_pure_function(Obj *fn, Obj **seen, int *nseen) {
+    for (int i = 0; i < *nseen; i++)
+        if (seen[i] == fn)
+            return true;
+    // A closure may refer to local variables, which may be modified.
+    if (*nseen == MEMO_MAX_CALLEES || fn->env->up != Nil)
+        return false;
+    seen[(*nseen)++] = fn;
+    Obj *env = fn->env;
+    return is_pure_list(&env, fn, fn->body, seen, nseen);
+}
+
+// Computes the hash of the arguments. Returns false if they can't be cached.
+static bool memo_hash(Obj **argv, int nargs, unsigned long *hash) {
+    unsigned long h = 0;
+    for (int i = 0; i < nargs; i++) {
+        Obj *arg = argv[i];
+        if (is_case_key(arg))
+            h = h * 31 + case_hash(arg);
+        else if (arg == Nil || arg == True)
+            h = h * 31 + arg->type;
+        else
+            return false;
+    }
+    *hash = h;
+    return true;
+}
+
+static bool memo_match(Obj *keys, Obj **argv, int nargs) {
+    int i = 0;
+    for (; keys != Nil && i < nargs; keys = keys->cdr, i++)
+        if (keys->car != argv[i] && !case_match(keys->car, argv[i]))
+            return false;
+    return keys == Nil && i == nargs;
+}
+
+// Returns a new list of the arguments.
+static Obj *memo_list(void *root, Obj **argv, int nargs) {
+    DEFINE1(root, list);
+    *list = Nil;
+    for (int i = 0; i < nargs; i++)
+        *list = cons(root, &Nil, list);
+    Obj *p = *list;
+    for (int i = 0; i < nargs; i++, p = p->cdr)
+        p->car = argv[i];
+    return *list;
+}
+
+// The arguments are evaluated, or copied, into an array on the C stack registered as a root frame,
+// like for a primitive, so that a call whose result is cached allocates nothing. The lists of the
+// arguments are only made when the result is not.
+static Obj *call_memo(void *root, Obj **env, Obj **fn, Obj **args, bool evaluate) {
+    if ((*fn)->memo_epoch != epoch) {
+        Obj *seen[MEMO_MAX_CALLEES];
+        int nseen = 0;
+        (*fn)->pure = is_pure_function(*fn, seen, &nseen);
+        for (long i = 0; i < (*fn)->memo->len; i++)
+            (*fn)->memo->slots[i] = NULL;
+        (*fn)->memo_epoch = epoch;
+    }
+    int nargs = length(*args);
+    if (!(*fn)->pure || nargs < 0)
+        return call_body(root, env, fn, args, evaluate);
+    DEFINE3(root, vals, keys, value);
+    check_stack((*fn)->line_num);
+    void *frame[nargs + 2];
+    root = add_root_frame(root, nargs, frame);
+    Obj **argv = (Obj **)(frame + 1);
+    if (evaluate) {
+        eval_args(root, env, args, argv, nargs);
+    } else {
+        Obj *p = *args;
+        for (int i = 0; i < nargs; i++, p = p->cdr)
+            argv[i] = p->car;
+    }
+    unsigned long hash;
+    bool cached = memo_hash(argv, nargs, &hash);
+    long i = cached ? hash % (*fn)->memo->len : 0;
+    Obj *entry = cached ? (*fn)->memo->slots[i] : NULL;
+    if (entry && memo_match(entry->car, argv, nargs)) {
+        nvalues = 0;
+        return entry->cdr;
+    }
+    *vals = memo_list(root, argv, nargs);
+    *value = call_body(root, env, fn, vals, false);
+    if (!cached)
+        return *value;
+    // The function may return its rest parameter, which the caller may modify, so the key is a
+    // list of its own.
+    *keys = memo_list(root, argv, nargs);
+    Obj *cell = cons(root, keys, value);
+    (*fn)->memo->slots[i] = cell;
+    return *value;
+}
+
+//======================================================================
+// Generators
+//
+// (make-generator fn) returns a generator, which calls (fn yield) on a stack of its own when it's
+// first resumed by (next g). When the generator calls (yield value), it's suspended, and next
+// returns the value. The next call of next resumes it where it left off, yield returning (). Once
+// fn has returned, next returns () and (done? g) returns t, so that a consumer can tell a yielded
+// () from the end. yield suspends the innermost generator that is running.
+//
+// The stack of a generator is allocated with mmap like the control stack, so that only the pages
+// it touches are committed. While a generator is suspended, the root frames on its stack are not
+// linked to the ones of the code that runs, so they are registered with GC as a Stack, which keeps
+// them up to date as long as the generator is live, and releases the stack once it's not. The
+// bottom root frame of a generator, which holds fn and the value yielded, is linked to the frames
+// of the caller of next while the generator runs.
+//
+// An error in a generator ends it, and is raised again in the caller of next. So does a throw to a
+// catch outside the generator: the bottom handler of its stack is linked to the handlers of the
+// caller of next while it runs.
+//======================================================================
+
+#define GENERATOR_STACK_SIZE (4 * 1024 * 1024)
+
+enum { NEW, SUSPENDED, RUNNING, DONE };
+
+typedef struct Generator {
+    Stack stack;  // Must be the first member, for release_generator()
+    int state;
+    bool failed;
+    char *memory;  // The stack, including the guard page
+    size_t size;
+    ucontext_t context, caller;
+    // The bottom handler of the stack of the generator, and the innermost handlers of the
+    // generator while it's suspended and of the caller while it runs
+    Handler handler, *own_context, *caller_context;
+    char *caller_stack_limit;
+    struct Generator *caller_generator;
+    // The depth of the function calls in the generator, and in the caller of next
+    long depth, caller_depth;
+    // The bottom root frame: {caller's frames, fn, value, ROOT_END}
+    void *base[4];
+} Generator;
+
+// The innermost generator running, if any
+static Generator *current_generator;
+
+static Obj *prim_yield(void *root, Obj **x, int line_num);
+
+static Obj *Yield = &(Obj){ .type = TPRIMITIVE, .size = sizeof(Obj), .subr1 = prim_yield,
+                            .arity = 1, .prim_name = "yield" };
+
+static void release_generator(Stack *stack) {
+    Generator *g = (Generator *)stack;
+    if (g->memory)
+        munmap(g->memory, g->size);
+    free(g);
+}
+
+static void run_generator(Generator *g) {
+    void *root = g->base;
+    DEFINE3(root, fn, args, env);
+    *fn = g->base[1];
+    *args = cons(root, &Yield, &Nil);
+    *env = Nil;
+    apply_func(root, env, fn, args);
+}
+
+// The entry point of the stack of a generator
+static void generator_main(void) {
+    Generator *g = current_generator;
+    context = &g->handler;
+    if (setjmp(g->handler.jmp) == 0)
+        run_generator(g);
+    else
+        g->failed = true;
+    g->state = DONE;
+    g->base[2] = Nil;
+    // Returns to the caller of next through uc_link.
+}
+
+// (make-generator fn)
+static Obj *prim_make_generator(void *root, Obj **fn, int line_num) {
+    if ((*fn)->type != TFUNCTION)
+        error("make-generator: argument must be a function", line_num);
+    Obj *obj = alloc(root, TGENERATOR, sizeof(Generator *));
+    Generator *g = calloc(1, sizeof(Generator));
+    if (!g)
+        error("Memory exhausted", line_num);
+    obj->generator = g;
+    obj->line_num = line_num;
+    g->state = NEW;
+    add_root_frame(NULL, 2, g->base);
+    g->base[1] = *fn;
+    g->stack.owner = obj;
+    g->stack.root = g->base;
+    g->stack.release = release_generator;
+    add_stack(&g->stack);
+    return obj;
+}
+
+static void start_generator(Generator *g, int line_num) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    g->size = GENERATOR_STACK_SIZE + page;
+    g->memory = mmap(NULL, g->size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (g->memory == MAP_FAILED) {
+        g->memory = NULL;
+        error("Cannot allocate the stack of a generator", line_num);
+    }
+    mprotect(g->memory, page, PROT_NONE);
+    getcontext(&g->context);
+    g->context.uc_stack.ss_sp = g->memory + page;
+    g->context.uc_stack.ss_size = GENERATOR_STACK_SIZE;
+    g->context.uc_link = &g->caller;
+    makecontext(&g->context, generator_main, 0);
+}
+
+// (next generator)
+static Obj *prim_next(void *root, Obj **gen, int line_num) {
+    if ((*gen)->type != TGENERATOR)
+        error("next: argument must be a generator", line_num);
+    Generator *g = (*gen)->generator;
+    if (g->state == RUNNING)
+        error("next: the generator is running", line_num);
+    if (g->state == DONE)
+        return Nil;
+    if (g->state == NEW)
+        start_generator(g, line_num);
+    g->caller_context = context;
+    g->handler.prev = context;
+    if (g->state == SUSPENDED)
+        context = g->own_context;
+    g->caller_stack_limit = stack_limit;
+    g->caller_generator = current_generator;
+    g->caller_depth = call_depth;
+    call_depth += g->depth;
+    g->base[0] = root;
+    g->stack.root = NULL;
+    g->state = RUNNING;
+    current_generator = g;
+    stack_limit = g->memory + (size_t)sysconf(_SC_PAGESIZE) + STACK_MARGIN;
+    swapcontext(&g->caller, &g->context);
+
+    // Back from yield, or from the end of the generator
+    current_generator = g->caller_generator;
+    stack_limit = g->caller_stack_limit;
+    g->depth = call_depth - g->caller_depth;
+    call_depth = g->caller_depth;
+    g->base[0] = NULL;
+    if (g->state == SUSPENDED)
+        g->own_context = context;
+    context = g->caller_context;
+    if (g->state == DONE) {
+        munmap(g->memory, g->size);
+        g->memory = NULL;
+        if (g->failed)
+            longjmp(context->jmp, 1);
+    }
+    Obj *value = g->base[2];
+    g->base[2] = NULL;
+    return value;
+}
+
+static Obj *prim_yield(void *root, Obj **x, int line_num) {
+    Generator *g = current_generator;
+    if (!g)
+        error("yield: no generator is running", line_num);
+    g->base[2] = *x;
+    g->stack.root = root;
+    g->state = SUSPENDED;
+    swapcontext(&g->context, &g->caller);
+    return Nil;
+}
+
+// (done? generator)
+static Obj *prim_done(void *root, Obj **gen, int line_num) {
+    if ((*gen)->type != TGENERATOR)
+        error("done?: argument must be a generator", line_num);
+    return (*gen)->generator->state == DONE ? True : Nil;
+}
+
+//======================================================================
+// Promises and streams
+//
+// (delay expr) returns a promise, which evaluates expr when it's forced by (force promise) for the
+// first time, and returns the same value without evaluating it again afterwards. The expression is
+// kept as a function of no arguments, created like a lambda, and dropped once the promise is
+// forced.
+//
+// A stream is either () or a cell whose car is its first element and whose cdr is a promise of the
+// rest of the stream, as made by (cons-stream x expr). Since force returns any other object as is,
+// a list is a stream too. The stream functions are written in C and produce their results on
+// demand: the rest of the stream returned by stream-map, stream-filter or stream-take is a promise
+// holding a primitive and its arguments instead of an expression. Nothing refers to the elements
+// already consumed, so that an infinite stream can be processed in constant heap as long as the
+// caller doesn't keep its head.
+//======================================================================
+
+static Obj *make_promise(void *root, Obj **thunk, Obj **args) {
+    Obj *r = alloc(root, TPROMISE, sizeof(Obj *) * 2 + sizeof(bool));
+    r->thunk = *thunk;
+    r->thunk_args = *args;
+    r->forced = false;
+    r->line_num = filepos.line_num;
+    return r;
+}
+
+// Returns a promise to evaluate the body of list, which is (() expr). free is the list of the free
+// variables of expr, or NULL if they are not known yet.
+static Obj *delay(void *root, Obj **env, Obj **list, Obj **free) {
+    DEFINE1(root, fn);
+    *fn = handle_function(root, env, list, TFUNCTION, free);
+    return make_promise(root, fn, &Nil);
+}
+
+static Obj *force(void *root, Obj **obj, int line_num) {
+    if ((*obj)->type != TPROMISE || (*obj)->forced)
+        return (*obj)->type == TPROMISE ? (*obj)->thunk : *obj;
+    DEFINE4(root, fn, args, x, y);
+    *fn = (*obj)->thunk;
+    *args = (*obj)->thunk_args;
+    if ((*fn)->type == TPRIMITIVE) {
+        *x = (*args)->car;
+        *y = (*args)->cdr->car;
+        *x = (*fn)->subr2(root, x, y, line_num);
+    } else {
+        *x = call_values(root, fn, NULL, 0, line_num);
+    }
+    // The expression may have forced the promise itself, in which case the first value is kept.
+    if (!(*obj)->forced) {
+        (*obj)->thunk = *x;
+        (*obj)->thunk_args = Nil;
+        (*obj)->forced = true;
+    }
+    return (*obj)->thunk;
+}
+
+// (delay expr)
+static Obj *prim_delay(void *root, Obj **env, Obj **list) {
+    if (length(*list) != 1)
+        error("Malformed delay", (*list)->line_num);
+    DEFINE1(root, lambda);
+    *lambda = cons(root, &Nil, list);
+    return delay(root, env, lambda, NULL);
+}
+
+// (cons-stream expr expr)
+static Obj *prim_cons_stream(void *root, Obj **env, Obj **list) {
+    if (length(*list) != 2)
+        error("Malformed cons-stream", (*list)->line_num);
+    DEFINE2(root, head, tail);
+    *head = (*list)->car;
+    *head = eval(root, env, head);
+    *tail = (*list)->cdr;
+    *tail = cons(root, &Nil, tail);
+    *tail = delay(root, env, tail, NULL);
+    return cons(root, head, tail);
+}
+
+// Compiles a delay or cons-stream form into
+// (<delay> original epoch free () expr) or (<cons-stream> original epoch head free () expr).
+static void compile_delay(void *root, Obj **env, Obj **obj, Obj **fn) {
+    DEFINE4(root, ops, params, body, tmp);
+    *body = (*obj)->cdr;
+    if ((*fn)->fn == prim_cons_stream)
+        *body = (*body)->cdr;
+    *params = Nil;
+    *tmp = free_variables(root, env, params, body);
+    *ops = cons(root, params, body);
+    *ops = cons(root, tmp, ops);
+    if ((*fn)->fn == prim_cons_stream) {
+        *tmp = (*obj)->cdr->car;
+        *tmp = compile_operand(root, env, tmp);
+        *ops = cons(root, tmp, ops);
+    }
+    compile_into(root, obj, (*fn)->fn == prim_delay ? Delay : ConsStream, ops);
+}
+
+static Obj *run_delay(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE2(root, free, list);
+    *free = operands(*node)->car;
+    *list = operands(*node)->cdr;
+    return delay(root, env, list, free);
+}
+
+static Obj *run_cons_stream(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE4(root, head, free, list, tail);
+    *head = operands(*node)->car;
+    *head = eval(root, env, head);
+    *free = operands(*node)->cdr->car;
+    *list = operands(*node)->cdr->cdr;
+    *tail = delay(root, env, list, free);
+    return cons(root, head, tail);
+}
+
+// (force promise)
+static Obj *prim_force(void *root, Obj **obj, int line_num) {
+    return force(root, obj, line_num);
+}
+
+// (stream-cdr stream)
+static Obj *prim_stream_cdr(void *root, Obj **stream, int line_num) {
+    if ((*stream)->type != TCELL)
+        error("stream-cdr: argument must be a non-empty stream", line_num);
+    DEFINE1(root, tail);
+    *tail = (*stream)->cdr;
+    return force(root, tail, line_num);
+}
+
+static void check_stream(Obj *stream, char *name, int line_num) {
+    if (stream->type != TCELL)
+        error("%s: argument must be a stream", line_num, name);
+}
+
+// Returns (x . <promise of (fn a b)>).
+static Obj *stream_cons(void *root, Obj **x, Obj *fn, Obj **a, Obj **b) {
+    DEFINE2(root, args, tail);
+    *args = cons(root, b, &Nil);
+    *args = cons(root, a, args);
+    *tail = make_promise(root, &fn, args);
+    return cons(root, x, tail);
+}
+
+static Subr2 stream_map_rest, stream_filter_rest, stream_take_rest;
+
+static Obj *StreamMap = &(Obj){ .type = TPRIMITIVE, .size = sizeof(Obj),
+                                .subr2 = stream_map_rest, .arity = 2, .prim_name = "stream-map" };
+static Obj *StreamFilter = &(Obj){ .type = TPRIMITIVE, .size = sizeof(Obj),
+                                   .subr2 = stream_filter_rest, .arity = 2,
+                                   .prim_name = "stream-filter" };
+static Obj *StreamTake = &(Obj){ .type = TPRIMITIVE, .size = sizeof(Obj),
+                                 .subr2 = stream_take_rest, .arity = 2,
+                                 .prim_name = "stream-take" };
+
+// (stream-map fn stream)
+static Obj *prim_stream_map(void *root, Obj **fn, Obj **stream, int line_num) {
+    if (*stream == Nil)
+        return Nil;
+    check_stream(*stream, "stream-map", line_num);
+    DEFINE2(root, x, tail);
+    *x = (*stream)->car;
+    *x = call_values(root, fn, x, 1, line_num);
+    *tail = (*stream)->cdr;
+    return stream_cons(root, x, StreamMap, fn, tail);
+}
+
+static Obj *stream_map_rest(void *root, Obj **fn, Obj **tail, int line_num) {
+    *tail = force(root, tail, line_num);
+    return prim_stream_map(root, fn, tail, line_num);
+}
+
+// (stream-filter pred stream)
+static Obj *prim_stream_filter(void *root, Obj **pred, Obj **stream, int line_num) {
+    DEFINE2(root, x, tail);
+    for (; *stream != Nil; *stream = force(root, tail, line_num)) {
+        check_stream(*stream, "stream-filter", line_num);
+        count_step(line_num);
+        *x = (*stream)->car;
+        *tail = (*stream)->cdr;
+        if (call_values(root, pred, x, 1, line_num) != Nil)
+            return stream_cons(root, x, StreamFilter, pred, tail);
+    }
+    return Nil;
+}
+
+static Obj *stream_filter_rest(void *root, Obj **pred, Obj **tail, int line_num) {
+    *tail = force(root, tail, line_num);
+    return prim_stream_filter(root, pred, tail, line_num);
+}
+
+// (stream-take n stream)
+static Obj *prim_stream_take(void *root, Obj **n, Obj **stream, int line_num) {
+    if ((*n)->type != TINT)
+        error("stream-take: first argument must be an integer", line_num);
+    if ((*n)->value <= 0 || *stream == Nil)
+        return Nil;
+    check_stream(*stream, "stream-take", line_num);
+    DEFINE3(root, x, tail, rest);
+    *x = (*stream)->car;
+    *tail = (*stream)->cdr;
+    *rest = make_int(root, (*n)->value - 1);
+    return stream_cons(root, x, StreamTake, rest, tail);
+}
+
+// The rest is forced only if it's taken, so that (stream-take n s) doesn't compute the element of
+// s following the nth one.
+static Obj *stream_take_rest(void *root, Obj **n, Obj **tail, int line_num) {
+    if ((*n)->value > 0)
+        *tail = force(root, tail, line_num);
+    return prim_stream_take(root, n, tail, line_num);
+}
+
+// (stream-fold fn init stream)
+static Obj *prim_stream_fold(void *root, Obj **args, int nargs, int line_num) {
+    // The accumulator and the element are passed to fn from a root frame.
+    void *frame[5];
+    root = add_root_frame(root, 3, frame);
+    Obj **acc = (Obj **)(frame + 1);
+    Obj **tail = (Obj **)(frame + 3);
+    *acc = args[1];
+    // args[2] is updated as the stream is consumed, so that the elements already folded are not
+    // referred to.
+    for (; args[2] != Nil; args[2] = force(root, tail, line_num)) {
+        check_stream(args[2], "stream-fold", line_num);
+        count_step(line_num);
+        acc[1] = args[2]->car;
+        *tail = args[2]->cdr;
+        *acc = call_values(root, &args[0], acc, 2, line_num);
+    }
+    return *acc;
+}
+
+//======================================================================
+// Quasiquote
+//
+// `tmpl is read as (quasiquote tmpl), ,expr as (unquote expr) and ,@expr as
+// (unquote-splicing expr). A quasiquote form returns its template as quote would, except that the
+// unquoted expressions are replaced with their values, and the elements of the lists
+// unquote-splicing evaluates to are inserted in their place. A quasiquote nested in the template
+// has its own unquotes, which are left as is.
+//
+// Interpreting the template would walk all of it every time. Instead, it's compiled into
+//
+//   (<quasiquote> original epoch plan)
+//
+// where plan is an expression building the value. The parts of the template that contain no
+// unquote are constants shared by all the values built, so that only the cells leading to an
+// unquoted expression are allocated:
+//
+//   (<cons> template epoch car cdr)      conses the values of the plans car and cdr.
+//   (<splice> template epoch expr cdr)   appends a copy of the list expr evaluates to, to the value
+//                                        of cdr. The list is not copied if cdr is ().
+//
+// These are only reached through the quasiquote node and don't check the epoch themselves.
+//======================================================================
+
+// Returns the expression of an unquote or unquote-splicing form at nesting level 1. Otherwise,
+// updates *depth if the template is a nested quasiquote, unquote or unquote-splicing form, and
+// returns NULL.
+static Obj *unquoted(Obj *tmpl, int *depth) {
+    if (tmpl->type != TCELL || tmpl->car->type != TSYMBOL || tmpl->cdr->type != TCELL
+        || tmpl->cdr->cdr != Nil)
+        return NULL;
+    char *name = tmpl->car->name;
+    if (strcmp(name, "quasiquote") == 0) {
+        (*depth)++;
+    } else if (strcmp(name, "unquote") == 0 || strcmp(name, "unquote-splicing") == 0) {
+        if (*depth == 1)
+            return tmpl->cdr->car;
+        (*depth)--;
+    }
+    return NULL;
+}
+
+static bool is_splice(Obj *tmpl, int depth) {
+    return unquoted(tmpl, &depth) && strcmp(tmpl->car->name, "unquote-splicing") == 0;
+}
+
+// Returns true if the plan is the constant part of the template.
+static bool is_constant_part(Obj *plan, Obj *part) {
+    return plan->type == TCELL && plan->car == Const && plan->cdr->cdr == part;
+}
+
+static Obj *compile_template(void *root, Obj **env, Obj **tmpl, int depth) {
+    if ((*tmpl)->type != TCELL)
+        return make_node(root, Const, tmpl, tmpl);
+    check_stack((*tmpl)->line_num);
+    DEFINE4(root, expr, car, cdr, ops);
+    *expr = unquoted(*tmpl, &depth);
+    if (*expr)
+        return compile_operand(root, env, expr);
+    Obj *handler = TemplateCons;
+    *car = (*tmpl)->car;
+    if (is_splice(*car, depth)) {
+        handler = Splice;
+        *car = (*car)->cdr->car;
+        *car = compile_operand(root, env, car);
+    } else {
+        *car = compile_template(root, env, car, depth);
+    }
+    *cdr = (*tmpl)->cdr;
+    *cdr = compile_template(root, env, cdr, depth);
+    if (handler == TemplateCons && is_constant_part(*car, (*tmpl)->car)
+        && is_constant_part(*cdr, (*tmpl)->cdr))
+        return make_node(root, Const, tmpl, tmpl);
+    *ops = cons(root, cdr, &Nil);
+    *ops = cons(root, car, ops);
+    *expr = make_int(root, epoch);
+    *ops = cons(root, expr, ops);
+    return make_node(root, handler, tmpl, ops);
+}
+
+static void compile_quasiquote(void *root, Obj **env, Obj **obj) {
+    DEFINE2(root, plan, ops);
+    *plan = (*obj)->cdr->car;
+    *plan = compile_template(root, env, plan, 1);
+    *ops = cons(root, plan, &Nil);
+    compile_into(root, obj, Quasiquote, ops);
+}
+
+static Obj *run_quasiquote(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE1(root, plan);
+    *plan = operands(*node)->car;
+    return eval(root, env, plan);
+}
+
+static Obj *run_template_cons(void *root, Obj **env, Obj **node) {
+    DEFINE2(root, car, cdr);
+    *car = operands(*node)->car;
+    *car = eval(root, env, car);
+    *cdr = operands(*node)->cdr->car;
+    *cdr = eval(root, env, cdr);
+    return cons(root, car, cdr);
+}
+
+static Obj *run_splice(void *root, Obj **env, Obj **node) {
+    DEFINE4(root, list, tail, head, elem);
+    *list = operands(*node)->car;
+    *list = eval(root, env, list);
+    if (length(*list) < 0)
+        error("unquote-splicing: argument must be a list", (*node)->cdr->car->line_num);
+    *tail = operands(*node)->cdr->car;
+    *tail = eval(root, env, tail);
+    if (*tail == Nil || *list == Nil)
+        return *list == Nil ? *tail : *list;
+    *head = Nil;
+    for (; *list != Nil; *list = (*list)->cdr) {
+        *elem = (*list)->car;
+        *head = cons(root, elem, head);
+    }
+    Obj *ret = reverse(*head);
+    (*head)->cdr = *tail;
+    return ret;
+}
+
+// (quasiquote tmpl)
+static Obj *prim_quasiquote(void *root, Obj **env, Obj **list) {
+    if (length(*list) != 1)
+        error("Malformed quasiquote", (*list)->line_num);
+    DEFINE1(root, plan);
+    *plan = (*list)->car;
+    *plan = compile_template(root, env, plan, 1);
+    return eval(root, env, plan);
+}
+
+//======================================================================
+// Primitive functions and special forms
+//======================================================================
+
+// (list expr ...)
+static Obj *prim_list(void *root, Obj **args, int nargs, int line_num) {
+    DEFINE1(root, list);
+    *list = Nil;
+    for (int i = nargs - 1; i >= 0; i--)
+        *list = cons(root, &args[i], list);
+    return *list;
+}
+
+// 'expr
+static Obj *prim_quote(void *root, Obj **env, Obj **list) {
+    if (length(*list) != 1)
+        error("Malformed quote", (*list)->line_num);
+    return (*list)->car;
+}
+
+// (atom expr)
+static Obj *prim_atom(void *root, Obj **x, int line_num) {
+    return (*x)->type != TCELL ? True : Nil;
+}
+
+// (cons expr expr)
+static Obj *prim_cons(void *root, Obj **x, Obj **y, int line_num) {
+    return cons(root, x, y);
+}
+
+// (car <cell>)
+static Obj *prim_car(void *root, Obj **x, int line_num) {
+    if ((*x)->type != TCELL)
+        error("Malformed car", line_num);
+    return (*x)->car;
+}
+
+// (cdr <cell>)
+static Obj *prim_cdr(void *root, Obj **x, int line_num) {
+    if ((*x)->type != TCELL)
+        error("Malformed cdr", line_num);
+    return (*x)->cdr;
+}
+
+// (setq <symbol> expr)
+static Obj *prim_setq(void *root, Obj **env, Obj **list) {
+    if (length(*list) != 2 || (*list)->car->type != TSYMBOL)
+        error("Malformed setq", (*list)->line_num);
+    DEFINE2(root, bind, value);
+    *bind = find(env, (*list)->car);
+    if (!*bind)
+        error("Unbound variable %s", (*list)->line_num, (*list)->car->name);
+    *value = (*list)->cdr->car;
+    *value = eval(root, env, value);
+    invalidate_value((*bind)->cdr);
+    (*bind)->cdr = *value;
+    // Only the primary value is returned.
+    nvalues = 0;
+    return *value;
+}
+
+// (declare (fixnum <symbol> ...) ...)
+static Obj *prim_declare(void *root, Obj **env, Obj **list) {
+    if (length(*list) < 0)
+        error("Malformed declare", (*list)->line_num);
+    for (Obj *p = *list; p != Nil; p = p->cdr) {
+        Obj *spec = p->car;
+        if (spec->type != TCELL || spec->car->type != TSYMBOL || length(spec) < 0
+            || strcmp(spec->car->name, "fixnum") != 0)
+            error("Malformed declare: the only type is fixnum", (*list)->line_num);
+        for (Obj *q = spec->cdr; q != Nil; q = q->cdr) {
+            if (q->car->type != TSYMBOL)
+                error("Malformed declare: the only type is fixnum", (*list)->line_num);
+            if (safety == 0)
+                continue;
+            Obj *bind = find(env, q->car);
+            if (!bind)
+                error("Undefined symbol: %s", (*list)->line_num, q->car->name);
+            if (bind->cdr->type != TINT)
+                error("%s is declared fixnum but is not an integer", (*list)->line_num,
+                      q->car->name);
+        }
+    }
+    return Nil;
+}
+
+// (setcar <cell> expr)
+static Obj *prim_setcar(void *root, Obj **x, Obj **y, int line_num) {
+    if ((*x)->type != TCELL)
+        error("Malformed setcar", line_num);
+    (*x)->car = *y;
+    return *x;
+}
+
+// (while cond expr ...)
+static Obj *prim_while(void *root, Obj **env, Obj **list) {
+    if (length(*list) < 2)
+        error("Malformed while", (*list)->line_num);
+    DEFINE2(root, cond, exprs);
+    *cond = (*list)->car;
+    *exprs = (*list)->cdr;
+    while (eval(root, env, cond) != Nil) {
+        count_step((*list)->line_num);
+        progn(root, env, exprs);
+    }
+    return Nil;
+}
+
+// Checks the form of (<loop> (<symbol> expr [result]) expr ...), and returns a new frame in which
+// the symbol is bound. *bind is set to the binding, which the loop updates in place. mode may
+// include OPEN_FRAME, as for a let form.
+static Obj *loop_frame(void *root, Obj **env, Obj **list, Obj **bind, char *name, int mode) {
+    Obj *spec = (*list)->type == TCELL ? (*list)->car : Nil;
+    if (spec->type != TCELL || spec->car->type != TSYMBOL
+        || (length(spec) != 2 && length(spec) != 3))
+        error("Malformed %s", (*list)->line_num, name);
+    DEFINE1(root, var);
+    *var = spec->car;
+    *bind = cons(root, var, &Nil);
+    *var = cons(root, bind, &Nil);
+    Obj *r = make_env(root, var, env);
+    r->open = mode & OPEN_FRAME;
+    return r;
+}
+
+// Evaluates the result form of a loop, if any.
+static Obj *loop_result(void *root, Obj **frame, Obj **list) {
+    DEFINE1(root, result);
+    *result = (*list)->car->cdr->cdr;
+    if (*result == Nil)
+        return Nil;
+    *result = (*result)->car;
+    return eval(root, frame, result);
+}
+
+// The counter of a dotimes form is normally a new integer on each iteration, which allocates
+// once it's out of the range of the small integers. If mode includes PRIVATE_COUNTER, the body
+// can't keep the value of the variable, so a single integer made by make_counter is updated in
+// place instead. If the body changes the epoch, e.g. by setting the variable of a primitive it
+// calls, it may no longer do so, and the loop goes back to new integers.
+#define PRIVATE_COUNTER 16
+
+// Evaluates (dotimes (<symbol> count [result]) expr ...).
+static Obj *eval_dotimes(void *root, Obj **env, Obj **list, int mode) {
+    DEFINE5(root, frame, bind, val, body, counter);
+    *frame = loop_frame(root, env, list, bind, "dotimes", mode);
+    *val = (*list)->car->cdr->car;
+    *val = eval(root, env, val);
+    if ((*val)->type != TINT)
+        error("dotimes: count must be an integer", (*list)->line_num);
+    long long n = (*val)->value;
+    *body = (*list)->cdr;
+    if (mode & PRIVATE_COUNTER)
+        *counter = make_counter(root);
+    long long start = epoch;
+    for (long long i = 0; i < n; i++) {
+        count_step((*list)->line_num);
+        if ((mode & PRIVATE_COUNTER) && epoch == start) {
+            (*counter)->value = i;
+            (*bind)->cdr = *counter;
+        } else {
+            Obj *r = make_int(root, i);
+            (*bind)->cdr = r;
+        }
+        progn(root, frame, body);
+    }
+    (*bind)->cdr = *val;
+    return loop_result(root, frame, list);
+}
+
+// Evaluates (dolist (<symbol> list [result]) expr ...).
+static Obj *eval_dolist(void *root, Obj **env, Obj **list, int mode) {
+    DEFINE4(root, frame, bind, lp, body);
+    *frame = loop_frame(root, env, list, bind, "dolist", mode);
+    *lp = (*list)->car->cdr->car;
+    *lp = eval(root, env, lp);
+    if (!is_list(*lp))
+        error("dolist: argument must be a list", (*list)->line_num);
+    *body = (*list)->cdr;
+    for (; (*lp)->type == TCELL; *lp = (*lp)->cdr) {
+        count_step((*list)->line_num);
+        (*bind)->cdr = (*lp)->car;
+        progn(root, frame, body);
+    }
+    (*bind)->cdr = Nil;
+    return loop_result(root, frame, list);
+}
+
+// (dotimes (<symbol> count [result]) expr ...)
+static Obj *prim_dotimes(void *root, Obj **env, Obj **list) {
+    return eval_dotimes(root, env, list, OPEN_FRAME);
+}
+
+// (dolist (<symbol> list [result]) expr ...)
+static Obj *prim_dolist(void *root, Obj **env, Obj **list) {
+    return eval_dolist(root, env, list, OPEN_FRAME);
+}
+
+static Obj *run_loop(void *root, Obj **env, Obj **node);
+
+static Obj *Loop = &(Obj){ .type = TNODE, .size = sizeof(Obj), .fn = run_loop };
+
+// Returns true if the primitive returns neither its arguments nor anything holding them.
+static bool drops_args(Obj *fn) {
+    if (fn->type != TPRIMITIVE)
+        return false;
+    return fn->subr == prim_plus || fn->subr == prim_minus || fn->subr == prim_mult
+        || fn->subr == prim_div || fn->subr == prim_modulo || fn->subr2 == prim_num_eq
+        || fn->subr2 == prim_lt || fn->subr2 == prim_lte || fn->subr2 == prim_gt
+        || fn->subr2 == prim_gte || fn->subr2 == prim_eq;
+}
+
+// Returns true if the value of the variable can't outlive an evaluation of the code, a part of
+// the body, that is if the code passes it only to the arithmetic and comparison primitives bound
+// in the environment and not rebound by the body. A macro, or a function not defined yet, which
+// may turn out to be a macro, may do anything with a form that mentions it.
+static bool keeps_private(Obj **env, Obj *body, Obj *code, Obj *sym) {
+    if (code == sym)
+        return false;
+    if (code->type != TCELL)
+        return true;
+    check_stack(code->line_num);
+    if (code->car->type == TNODE)
+        return keeps_private(env, body, code->cdr->car, sym);
+    bool drops = false;
+    if (code->car->type == TSYMBOL) {
+        Obj *bind = find(env, code->car);
+        if (!bind || bind->cdr->type == TMACRO)
+            return !occurs(code, sym);
+        drops = drops_args(bind->cdr) && !binds_list(env, body, code->car);
+    }
+    for (; code->type == TCELL; code = code->cdr)
+        if (!(drops && code->car == sym) && !keeps_private(env, body, code->car, sym))
+            return false;
+    return code != sym;
+}
+
+// A loop is compiled into (<loop> original epoch mode fn . args), where mode includes OPEN_FRAME
+// if the result or the body may define a variable in the frame of the loop, and PRIVATE_COUNTER
+// if the loop is a dotimes whose body keeps the variable private.
+static void compile_loop(void *root, Obj **env, Obj **obj, Obj **fn) {
+    DEFINE2(root, ops, tmp);
+    Obj *args = (*obj)->cdr;
+    Obj *spec = args->type == TCELL ? args->car : Nil;
+    int mode = 0;
+    if (spec->type != TCELL || spec->cdr->type != TCELL
+        || may_define_list(env, Nil, spec->cdr->cdr) || may_define_list(env, Nil, args->cdr))
+        mode |= OPEN_FRAME;
+    if ((*fn)->fn == prim_dotimes && spec->type == TCELL && !(mode & OPEN_FRAME)
+        && keeps_private(env, args->cdr, args->cdr, spec->car))
+        mode |= PRIVATE_COUNTER;
+    *ops = (*obj)->cdr;
+    *ops = cons(root, fn, ops);
+    *tmp = make_int(root, mode);
+    *ops = cons(root, tmp, ops);
+    compile_into(root, obj, Loop, ops);
+}
+
+static Obj *run_loop(void *root, Obj **env, Obj **node) {
+    if (is_stale(*node))
+        return revert(root, env, node);
+    DEFINE1(root, args);
+    int mode = operands(*node)->car->value;
+    Obj *fn = operands(*node)->cdr->car;
+    *args = operands(*node)->cdr->cdr;
+    if (fn->fn == prim_dotimes)
+        return eval_dotimes(root, env, args, mode);
+    return eval_dolist(root, env, args, mode);
+}
+
+// (funcall fn expr ...)
+static Obj *prim_funcall(void *root, Obj **args, int nargs, int line_num) {
+    if (nargs < 1)
+        error("Malformed funcall", line_num);
+    return call_values(root, args, args + 1, nargs - 1, line_num);
+}
+
+// (apply fn expr ... list) calls fn with the arguments expr ... followed by the elements of list.
+// A function gets the list itself as the tail of its arguments, and a primitive gets them in an
+// array on the C stack.
+static Obj *prim_apply(void *root, Obj **args, int nargs, int line_num) {
+    if (nargs < 2 || length(args[nargs - 1]) < 0)
+        error("Malformed apply", line_num);
+    if (args[0]->type == TFUNCTION) {
+        DEFINE2(root, list, env);
+        *list = args[nargs - 1];
+        for (int i = nargs - 2; i > 0; i--)
+            *list = cons(root, &args[i], list);
+        *env = Nil;
+        return apply_func(root, env, args, list);
+    }
+    int n = nargs - 2 + length(args[nargs - 1]);
+    check_stack_space((n + 2) * sizeof(void *), line_num);
+    void *frame[n + 2];
+    root = add_root_frame(root, n, frame);
+    Obj **argv = (Obj **)(frame + 1);
+    int i = 0;
+    for (; i < nargs - 2; i++)
+        argv[i] = args[i + 1];
+    for (Obj *p = args[nargs - 1]; p != Nil; p = p->cdr)
+        argv[i++] = p->car;
+    return call_values(root, args, argv, n, line_num);
+}
+
+// (gensym)
+static Obj *prim_gensym(void *root, Obj **args, int nargs, int line_num) {
+  static int count = 0;
+  char buf[10];
+  snprintf(buf, sizeof(buf), "G__%d", count++);
+  return make_symbol(root, buf);
+}
+
+// (length <cell> | length <string> | length ...)
+static Obj *prim_length(void *root, Obj **args, int nargs, int line_num) {
+    int len = nargs;
+    if (nargs == 1) {
+        Obj *car = args[0];
+        if (car->type == TSTRING) {
+            len = strlen(car->name);
+        }
+        else if (is_list(car)) {
+            for (len = 0; car != Nil && car->type == TCELL; car = car->cdr) 
+                len++;
+        }
+        else {
+            error("When length has a single argument, it must be a list or a string", 
+            line_num);
+        }
+    }
+
+    return make_int(root, len);
+}
+
+// (reverse ... | reverse <cell>)
+static Obj *prim_reverse(void *root, Obj **args, int nargs, int line_num) {
+    if (nargs != 1) {
+        DEFINE1(root, list);
+        *list = Nil;
+        for (int i = 0; i < nargs; i++)
+            *list = cons(root, &args[i], list);
+        return *list;
     }
     else { 
-        Obj *car = args->car;
+        Obj *car = args[0];
         if (car != Nil) { 
             if (car->type == TCELL) {
                 return reverse(car);
             }
-            else if(car->type == TSTRING){
-                char *left = car->name, 
-                     *right = left + strlen(car->name) - 1;
-                while (left <= right) {
-                    swap(left, right);
-                    left++, right--;
-                }
+            else if(car->type == TSTRING){
+                char *left = car->name, 
+                     *right = left + strlen(car->name) - 1;
+                while (left <= right) {
+                    swap(left, right);
+                    left++, right--;
+                }
+            }
+            else {
+                error("When reverse has a single argument, it must be a list", 
+                line_num);
+            }
+        }
+        return car;
+    }
+}
+
+// Checks that all the arguments of an arithmetic operator are integers.
+static void check_numbers(char *op, Obj **args, int nargs, int line_num) {
+    if (nargs == 0)
+        error("%s takes at least 1 number", line_num, op);
+    for (int i = 0; i < nargs; i++)
+        if (args[i]->type != TINT)
+            error("%s takes only numbers", line_num, op);
+}
+
+#define PRIM_ARITHMETIC_OP(PRIM_OP, OP, OPEQ)                           \
+static Obj *PRIM_OP(void *root, Obj **args, int nargs, int line_num) {  \
+    check_numbers(#OP, args, nargs, line_num);                          \
+    long long r = args[0]->value;                                       \
+    for (int i = 1; i < nargs; i++)                                     \
+        r OPEQ args[i]->value;                                          \
+    return make_int(root, r);                                           \
+}
+
+// (+ <integer> ...)
+PRIM_ARITHMETIC_OP(prim_plus, +, += )
+PRIM_ARITHMETIC_OP(prim_mult, *, *= )
+PRIM_ARITHMETIC_OP(prim_div , /, /= )
+PRIM_ARITHMETIC_OP(prim_modulo, %, %= )
+
+// (- <integer> ...)
+static Obj *prim_minus(void *root, Obj **args, int nargs, int line_num) {
+    check_numbers("-", args, nargs, line_num);
+    if (nargs == 1)
+        return make_int(root, -args[0]->value);
+    long long r = args[0]->value;
+    for (int i = 1; i < nargs; i++)
+        r -= args[i]->value;
+    return make_int(root, r);
+}
+
+// (op <integer> <integer>)
+#define PRIM_COMPARISON_OP(PRIM_OP, OP)                                 \
+static Obj *PRIM_OP(void *root, Obj **x, Obj **y, int line_num) {      \
+    if ((*x)->type != TINT || (*y)->type != TINT)                       \
+        error(#OP " takes only 2 numbers", line_num);                   \
+    return (*x)->value OP (*y)->value ? True : Nil;                     \
+}
+
+PRIM_COMPARISON_OP(prim_num_eq, ==)
+PRIM_COMPARISON_OP(prim_lt, <)
+PRIM_COMPARISON_OP(prim_lte, <=)
+PRIM_COMPARISON_OP(prim_gt, >)
+PRIM_COMPARISON_OP(prim_gte, >=)
+
+// (not <cell>)
+static Obj *prim_not(void *root, Obj **x, int line_num) {
+    return *x == Nil ? True : Nil;
+}
+
+static void load_file(void *root, char *fname, Obj **env, Obj **expr);
+
+static Obj *prim_load(void *root, Obj **env, Obj **list) {
+    DEFINE1(root, expr);
+    Obj *args = eval_list(root, env, list);
+    if (args->car->type != TSTRING){
+        error("load: filename must be a string", (*list)->line_num);
+    }
+    char *name = args->car->name;
+    
+    // Set up a handler, so that an error stops loading the file but not the caller. A throw goes
+    // on to its catch.
+    Handler h = { .prev = context, .stops_errors = true };
+    context = &h;
+    filepos_t calling_file = filepos;
+    if (setjmp(h.jmp) == 0)
+        load_file(root, name, env, expr);
+    filepos = calling_file;
+    context = h.prev;
+    if (thrown)
+        longjmp(context->jmp, 1);
+    return Nil;
+}
+
+// Evaluates the expressions with the handler set up. Returns NULL if they raise an error, which has
+// been reported already, or throw.
+static Obj *progn_or_null(void *root, Obj **env, Obj **body, Handler *h) {
+    DEFINE1(root, r);
+    h->prev = context;
+    context = h;
+    if (setjmp(h->jmp) == 0)
+        *r = progn(root, env, body);
+    else
+        *r = NULL;
+    context = h->prev;
+    return *r;
+}
+
+// (catch tag expr ...) evaluates the expressions, unless (throw tag value) is called meanwhile with
+// the same tag, in which case catch returns the value at once. A catch with the tag error also
+// handles the errors raised meanwhile, and returns their message.
+static Obj *prim_catch(void *root, Obj **env, Obj **list) {
+    if (length(*list) < 1)
+        error("Malformed catch", (*list)->line_num);
+    DEFINE3(root, tag, value, body);
+    *tag = (*list)->car;
+    *tag = eval(root, env, tag);
+    *body = (*list)->cdr;
+    Handler h = { .tag = tag, .value = value, .call_depth = call_depth };
+    Obj *r = progn_or_null(root, env, body, &h);
+    if (r)
+        return r;
+    if (!thrown && catches_errors(&h)) {
+        call_depth = h.call_depth;
+        return make_string(root, error_message);
+    }
+    if (thrown != &h)
+        longjmp(context->jmp, 1);
+    thrown = NULL;
+    call_depth = h.call_depth;
+    return *value;
+}
+
+// (throw tag value)
+static Obj *prim_throw(void *root, Obj **tag, Obj **value, int line_num) {
+    for (Handler *h = context; h; h = h->prev) {
+        if (h->tag && *h->tag == *tag) {
+            *h->value = *value;
+            thrown = h;
+            longjmp(context->jmp, 1);
+        }
+    }
+    error("throw: no catch for the tag", line_num);
+    return Nil;
+}
+
+// (with-limits (name value ...) expr ...) evaluates the expressions with the limits named steps,
+// alloc and depth lowered to the given values. What the expressions have consumed is then
+// counted against the limits outside, even if they raised an error.
+static Obj *prim_with_limits(void *root, Obj **env, Obj **list) {
+    if (length(*list) < 2 || !is_list((*list)->car) || length((*list)->car) % 2 != 0)
+        error("Malformed with-limits", (*list)->line_num);
+    long long steps = steps_left;
+    size_t alloc = alloc_left;
+    long limit = depth_limit;
+    DEFINE3(root, spec, value, body);
+    for (*spec = (*list)->car; *spec != Nil; *spec = (*spec)->cdr->cdr) {
+        Obj *name = (*spec)->car;
+        *value = (*spec)->cdr->car;
+        *value = eval(root, env, value);
+        if ((*value)->type != TINT || (*value)->value < 0)
+            error("with-limits: limit must be a non-negative integer", (*spec)->line_num);
+        long long n = (*value)->value;
+        if (name->type == TSYMBOL && strcmp(name->name, "steps") == 0)
+            steps = n < steps ? n : steps;
+        else if (name->type == TSYMBOL && strcmp(name->name, "alloc") == 0)
+            alloc = (unsigned long long)n < alloc ? (size_t)n : alloc;
+        else if (name->type == TSYMBOL && strcmp(name->name, "depth") == 0)
+            limit = n < limit - call_depth ? call_depth + n : limit;
+        else
+            error("with-limits: unknown limit", (*spec)->line_num);
+    }
+    long long outer_steps = steps_left;
+    size_t outer_alloc = alloc_left;
+    long outer_depth = call_depth, outer_limit = depth_limit;
+    steps_left = steps;
+    alloc_left = alloc;
+    depth_limit = limit;
+    *body = (*list)->cdr;
+
+    Handler h = { 0 };
+    *value = progn_or_null(root, env, body, &h);
+    steps_left = outer_steps - (steps - steps_left);
+    alloc_left = outer_alloc - (alloc - alloc_left);
+    call_depth = outer_depth;
+    depth_limit = outer_limit;
+    if (!*value)
+        longjmp(context->jmp, 1);
+    return *value;
+}
+
+// (with-timeout ms expr ...) evaluates the expressions, raising an error if they are still running
+// after ms milliseconds.
+static Obj *prim_with_timeout(void *root, Obj **env, Obj **list) {
+    if (length(*list) < 2)
+        error("Malformed with-timeout", (*list)->line_num);
+    DEFINE2(root, value, body);
+    *value = (*list)->car;
+    *value = eval(root, env, value);
+    if ((*value)->type != TINT || (*value)->value < 0)
+        error("with-timeout: time must be a non-negative integer", (*list)->line_num);
+    long long outer = deadline;
+    long long ms = now_ms() + (*value)->value;
+    if (!outer || ms < outer)
+        set_deadline(ms);
+    *body = (*list)->cdr;
+
+    Handler h = { 0 };
+    *value = progn_or_null(root, env, body, &h);
+    if (deadline != outer)
+        set_deadline(outer);
+    if (!*value)
+        longjmp(context->jmp, 1);
+    return *value;
+}
+
+// Creates a function. free is the list of its free variables, or NULL if they are not known yet.
+static Obj *handle_function(void *root, Obj **env, Obj **list, int type, Obj **free) {
+    if ((*list)->type != TCELL || !is_list((*list)->car) || (*list)->cdr->type != TCELL)
+        error("Malformed lambda", (*list)->line_num);
+    Obj *p = (*list)->car;
+    for (; p->type == TCELL; p = p->cdr)
+        if (p->car->type != TSYMBOL)
+            error("Parameter must be a symbol", (*list)->line_num);
+    if (p != Nil && p->type != TSYMBOL)
+        error("Parameter must be a symbol", (*list)->line_num);
+    DEFINE3(root, params, body, fenv);
+    *params = (*list)->car;
+    *body = (*list)->cdr;
+    if (optimize_level >= 1)
+        *body = fold_body(root, env, params, body);
+    *fenv = free ? *free : free_variables(root, env, params, body);
+    *fenv = closure_env(root, env, fenv);
+    return make_function(root, fenv, type, params, body);
+}
+
+// (lambda (<symbol> ...) expr ...)
+static Obj *prim_lambda(void *root, Obj **env, Obj **list) {
+    return handle_function(root, env, list, TFUNCTION, NULL);
+}
+
+// (and expr ...)
+static Obj *prim_and(void *root, Obj **env, Obj **list) {
+    DEFINE2(root, lp, r);
+    *r = True;
+    for (*lp = *list; *lp != Nil; *lp = (*lp)->cdr) {
+        *r = (*lp)->car;
+        if ((*r = eval(root, env, r)) == Nil)
+            break;
+    }
+    return *r;
+}
+
+// (or expr ...)
+static Obj *prim_or(void *root, Obj **env, Obj **list) {
+    DEFINE2(root, lp, r);
+    *r = Nil;
+    for (*lp = *list; *lp != Nil; *lp = (*lp)->cdr) {
+        *r = (*lp)->car;
+        if ((*r = eval(root, env, r)) != Nil)
+            break;
+    }
+    return *r;
+}
+
+// (when cond expr ...)
+static Obj *prim_when(void *root, Obj **env, Obj **list) {
+    if (length(*list) < 1)
+        error("Malformed when", (*list)->line_num);
+    DEFINE1(root, expr);
+    *expr = (*list)->car;
+    if (eval(root, env, expr) == Nil)
+        return Nil;
+    *expr = (*list)->cdr;
+    return progn(root, env, expr);
+}
+
+// (unless cond expr ...)
+static Obj *prim_unless(void *root, Obj **env, Obj **list) {
+    if (length(*list) < 1)
+        error("Malformed unless", (*list)->line_num);
+    DEFINE1(root, expr);
+    *expr = (*list)->car;
+    if (eval(root, env, expr) != Nil)
+        return Nil;
+    *expr = (*list)->cdr;
+    return progn(root, env, expr);
+}
+
+// (cond (cond expr ...) ...)
+//
+// Returns the value of the last expression of the first clause whose condition is true, or the
+// value of the condition if the clause has no expression.
+static Obj *prim_cond(void *root, Obj **env, Obj **list) {
+    if (length(*list) < 0)
+        error("Malformed cond", (*list)->line_num);
+    DEFINE2(root, lp, expr);
+    for (*lp = *list; *lp != Nil; *lp = (*lp)->cdr) {
+        if ((*lp)->car->type != TCELL || length((*lp)->car) < 0)
+            error("Malformed cond", (*lp)->line_num);
+        *expr = (*lp)->car->car;
+        *expr = eval(root, env, expr);
+        if (*expr == Nil)
+            continue;
+        if ((*lp)->car->cdr == Nil)
+            return *expr;
+        *expr = (*lp)->car->cdr;
+        return progn(root, env, expr);
+    }
+    return Nil;
+}
+
+// (case expr ((<key> ...) expr ...) ...)
+static Obj *prim_case(void *root, Obj **env, Obj **list) {
+    if ((*list)->type != TCELL || case_keys((*list)->cdr) < 0)
+        error("Malformed case", (*list)->line_num);
+    DEFINE2(root, key, lp);
+    *key = (*list)->car;
+    *key = eval(root, env, key);
+    for (*lp = (*list)->cdr; *lp != Nil; *lp = (*lp)->cdr) {
+        Obj *keys = (*lp)->car->car;
+        bool match = is_otherwise(keys);
+        if (keys->type != TCELL && keys != Nil)
+            match = match || case_match(keys, *key);
+        for (; !match && keys->type == TCELL; keys = keys->cdr)
+            match = case_match(keys->car, *key);
+        if (match) {
+            *lp = (*lp)->car->cdr;
+            return progn(root, env, lp);
+        }
+    }
+    return Nil;
+}
+
+// (let ((<symbol> expr) ...) expr ...)
+static Obj *prim_let(void *root, Obj **env, Obj **list) {
+    DEFINE2(root, bindings, body);
+    *bindings = let_bindings(root, list, body);
+    return eval_let(root, env, LET | OPEN_FRAME, bindings, body, NULL);
+}
+
+// (let* ((<symbol> expr) ...) expr ...)
+static Obj *prim_let_star(void *root, Obj **env, Obj **list) {
+    DEFINE2(root, bindings, body);
+    *bindings = let_bindings(root, list, body);
+    return eval_let(root, env, LET_STAR | OPEN_FRAME, bindings, body, NULL);
+}
+
+// (letrec ((<symbol> expr) ...) expr ...)
+static Obj *prim_letrec(void *root, Obj **env, Obj **list) {
+    DEFINE2(root, bindings, body);
+    *bindings = let_bindings(root, list, body);
+    return eval_let(root, env, LETREC | OPEN_FRAME, bindings, body, NULL);
+}
+
+// The program compiled by --compile-c being run, if any
+static NativeProgram *native_program;
+static unsigned long hash_form(Obj *obj);
+static void attach_native(Obj *fn, Obj *sym, unsigned long hash);
+
+static Obj *handle_defun(void *root, Obj **env, Obj **list, int type) {
+    if (length(*list) < 3 || (*list)->car->type != TSYMBOL || (*list)->cdr->type != TCELL)
+        error("Malformed defun: correct form is (defun <symbol> (<symbol> ...) expr ...)"
+        , (*list)->line_num);
+    DEFINE3(root, fn, sym, rest);
+    *sym = (*list)->car;
+    *rest = (*list)->cdr;
+    // The hash is computed before the body is compiled in place.
+    unsigned long hash = native_program ? hash_form(*list) : 0;
+    *fn = handle_function(root, env, rest, type, NULL);
+    if (native_program && type == TFUNCTION)
+        attach_native(*fn, *sym, hash);
+    invalidate_binding(env, *sym);
+    add_variable(root, env, sym, fn);
+    return *fn;
+}
+
+// (defun <symbol> (<symbol> ...) expr ...)
+static Obj *prim_defun(void *root, Obj **env, Obj **list) {
+    return handle_defun(root, env, list, TFUNCTION);
+}
+
+// (defun-memo <symbol> (<symbol> ...) expr ...)
+static Obj *prim_defun_memo(void *root, Obj **env, Obj **list) {
+    DEFINE2(root, fn, table);
+    *fn = handle_defun(root, env, list, TFUNCTION);
+    long size = memo_size > 0 ? memo_size : 1;
+    *table = alloc(root, TTABLE, sizeof(long) + sizeof(Obj *) * size);
+    (*table)->len = size;
+    for (long i = 0; i < size; i++)
+        (*table)->slots[i] = NULL;
+    (*fn)->memo = *table;
+    return *fn;
+}
+
+// (define <symbol> expr)
+static Obj *prim_define(void *root, Obj **env, Obj **list) {
+    if (length(*list) != 2 || (*list)->car->type != TSYMBOL)
+        error("Malformed define", (*list)->line_num);
+    DEFINE2(root, sym, value);
+    *sym = (*list)->car;
+    *value = (*list)->cdr->car;
+    *value = eval(root, env, value);
+    invalidate_binding(env, *sym);
+    add_variable(root, env, sym, value);
+    return *value;
+}
+
+// (defmacro <symbol> (<symbol> ...) expr ...)
+static Obj *prim_defmacro(void *root, Obj **env, Obj **list) {
+    return handle_defun(root, env, list, TMACRO);
+}
+
+// (macroexpand expr)
+static Obj *prim_macroexpand(void *root, Obj **env, Obj **list) {
+    if (length(*list) != 1)
+        error("Malformed macroexpand", (*list)->line_num);
+    DEFINE1(root, body);
+    *body = (*list)->car;
+    return macroexpand(root, env, body);
+}
+
+// (print ...)
+static Obj *prim_print(void *root, Obj **args, int nargs, int line_num) {
+    for (int i = 0; i < nargs; i++) {
+        if (i > 0)
+            fputc(' ', stdout);
+        print(args[i]);
+    }
+    return Nil;
+}
+
+
+// (println ...)
+static Obj *prim_println(void *root, Obj **args, int nargs, int line_num) {
+    prim_print(root, args, nargs, line_num);
+    fputc('\n', stdout);
+    return Nil;
+}
+
+static Obj *prim_progn(void *root, Obj **env, Obj **list) {
+    return progn(root, env, list);
+}
+
+// (if expr expr expr ...)
+static Obj *prim_if(void *root, Obj **env, Obj **list) {
+    if (length(*list) < 2)
+        error("Malformed if", (*list)->line_num);
+    DEFINE3(root, cond, then, els);
+    *cond = (*list)->car;
+    *cond = eval(root, env, cond);
+    if (*cond != Nil) {
+        *then = (*list)->cdr->car;
+        return eval(root, env, then);
+    }
+    *els = (*list)->cdr->cdr;
+    return *els == Nil ? Nil : progn(root, env, els);
+}
+
+// (eq expr expr)
+static Obj *prim_eq(void *root, Obj **x, Obj **y, int line_num) {
+    Obj *first = *x;
+    Obj *second = *y;
+    if (first->type == TSTRING){
+        if (second->type == TSTRING)
+            return strcmp(first->name, second->name) == 0 ? True : Nil;
+        else
+            error("The 2 arguments of eq must be of the same type", line_num);
+    } 
+    // Small integers are shared and the others are not, so integers are compared by value.
+    if (first->type == TINT && second->type == TINT)
+        return first->value == second->value ? True : Nil;
+    return first == second ? True : Nil;
+}
+
+// String primitives
+static Obj *prim_string_concat(void *root, Obj **args, int nargs, int line_num) {
+    // First pass: calculate total length needed
+    size_t total_len = 1;  // Start with 1 for null terminator
+    for (int i = 0; i < nargs; i++) {
+        if (args[i]->type != TSTRING && args[i]->type != TINT)
+            error("string-concat arguments must be strings or numbers", 
+            line_num);
+        if (args[i]->type == TINT) {
+            long long val = args[i]->value;
+            char var[22];
+            snprintf(var, sizeof(var), "%lld", val);
+            total_len += strlen(var);
+        }
+        else {
+            total_len += strlen(args[i]->name);
+        }
+    }
+    
+    char *buf = malloc(total_len);
+    if (!buf)
+        error("Out of memory in string-concat", line_num);
+    buf[0] = '\0';
+    
+    // Second pass: concatenate all strings
+    for (int i = 0; i < nargs; i++) {
+        if (args[i]->type == TINT) {
+            long long val = args[i]->value;
+            char var[22];
+            snprintf(var, sizeof(var), "%lld", val);
+            strcat(buf, var);
+        }
+        else {
+            strcat(buf, args[i]->name);
+        }
+    }
+    
+    Obj *result = make_string(root, buf);
+    free(buf);
+    return result;
+}
+
+static Obj *prim_symbol_to_string(void *root, Obj **x, int line_num) {
+    if ((*x)->type != TSYMBOL)
+        error("symbol->string argument must be a symbol", line_num);
+        
+    return make_string(root, (*x)->name);
+}
+
+static Obj *prim_string_to_symbol(void *root, Obj **x, int line_num) {
+    if ((*x)->type != TSTRING)
+        error("string->symbol argument must be a string", line_num);
+        
+    // Copy the name because intern() may run GC, which moves the string.
+    char name[strlen((*x)->name) + 1];
+    strcpy(name, (*x)->name);
+    return intern(root, name);
+}
+
+static Obj *prim_exit(void *root, Obj **x, int line_num) {
+    if ((*x)->type != TINT)
+        error("exit argument must be an integer", line_num);
+    exit((*x)->value);
+}
+
+static void add_primitive(void *root, Obj **env, char *name, Obj **prim) {
+    DEFINE1(root, sym);
+    *sym = intern(root, name);
+    add_variable(root, env, sym, prim);
+}
+
+// Special forms are primitives that take their arguments unevaluated.
+static void add_special_form(void *root, Obj **env, char *name, Primitive *fn) {
+    DEFINE1(root, prim);
+    *prim = make_primitive(root, name, SPECIAL_FORM);
+    (*prim)->fn = fn;
+    add_primitive(root, env, name, prim);
+}
+
+// Adds a primitive function taking arity arguments, or any number if arity is VARIADIC.
+static void add_subr(void *root, Obj **env, char *name, Subr *fn, int arity) {
+    DEFINE1(root, prim);
+    *prim = make_primitive(root, name, arity);
+    (*prim)->subr = fn;
+    add_primitive(root, env, name, prim);
+}
+
+static void add_subr1(void *root, Obj **env, char *name, Subr1 *fn) {
+    DEFINE1(root, prim);
+    *prim = make_primitive(root, name, 1);
+    (*prim)->subr1 = fn;
+    add_primitive(root, env, name, prim);
+}
+
+static void add_subr2(void *root, Obj **env, char *name, Subr2 *fn) {
+    DEFINE1(root, prim);
+    *prim = make_primitive(root, name, 2);
+    (*prim)->subr2 = fn;
+    add_primitive(root, env, name, prim);
+}
+
+static void define_constants(void *root, Obj **env) {
+    DEFINE1(root, sym);
+    *sym = intern(root, "t");
+    add_variable(root, env, sym, &True);
+}
+
+static size_t read_file(char *fname, char **text) {
+    size_t length = 0;
+    // The compiled programs have the files they load embedded.
+    for (int i = 0; native_program && i < native_program->nfiles; i++) {
+        if (strcmp(native_program->files[i].name, fname) == 0) {
+            filepos.filename = fname;
+            *text = strdup(native_program->files[i].text);
+            return strlen(*text);
+        }
+    }
+    FILE *f = fopen(fname, "r");
+    if (!f) {
+        printf("Failed to load file %s\n", fname);
+        return 0;
+    }
+
+    filepos.filename = fname;
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    
+    *text = malloc(length + 1);
+    if (!*text) {
+        puts("Out of memory.");
+        fclose(f);
+        return 0;
+    }
+
+    size_t read = fread(*text, 1, length, f);
+    if (read != length) {
+        printf("Failed to read entire file %s\n", fname);
+        free(*text);
+        *text = NULL;
+        fclose(f);
+        return 0;
+    }
+
+    (*text)[length] = '\0';
+    fclose(f);
+    return length;
+}
+
+// Evaluates the forms in the file. A throw out of them stops at the form throwing.
+static void load_file(void *root, char *fname, Obj **env, Obj **expr) {
+    char *text = NULL;
+    size_t len = read_file(fname, &text);
+    if (len == 0) return;
+
+    // Save old stdin
+    FILE *old_stdin = stdin;
+    // Create a single stream for the entire file
+    FILE *stream = fmemopen(text, len, "r");
+    if (!stream) {
+        free(text);
+        error("Failed to create memory stream for %s", (*expr)->line_num, fname);
+        return;
+    }
+
+    // Redirect stdin to the memory stream
+    stdin = stream;
+    filepos.filename = fname;
+    filepos.file_len = len;
+    filepos.line_num = 1;
+
+    int eval_input(void *root, Obj **env, Obj **expr);
+    // Process expressions until we reach end of file
+    while (!feof(stream) && !thrown) {
+        eval_input(root, env, expr);
+    }
+
+    // Cleanup
+    stdin = old_stdin;
+    fclose(stream);
+    free(text);
+}
+
+void process_file(char *fname, Obj **env, Obj **expr) {
+    load_file(gc_root, fname, env, expr);
+}
+
+static void define_primitives(void *root, Obj **env) {
+    add_special_form(root, env, "quote", prim_quote);
+    add_special_form(root, env, "quasiquote", prim_quasiquote);
+    add_special_form(root, env, "multiple-value-bind", prim_multiple_value_bind);
+    add_special_form(root, env, "catch", prim_catch);
+    add_special_form(root, env, "setq", prim_setq);
+    add_special_form(root, env, "declare", prim_declare);
+    add_special_form(root, env, "while", prim_while);
+    add_special_form(root, env, "dotimes", prim_dotimes);
+    add_special_form(root, env, "dolist", prim_dolist);
+    add_special_form(root, env, "define", prim_define);
+    add_special_form(root, env, "defun", prim_defun);
+    add_special_form(root, env, "defun-memo", prim_defun_memo);
+    add_special_form(root, env, "defmacro", prim_defmacro);
+    add_special_form(root, env, "macroexpand", prim_macroexpand);
+    add_special_form(root, env, "lambda", prim_lambda);
+    add_special_form(root, env, "if", prim_if);
+    add_special_form(root, env, "progn", prim_progn);
+    add_special_form(root, env, "let", prim_let);
+    add_special_form(root, env, "let*", prim_let_star);
+    add_special_form(root, env, "letrec", prim_letrec);
+    add_special_form(root, env, "and", prim_and);
+    add_special_form(root, env, "or", prim_or);
+    add_special_form(root, env, "when", prim_when);
+    add_special_form(root, env, "unless", prim_unless);
+    add_special_form(root, env, "cond", prim_cond);
+    add_special_form(root, env, "case", prim_case);
+    add_special_form(root, env, "load", prim_load);
+    add_special_form(root, env, "with-limits", prim_with_limits);
+    add_special_form(root, env, "with-timeout", prim_with_timeout);
+    add_subr(root, env, "list", prim_list, VARIADIC);
+    add_subr1(root, env, "atom", prim_atom);
+    add_subr2(root, env, "cons", prim_cons);
+    add_subr1(root, env, "car", prim_car);
+    add_subr1(root, env, "cdr", prim_cdr);
+    add_subr2(root, env, "setcar", prim_setcar);
+    add_subr(root, env, "gensym", prim_gensym, 0);
+    add_subr1(root, env, "not", prim_not);
+    add_subr(root, env, "+", prim_plus, VARIADIC);
+    add_subr(root, env, "-", prim_minus, VARIADIC);
+    add_subr(root, env, "*", prim_mult, VARIADIC);
+    add_subr(root, env, "/", prim_div, VARIADIC);
+    add_subr(root, env, "mod", prim_modulo, VARIADIC);
+    add_subr(root, env, "length", prim_length, VARIADIC);
+    add_subr(root, env, "reverse", prim_reverse, VARIADIC);
+    add_subr2(root, env, "<", prim_lt);
+    add_subr2(root, env, ">", prim_gt);
+    add_subr2(root, env, "<=", prim_lte);
+    add_subr2(root, env, ">=", prim_gte);
+    add_subr2(root, env, "=", prim_num_eq);
+    add_subr2(root, env, "eq", prim_eq);
+    add_subr(root, env, "print", prim_print, VARIADIC);
+    add_subr(root, env, "println", prim_println, VARIADIC);
+    add_subr(root, env, "string-concat", prim_string_concat, VARIADIC);
+    add_subr1(root, env, "symbol->string", prim_symbol_to_string);
+    add_subr1(root, env, "string->symbol", prim_string_to_symbol);
+    add_subr1(root, env, "exit", prim_exit);
+    add_subr2(root, env, "throw", prim_throw);
+    add_subr(root, env, "funcall", prim_funcall, VARIADIC);
+    add_subr(root, env, "apply", prim_apply, VARIADIC);
+    add_subr(root, env, "values", prim_values, VARIADIC);
+    add_subr1(root, env, "make-generator", prim_make_generator);
+    add_subr1(root, env, "next", prim_next);
+    add_subr1(root, env, "done?", prim_done);
+    add_special_form(root, env, "delay", prim_delay);
+    add_special_form(root, env, "cons-stream", prim_cons_stream);
+    add_subr1(root, env, "force", prim_force);
+    add_subr1(root, env, "stream-cdr", prim_stream_cdr);
+    add_subr2(root, env, "stream-map", prim_stream_map);
+    add_subr2(root, env, "stream-filter", prim_stream_filter);
+    add_subr2(root, env, "stream-take", prim_stream_take);
+    add_subr(root, env, "stream-fold", prim_stream_fold, 3);
+}
+
+//======================================================================
+// Entry point
+//======================================================================
+
+extern void *memory;
+
+void init_minilisp(Obj **env) {
+    // Memory allocation
+    extern void *alloc_semispace();
+    memory = alloc_semispace();
+
+    // Constants and primitives
+    init_small_ints();
+    Symbols = Nil;
+    *env = make_env(NULL, &Nil, &Nil);
+    define_constants(NULL, env);
+    define_primitives(NULL, env);
+#ifndef MINILISP_NO_JIT
+    if (jit)
+        init_jit();
+#endif
+}
+
+// The number of eval_input() calls in progress. Those run by load share the limits of the form
+// calling load.
+static int input_level = 0;
+
+int eval_input(void *root, Obj **env, Obj **expr) {
+    int level = input_level++;
+    Handler h = { .prev = context, .stops_errors = true };
+    context = &h;
+    if (setjmp(h.jmp) == 0) {
+        while (true) {
+            if (level == 0)
+                reset_limits();
+            *expr = read_expr(root);         
+            if (!*expr) {
+                input_level = level;
+                context = h.prev;
+                return 0;
+            }
+            if (*expr == Cparen)
+                error("Stray close parenthesis", (*expr)->line_num);
+            if (*expr == Dot)
+                error("Stray dot", (*expr)->line_num);
+            print(eval(root, env, expr));
+            putc('\n', stdout);
+        }
+    }
+    input_level = level;
+    context = h.prev;
+    if (level == 0 && deadline)
+        set_deadline(0);
+    return 0;
+}
+
+//======================================================================
+// Ahead-of-time compiler
+//
+// minilisp --compile-c out.c FILE ... translates the functions defined with defun in the given
+// files, and in the files they load, into C. The generated file embeds the source of all these
+// files. Its main() runs them with the interpreter through aot_main(), and when a defun form is
+// evaluated, the native code compiled from the same form is attached to the function, so that
+// call_func() runs it instead of the body. Everything else, e.g. the top-level forms, macros,
+// lambdas and load, is interpreted as usual. The generated file is built with gc.c and minilisp.c:
+//
+//   cc -Isrc -o prog out.c src/gc.c src/minilisp.c
+//
+// A function is compiled only if its body is made of constants, parameters, global variables,
+// function calls, setq, if, progn, while, and, or, when, unless, cond, let, let*, dotimes and
+// dolist. Macros are expanded when the program is compiled. The other functions are left to the
+// interpreter. The arithmetic and comparisons of two integers, car and cdr are done inline as long
+// as the global variables they are bound to still hold the primitives.
+//
+// The compiled code keeps its values in a root frame, like the C functions of the interpreter.
+// The constants, the primitives inlined and the bindings of the global variables it refers to are
+// kept in a static root frame at the bottom of the GC roots. A global binding is looked up again
+// when the epoch changes, since define creates a new binding.
+//======================================================================
+
+Obj *aot_nil, *aot_true;
+long long *aot_epoch = &epoch;
+
+static Obj **native_env;
+
+// The hash of a form. Compiled code is printed as it was written, so it's hashed the same way.
+static unsigned long hash_form(Obj *obj) {
+    unsigned long h = obj->type;
+    if (obj->type == TCELL && obj->car->type == TNODE)
+        return hash_form(obj->cdr->car);
+    switch (obj->type) {
+    case TINT:
+        return h * 31 + (unsigned long)obj->value;
+    case TSYMBOL:
+    case TSTRING:
+        for (char *p = obj->name; *p; p++)
+            h = h * 33 + (unsigned char)*p;
+        return h;
+    case TCELL:
+        check_stack(obj->line_num);
+        for (; obj->type == TCELL; obj = obj->cdr)
+            h = h * 31 + hash_form(obj->car);
+        return h * 31 + hash_form(obj);
+    default:
+        return h;
+    }
+}
+
+// Attaches the native code compiled from the defun form, if any, to the function.
+static void attach_native(Obj *fn, Obj *sym, unsigned long hash) {
+    for (int i = 0; i < native_program->nfunctions; i++) {
+        NativeFunction *f = &native_program->functions[i];
+        if (f->hash == hash && strcmp(f->name, sym->name) == 0) {
+            fn->code = f->code;
+            return;
+        }
+    }
+}
+
+static Obj *global_binding(char *name) {
+    for (Obj *p = (*native_env)->vars; p != Nil; p = p->cdr)
+        if (strcmp(p->car->car->name, name) == 0)
+            return p->car;
+    return NULL;
+}
+
+void aot_enter(int line_num) {
+    check_stack(line_num);
+    count_step(line_num);
+}
+
+// Called on each iteration of a loop.
+void aot_step(int line_num) {
+    count_step(line_num);
+}
+
+Obj *aot_int(void *root, long long value) {
+    return make_int(root, value);
+}
+
+Obj *aot_counter(void *root) {
+    return make_counter(root);
+}
+
+// Returns the binding of the global variable, which is cached in *cell until the epoch changes.
+Obj *aot_global(Obj **cell, long long *cell_epoch, char *name, int line_num) {
+    Obj *bind = global_binding(name);
+    if (!bind)
+        error("Undefined symbol: %s", line_num, name);
+    *cell_epoch = epoch;
+    return *cell = bind;
+}
+
+void aot_setq(Obj **cell, long long *cell_epoch, char *name, Obj *value, int line_num) {
+    if (*cell_epoch != epoch) {
+        *cell = global_binding(name);
+        if (!*cell)
+            error("Unbound variable %s", line_num, name);
+        *cell_epoch = epoch;
+    }
+    invalidate_value((*cell)->cdr);
+    (*cell)->cdr = value;
+}
+
+// Applies the function to the arguments, which must be in a root frame.
+Obj *aot_call(void *root, Obj *fn, Obj **args, int nargs, int line_num) {
+    if (fn->type == TPRIMITIVE && !is_special_form(fn)) {
+        if (fn->arity != VARIADIC && fn->arity != nargs)
+            error("Wrong number of arguments to %s", line_num, fn->prim_name);
+        nvalues = 0;
+        if (fn->arity == 1)
+            return primitive_value(fn, fn->subr1(root, &args[0], line_num));
+        if (fn->arity == 2)
+            return primitive_value(fn, fn->subr2(root, &args[0], &args[1], line_num));
+        return primitive_value(fn, fn->subr(root, args, nargs, line_num));
+    }
+    if (fn->type != TFUNCTION)
+        error("The head of a list must be a function", line_num);
+    if (fn->code) {
+        if (nargs < length(fn->params))
+            error("Cannot apply function: number of argument does not match", fn->line_num);
+        return fn->code(root, args, nargs, fn->line_num);
+    }
+    DEFINE2(root, f, list);
+    *f = fn;
+    *list = Nil;
+    for (int i = nargs - 1; i >= 0; i--)
+        *list = cons(root, &args[i], list);
+    return apply_func(root, native_env, f, list);
+}
+
+static Obj *read_from_string(void *root, char *text) {
+    FILE *old_stdin = stdin;
+    stdin = fmemopen(text, strlen(text), "r");
+    int line_num = filepos.line_num;
+    Obj *r = read_expr(root);
+    filepos.line_num = line_num;
+    fclose(stdin);
+    stdin = old_stdin;
+    return r;
+}
+
+static void run_native_program(void) {
+    NativeProgram *p = native_program;
+    static void *frame[4];
+    gc_root = add_root_frame(NULL, p->nroots, p->roots);
+    gc_root = add_root_frame(gc_root, 2, frame);
+    Obj **env = (Obj **)(frame + 1), **expr = (Obj **)(frame + 2);
+    init_minilisp(env);
+    native_env = env;
+    aot_nil = Nil;
+    aot_true = True;
+    Obj **r = (Obj **)(p->roots + 1);
+    for (int i = 0; i < p->nconstants; i++)
+        r[i] = read_from_string(gc_root, p->constants[i]);
+    for (int i = 0; i < p->nprimitives; i++) {
+        Obj *bind = global_binding(p->primitives[i]);
+        r[p->nconstants + i] = bind ? bind->cdr : NULL;
+    }
+    for (int i = 0; i < p->nmain_files; i++)
+        process_file(p->main_files[i], env, expr);
+}
+
+int aot_main(NativeProgram *program) {
+    native_program = program;
+    run_on_stack((size_t)512 * 1024 * 1024, run_native_program);
+    return 0;
+}
+
+// The state of the compiler. The code of the function being compiled is written to body.
+// Its values are kept in the array v of its root frame, and its parameters in args.
+static FILE *body;
+static int nslots, indent, nloops;
+
+// The names of the objects in the static root frame
+typedef struct {
+    char **names;
+    int len;
+} Names;
+
+static Names constants, primitives, globals;
+
+// The local variables in scope. A parameter i is args[i], and the other variables v[slot].
+#define MAX_SCOPE 256
+static struct {
+    Obj *sym;
+    bool param;
+    int index;
+} scope[MAX_SCOPE];
+static int nscope;
+
+static int add_name(Names *names, char *name, bool unique) {
+    if (unique)
+        for (int i = 0; i < names->len; i++)
+            if (strcmp(names->names[i], name) == 0)
+                return i;
+    names->names = realloc(names->names, sizeof(char *) * (names->len + 1));
+    names->names[names->len] = strdup(name);
+    return names->len++;
+}
+
+static void truncate_names(Names *names, int len) {
+    while (names->len > len)
+        free(names->names[--names->len]);
+}
+
+static void emit(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(body, "%*s", indent * 4, "");
+    vfprintf(body, fmt, ap);
+    fputc('\n', body);
+    va_end(ap);
+}
+
+static void use_slot(int slot) {
+    if (nslots <= slot)
+        nslots = slot + 1;
+}
+
+static void write_cstring(FILE *f, char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if (*s == '\n')
+            fputs("\\n", f);
+        else if (isprint((unsigned char)*s))
+            fputc(*s, f);
+        else
+            fprintf(f, "\\%03o", (unsigned char)*s);
+    }
+    fputc('"', f);
+}
+
+// Writes the object in the syntax of the reader. Returns false if it can't be read back.
+static bool write_constant(FILE *f, Obj *obj) {
+    switch (obj->type) {
+    case TINT:
+        fprintf(f, "%lld", obj->value);
+        return true;
+    case TSYMBOL:
+        fputs(obj->name, f);
+        return true;
+    case TNIL:
+        fputs("()", f);
+        return true;
+    case TSTRING:
+        fputc('"', f);
+        for (char *p = obj->name; *p; p++) {
+            if (*p == '"' || *p == '\\')
+                fputc('\\', f);
+            fputc(*p, f);
+        }
+        fputc('"', f);
+        return true;
+    case TCELL:
+        if (obj->car->type == TNODE)
+            return false;
+        fputc('(', f);
+        for (;;) {
+            if (!write_constant(f, obj->car))
+                return false;
+            if (obj->cdr == Nil)
+                break;
+            if (obj->cdr->type != TCELL) {
+                fputs(" . ", f);
+                if (!write_constant(f, obj->cdr))
+                    return false;
+                break;
             }
-            else {
-                error("When reverse has a single argument, it must be a list", 
-                (*list)->line_num);
+            fputc(' ', f);
+            obj = obj->cdr;
+        }
+        fputc(')', f);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Returns the index of the local variable in the scope, or -1.
+static int find_local(Obj *sym) {
+    for (int i = nscope - 1; i >= 0; i--)
+        if (scope[i].sym == sym)
+            return i;
+    return -1;
+}
+
+static bool push_local(Obj *sym, bool param, int index) {
+    if (nscope == MAX_SCOPE)
+        return false;
+    scope[nscope].sym = sym;
+    scope[nscope].param = param;
+    scope[nscope].index = index;
+    nscope++;
+    return true;
+}
+
+// Writes the C expression of the local variable into buf.
+static char *local_ref(char *buf, int i) {
+    sprintf(buf, scope[i].param ? "args[%d]" : "v[%d]", scope[i].index);
+    return buf;
+}
+
+// Writes the C expression of the binding of the global variable into buf.
+static void emit_global(char *buf, Obj *sym, int line_num) {
+    int g = add_name(&globals, sym->name, true);
+    FILE *f = fmemopen(buf, 512, "w");
+    fprintf(f, "GLOBAL(%d, ", g);
+    write_cstring(f, sym->name);
+    fprintf(f, ", %d)", line_num);
+    fclose(f);
+}
+
+static bool gen(Obj **env, Obj *expr, int t);
+
+static bool gen_progn(Obj **env, Obj *list, int t) {
+    use_slot(t);
+    if (list == Nil)
+        emit("v[%d] = aot_nil;", t);
+    for (; list != Nil; list = list->cdr)
+        if (!gen(env, list->car, t))
+            return false;
+    return true;
+}
+
+static bool gen_constant(Obj *obj, int t) {
+    char *text;
+    size_t len;
+    FILE *f = open_memstream(&text, &len);
+    bool ok = write_constant(f, obj);
+    fclose(f);
+    if (ok)
+        emit("v[%d] = R[%d];", t, add_name(&constants, text, false));
+    free(text);
+    return ok;
+}
+
+// Emits the closing braces of n blocks.
+static void close_blocks(int n) {
+    for (; n > 0; n--) {
+        indent--;
+        emit("}");
+    }
+}
+
+static bool gen_and_or(Obj **env, Obj *args, int t, bool is_and) {
+    if (args == Nil) {
+        emit("v[%d] = %s;", t, is_and ? "aot_true" : "aot_nil");
+        return true;
+    }
+    int n = 0;
+    for (; args != Nil; args = args->cdr) {
+        if (!gen(env, args->car, t))
+            return false;
+        if (args->cdr != Nil) {
+            emit("if (v[%d] %s aot_nil) {", t, is_and ? "!=" : "==");
+            indent++;
+            n++;
+        }
+    }
+    close_blocks(n);
+    return true;
+}
+
+static bool gen_cond(Obj **env, Obj *clauses, int t) {
+    int n = 0;
+    for (; clauses != Nil; clauses = clauses->cdr) {
+        Obj *clause = clauses->car;
+        if (clause->type != TCELL || length(clause) < 0 || !gen(env, clause->car, t))
+            return false;
+        emit("if (v[%d] != aot_nil) {", t);
+        indent++;
+        if (clause->cdr != Nil && !gen_progn(env, clause->cdr, t))
+            return false;
+        indent--;
+        emit("} else {");
+        indent++;
+        n++;
+    }
+    emit("v[%d] = aot_nil;", t);
+    close_blocks(n);
+    return true;
+}
+
+// Compiles (let ((var expr) ...) body ...) and (let* ...). The variables are in v[t], v[t + 1], ...
+static bool gen_let(Obj **env, Obj *args, int t, bool sequential) {
+    if (length(args) < 2)
+        return false;
+    int base = nscope, n = 0;
+    Obj *bindings = args->car, *body_forms = args->cdr;
+    if (bindings->type == TSYMBOL) {
+        // (let var expr body ...)
+        if (length(args) < 3 || !gen(env, args->cdr->car, t) || !push_local(bindings, false, t))
+            return false;
+        n = 1;
+        body_forms = args->cdr->cdr;
+    } else {
+        for (Obj *p = bindings; p != Nil; p = p->cdr, n++) {
+            Obj *b = p->type == TCELL ? p->car : Nil;
+            if (b->type != TCELL || b->car->type != TSYMBOL || (length(b) != 1 && length(b) != 2))
+                return false;
+            use_slot(t + n);
+            if (b->cdr == Nil)
+                emit("v[%d] = aot_nil;", t + n);
+            else if (!gen(env, b->cdr->car, t + n))
+                return false;
+            if (sequential && !push_local(b->car, false, t + n))
+                return false;
+        }
+        if (!sequential) {
+            int i = 0;
+            for (Obj *p = bindings; p != Nil; p = p->cdr, i++)
+                if (!push_local(p->car->car, false, t + i))
+                    return false;
+        }
+    }
+    bool ok = gen_progn(env, body_forms, t + n);
+    nscope = base;
+    if (n > 0)
+        emit("v[%d] = v[%d];", t, t + n);
+    return ok;
+}
+
+// Compiles (dotimes (var count [result]) body ...) and (dolist (var list [result]) body ...). The
+// count or the list is in v[t], and the variable in v[t + 1]. The counter of a dotimes is updated
+// in place as in eval_dotimes if the body keeps it private, which a local variable can't be
+// trusted to do either, since it may hide one of the primitives keeps_private trusts.
+static bool gen_loop(Obj **env, Obj *args, int t, bool is_dotimes, int line_num) {
+    Obj *spec = args->type == TCELL ? args->car : Nil;
+    if (spec->type != TCELL || spec->car->type != TSYMBOL
+        || (length(spec) != 2 && length(spec) != 3) || length(args) < 0)
+        return false;
+    if (!gen(env, spec->cdr->car, t))
+        return false;
+    bool private = is_dotimes && keeps_private(env, args->cdr, args->cdr, spec->car);
+    for (int i = 0; private && i < nscope; i++) {
+        Obj *bind = find(env, scope[i].sym);
+        if (bind && drops_args(bind->cdr))
+            private = false;
+    }
+    use_slot(t + 1);
+    int base = nscope, loop = nloops++;
+    if (!push_local(spec->car, false, t + 1))
+        return false;
+    if (is_dotimes) {
+        emit("if (v[%d]->type != TINT)", t);
+        emit("    error(\"dotimes: count must be an integer\", %d);", line_num);
+        if (private) {
+            emit("long long e%d = *aot_epoch;", loop);
+            emit("v[%d] = aot_counter(root);", t + 1);
+        }
+        emit("for (long long i%d = 0, n%d = v[%d]->value; i%d < n%d; i%d++) {",
+             loop, loop, t, loop, loop, loop);
+        indent++;
+        emit("aot_step(%d);", line_num);
+        if (private) {
+            emit("if (*aot_epoch == e%d)", loop);
+            emit("    v[%d]->value = i%d;", t + 1, loop);
+            emit("else");
+            emit("    v[%d] = aot_int(root, i%d);", t + 1, loop);
+        } else {
+            emit("v[%d] = aot_int(root, i%d);", t + 1, loop);
+        }
+    } else {
+        emit("if (v[%d] != aot_nil && v[%d]->type != TCELL)", t, t);
+        emit("    error(\"dolist: argument must be a list\", %d);", line_num);
+        emit("for (; v[%d]->type == TCELL; v[%d] = v[%d]->cdr) {", t, t, t);
+        indent++;
+        emit("aot_step(%d);", line_num);
+        emit("v[%d] = v[%d]->car;", t + 1, t);
+    }
+    bool ok = args->cdr == Nil || gen_progn(env, args->cdr, t + 2);
+    close_blocks(1);
+    emit(is_dotimes ? "v[%d] = v[%d];" : "v[%d] = aot_nil;", t + 1, t);
+    if (ok && spec->cdr->cdr != Nil)
+        ok = gen(env, spec->cdr->cdr->car, t);
+    else
+        emit("v[%d] = aot_nil;", t);
+    nscope = base;
+    return ok;
+}
+
+static bool gen_special(Obj **env, Obj *fn, Obj *expr, int t) {
+    Obj *args = expr->cdr;
+    int nargs = length(args);
+    if (fn->fn == prim_quote)
+        return nargs == 1 && gen_constant(args->car, t);
+    if (fn->fn == prim_progn)
+        return gen_progn(env, args, t);
+    if (fn->fn == prim_if) {
+        if (nargs < 2 || !gen(env, args->car, t))
+            return false;
+        emit("if (v[%d] != aot_nil) {", t);
+        indent++;
+        if (!gen(env, args->cdr->car, t))
+            return false;
+        indent--;
+        emit("} else {");
+        indent++;
+        if (!gen_progn(env, args->cdr->cdr, t))
+            return false;
+        close_blocks(1);
+        return true;
+    }
+    if (fn->fn == prim_while) {
+        if (nargs < 2)
+            return false;
+        emit("for (;;) {");
+        indent++;
+        emit("aot_step(%d);", expr->line_num);
+        if (!gen(env, args->car, t))
+            return false;
+        emit("if (v[%d] == aot_nil)", t);
+        emit("    break;");
+        if (!gen_progn(env, args->cdr, t))
+            return false;
+        close_blocks(1);
+        emit("v[%d] = aot_nil;", t);
+        return true;
+    }
+    if (fn->fn == prim_setq) {
+        if (nargs != 2 || args->car->type != TSYMBOL || !gen(env, args->cdr->car, t))
+            return false;
+        int i = find_local(args->car);
+        char buf[512];
+        if (i >= 0) {
+            emit("%s = v[%d];", local_ref(buf, i), t);
+            return true;
+        }
+        int g = add_name(&globals, args->car->name, true);
+        FILE *f = fmemopen(buf, sizeof(buf), "w");
+        write_cstring(f, args->car->name);
+        fclose(f);
+        emit("aot_setq(&G(%d), &E[%d], %s, v[%d], %d);", g, g, buf, t, expr->line_num);
+        return true;
+    }
+    if (fn->fn == prim_declare) {
+        // The declarations are checked like the interpreter does.
+        for (Obj *p = args; nargs >= 0 && p != Nil; p = p->cdr) {
+            Obj *spec = p->car;
+            if (spec->type != TCELL || spec->car->type != TSYMBOL || length(spec) < 0
+                || strcmp(spec->car->name, "fixnum") != 0)
+                return false;
+            for (Obj *q = spec->cdr; q != Nil; q = q->cdr) {
+                int i = q->car->type == TSYMBOL ? find_local(q->car) : -1;
+                if (i < 0)
+                    return false;
+                char buf[512];
+                emit("if (safety > 0 && %s->type != TINT)", local_ref(buf, i));
+                FILE *f = fmemopen(buf, sizeof(buf), "w");
+                write_cstring(f, q->car->name);
+                fclose(f);
+                emit("    error(\"%%s is declared fixnum but is not an integer\", %d, %s);",
+                     expr->line_num, buf);
             }
         }
-        return car;
+        emit("v[%d] = aot_nil;", t);
+        return nargs >= 0;
+    }
+    if (fn->fn == prim_and || fn->fn == prim_or)
+        return nargs >= 0 && gen_and_or(env, args, t, fn->fn == prim_and);
+    if (fn->fn == prim_when || fn->fn == prim_unless) {
+        if (nargs < 1 || !gen(env, args->car, t))
+            return false;
+        emit("if (v[%d] %s aot_nil) {", t, fn->fn == prim_when ? "!=" : "==");
+        indent++;
+        if (!gen_progn(env, args->cdr, t))
+            return false;
+        indent--;
+        emit("} else {");
+        emit("    v[%d] = aot_nil;", t);
+        emit("}");
+        return true;
+    }
+    if (fn->fn == prim_cond)
+        return nargs >= 0 && gen_cond(env, args, t);
+    if (fn->fn == prim_let || fn->fn == prim_let_star)
+        return gen_let(env, args, t, fn->fn == prim_let_star);
+    if (is_loop(fn))
+        return gen_loop(env, args, t, fn->fn == prim_dotimes, expr->line_num);
+    return false;
+}
+
+// The primitives applied to two integers inline, and the C operators doing the same
+static char *inline_ops[][2] = {
+    { "+", "+" }, { "-", "-" }, { "*", "*" },
+    { "<", "<" }, { "<=", "<=" }, { ">", ">" }, { ">=", ">=" }, { "=", "==" },
+};
+
+static bool gen_call(Obj **env, Obj *expr, int t) {
+    int n = 0;
+    for (Obj *p = expr->cdr; p != Nil; p = p->cdr, n++)
+        if (!gen(env, p->car, t + n))
+            return false;
+    use_slot(t);
+    Obj *head = expr->car;
+    if (head->type != TSYMBOL)
+        return false;
+    char fn[512];
+    int i = find_local(head);
+    if (i >= 0) {
+        local_ref(fn, i);
+    } else {
+        emit_global(fn, head, expr->line_num);
+        strcat(fn, "->cdr");
+    }
+    char call[1024];
+    snprintf(call, sizeof(call), "v[%d] = aot_call(root, %s, &v[%d], %d, %d);",
+             t, fn, t, n, expr->line_num);
+    if (i >= 0) {
+        emit("%s", call);
+        return true;
+    }
+    int nops = sizeof(inline_ops) / sizeof(inline_ops[0]);
+    for (int k = 0; n == 2 && k < nops; k++) {
+        if (strcmp(head->name, inline_ops[k][0]) != 0)
+            continue;
+        int p = add_name(&primitives, head->name, true);
+        emit("if (v[%d]->type == TINT && v[%d]->type == TINT && %s == P(%d))", t, t + 1, fn, p);
+        if (k < 3)
+            emit("    v[%d] = aot_int(root, v[%d]->value %s v[%d]->value);",
+                 t, t, inline_ops[k][1], t + 1);
+        else
+            emit("    v[%d] = v[%d]->value %s v[%d]->value ? aot_true : aot_nil;",
+                 t, t, inline_ops[k][1], t + 1);
+        emit("else");
+        emit("    %s", call);
+        return true;
+    }
+    if (n == 2 && strcmp(head->name, "eq") == 0) {
+        int p = add_name(&primitives, head->name, true);
+        emit("if (v[%d]->type != TSTRING && v[%d]->type != TINT && %s == P(%d))", t, t, fn, p);
+        emit("    v[%d] = v[%d] == v[%d] ? aot_true : aot_nil;", t, t, t + 1);
+        emit("else");
+        emit("    %s", call);
+        return true;
+    }
+    if (n == 1 && (strcmp(head->name, "car") == 0 || strcmp(head->name, "cdr") == 0)) {
+        int p = add_name(&primitives, head->name, true);
+        emit("if (v[%d]->type == TCELL && %s == P(%d))", t, fn, p);
+        emit("    v[%d] = v[%d]->%s;", t, t, head->name);
+        emit("else");
+        emit("    %s", call);
+        return true;
+    }
+    emit("%s", call);
+    return true;
+}
+
+// Emits the code storing the value of the expression into v[t]. It may use the slots above t.
+// Returns false if the expression can't be compiled. This must not allocate any object, since it
+// keeps pointers to symbols in scope.
+static bool gen(Obj **env, Obj *expr, int t) {
+    check_stack(expr->line_num);
+    use_slot(t);
+    char buf[512];
+    switch (expr->type) {
+    case TNIL:
+        emit("v[%d] = aot_nil;", t);
+        return true;
+    case TINT:
+    case TSTRING:
+        return gen_constant(expr, t);
+    case TSYMBOL: {
+        int i = find_local(expr);
+        if (i >= 0)
+            emit("v[%d] = %s;", t, local_ref(buf, i));
+        else {
+            emit_global(buf, expr, expr->line_num);
+            emit("v[%d] = %s->cdr;", t, buf);
+        }
+        return true;
+    }
+    case TCELL:
+        break;
+    default:
+        return false;
+    }
+    if (expr->car->type == TNODE || length(expr) < 0)
+        return false;
+    if (expr->car->type == TSYMBOL && find_local(expr->car) < 0) {
+        Obj *bind = find(env, expr->car);
+        if (bind && is_special_form(bind->cdr))
+            return gen_special(env, bind->cdr, expr, t);
+        if (bind && bind->cdr->type == TMACRO)
+            return false;
+    }
+    return gen_call(env, expr, t);
+}
+
+// Returns a copy of the code in which the macros are expanded.
+static Obj *expand_macros(void *root, Obj **env, Obj **obj) {
+    if ((*obj)->type != TCELL)
+        return *obj;
+    check_stack((*obj)->line_num);
+    DEFINE3(root, head, lp, expr);
+    if ((*obj)->car->type == TSYMBOL) {
+        Obj *bind = find(env, (*obj)->car);
+        if (bind && is_special_form(bind->cdr)
+            && (bind->cdr->fn == prim_quote || bind->cdr->fn == prim_quasiquote))
+            return *obj;
+        if (bind && bind->cdr->type == TMACRO) {
+            *expr = macroexpand(root, env, obj);
+            return expand_macros(root, env, expr);
+        }
+    }
+    *head = Nil;
+    for (*lp = *obj; (*lp)->type == TCELL; *lp = (*lp)->cdr) {
+        *expr = (*lp)->car;
+        *expr = expand_macros(root, env, expr);
+        *head = cons(root, expr, head);
+    }
+    Obj *ret = reverse(*head);
+    (*head)->cdr = *lp;
+    ret->line_num = (*obj)->line_num;
+    return ret;
+}
+
+// Compiles the function defined by (name params . body) into the C function f<index>, which is
+// written to out. Returns false if it can't be compiled.
+static bool compile_defun(Obj **env, Obj *def, int index, FILE *out) {
+    Obj *params = def->cdr->car;
+    nscope = 0;
+    int nparams = 0;
+    for (; params->type == TCELL; params = params->cdr, nparams++)
+        if (params->car->type != TSYMBOL || !push_local(params->car, true, nparams))
+            return false;
+    if (params != Nil)
+        return false;
+    int saved[] = { constants.len, primitives.len, globals.len };
+    char *text;
+    size_t len;
+    body = open_memstream(&text, &len);
+    nslots = 1;
+    indent = 1;
+    bool ok = gen_progn(env, def->cdr->cdr, 0);
+    fclose(body);
+    if (ok) {
+        fprintf(out, "// %s\n", def->car->name);
+        fprintf(out, "static Obj *f%d(void *root, Obj **args, int nargs, int line_num) {\n", index);
+        fprintf(out, "    void *frame[%d];\n", nslots + 2);
+        fprintf(out, "    root = add_root_frame(root, %d, frame);\n", nslots);
+        fprintf(out, "    Obj **v = (Obj **)(frame + 1);\n");
+        fprintf(out, "    aot_enter(line_num);\n");
+        fputs(text, out);
+        fprintf(out, "    return v[0];\n}\n\n");
+    } else {
+        truncate_names(&constants, saved[0]);
+        truncate_names(&primitives, saved[1]);
+        truncate_names(&globals, saved[2]);
+    }
+    free(text);
+    return ok;
+}
+
+static Names file_names, file_texts;
+
+static void read_program(void *root, Obj **env, char *fname, Obj **defuns);
+
+static void read_forms(void *root, Obj **env, Obj **defuns) {
+    DEFINE3(root, form, def, tmp);
+    while ((*form = read_expr(root)) != NULL) {
+        Obj *head = (*form)->type == TCELL ? (*form)->car : Nil;
+        if (head->type != TSYMBOL)
+            continue;
+        if (strcmp(head->name, "defun") == 0) {
+            *def = (*form)->cdr;
+            *tmp = make_int(root, (long long)hash_form(*def));
+            *tmp = cons(root, tmp, def);
+            *defuns = cons(root, tmp, defuns);
+            eval(root, env, form);
+        } else if (strcmp(head->name, "defmacro") == 0) {
+            eval(root, env, form);
+        } else if (strcmp(head->name, "load") == 0 && length(*form) == 2
+                   && (*form)->cdr->car->type == TSTRING) {
+            read_program(root, env, (*form)->cdr->car->name, defuns);
+        }
+    }
+}
+
+// Reads the program in the file. The functions and macros are defined, and the defun forms are
+// added to *defuns as (hash name params . body). The other forms are not evaluated.
+static void read_program(void *root, Obj **env, char *fname, Obj **defuns) {
+    for (int i = 0; i < file_names.len; i++)
+        if (strcmp(file_names.names[i], fname) == 0)
+            return;
+    char *text = NULL;
+    size_t len = read_file(fname, &text);
+    if (len == 0)
+        return;
+    add_name(&file_names, fname, false);
+    add_name(&file_texts, text, false);
+
+    FILE *old_stdin = stdin;
+    stdin = fmemopen(text, len, "r");
+    filepos_t calling_file = filepos;
+    filepos.filename = file_names.names[file_names.len - 1];
+    filepos.file_len = len;
+    filepos.line_num = 1;
+    Handler h = { .prev = context, .stops_errors = true };
+    context = &h;
+    if (setjmp(h.jmp) == 0)
+        read_forms(root, env, defuns);
+    context = h.prev;
+    fclose(stdin);
+    stdin = old_stdin;
+    filepos = calling_file;
+    free(text);
+}
+
+static void write_names(FILE *out, char *type, char *name, Names *names) {
+    fprintf(out, "static %s %s[] = {\n", type, name);
+    for (int i = 0; i < names->len; i++) {
+        fputs("    ", out);
+        write_cstring(out, names->names[i]);
+        fputs(",\n", out);
+    }
+    fputs("    NULL,\n};\n\n", out);
+}
+
+void compile_c(char *output, char **files, int nfiles, Obj **env, Obj **expr) {
+    void *root = gc_root;
+    DEFINE2(root, defuns, def);
+    *defuns = Nil;
+    for (int i = 0; i < nfiles; i++)
+        read_program(root, env, files[i], defuns);
+    *defuns = reverse(*defuns);
+
+    char *text;
+    size_t len;
+    FILE *functions = open_memstream(&text, &len);
+    Names names = { NULL, 0 }, hashes = { NULL, 0 };
+    Handler h = { .prev = context, .stops_errors = true };
+    context = &h;
+    if (setjmp(h.jmp) == 0) {
+        for (; *defuns != Nil; *defuns = (*defuns)->cdr) {
+            *def = (*defuns)->car->cdr;
+            if ((*def)->type != TCELL || (*def)->car->type != TSYMBOL
+                || length(*def) < 3 || !is_list((*def)->cdr->car))
+                continue;
+            *def = expand_macros(root, env, def);
+            if (compile_defun(env, *def, names.len, functions)) {
+                char hash[32];
+                sprintf(hash, "%luUL", (unsigned long)(*defuns)->car->car->value);
+                add_name(&names, (*def)->car->name, false);
+                add_name(&hashes, hash, false);
+            }
+        }
+    }
+    context = h.prev;
+    fclose(functions);
+
+    FILE *out = fopen(output, "w");
+    if (!out) {
+        printf("Failed to open %s\n", output);
+        free(text);
+        return;
+    }
+    fprintf(out, "// Generated by minilisp --compile-c. Build with:\n");
+    fprintf(out, "//   cc -Isrc -o prog %s src/gc.c src/minilisp.c\n\n", output);
+    fprintf(out, "#include <stddef.h>\n#include \"minilisp.h\"\n#include \"gc.h\"\n\n");
+    fprintf(out, "filepos_t filepos = {\"\", 0, 1};\n\n");
+    fprintf(out, "#define NCONSTANTS %d\n", constants.len);
+    fprintf(out, "#define NPRIMITIVES %d\n", primitives.len);
+    fprintf(out, "#define NGLOBALS %d\n", globals.len);
+    fprintf(out, "#define NROOTS (NCONSTANTS + NPRIMITIVES + NGLOBALS)\n\n");
+    fprintf(out, "static void *roots[NROOTS + 2];\n");
+    fprintf(out, "#define R ((Obj **)(roots + 1))\n");
+    fprintf(out, "#define P(i) R[NCONSTANTS + (i)]\n");
+    fprintf(out, "#define G(i) R[NCONSTANTS + NPRIMITIVES + (i)]\n");
+    fprintf(out, "static long long E[NGLOBALS + 1];\n");
+    fprintf(out, "#define GLOBAL(i, name, line) \\\n");
+    fprintf(out, "    (E[i] == *aot_epoch ? G(i) : aot_global(&G(i), &E[i], name, line))\n\n");
+    fputs(text, out);
+    free(text);
+
+    fprintf(out, "static NativeFunction functions[] = {\n");
+    for (int i = 0; i < names.len; i++) {
+        fputs("    { ", out);
+        write_cstring(out, names.names[i]);
+        fprintf(out, ", %s, f%d },\n", hashes.names[i], i);
+    }
+    fprintf(out, "    { NULL, 0, NULL },\n};\n\n");
+    write_names(out, "char *", "constants", &constants);
+    write_names(out, "char *", "primitives", &primitives);
+    fprintf(out, "static EmbeddedFile files[] = {\n");
+    for (int i = 0; i < file_names.len; i++) {
+        fputs("    { ", out);
+        write_cstring(out, file_names.names[i]);
+        fputs(",\n", out);
+        // One string literal per line
+        char *p = file_texts.names[i];
+        while (*p) {
+            char *end = strchr(p, '\n');
+            size_t n = end ? (size_t)(end - p + 1) : strlen(p);
+            char line[n + 1];
+            memcpy(line, p, n);
+            line[n] = '\0';
+            fputs("      ", out);
+            write_cstring(out, line);
+            fputc('\n', out);
+            p += n;
+        }
+        fputs("      \"\" },\n", out);
+    }
+    fprintf(out, "    { NULL, NULL },\n};\n\n");
+    Names main_files = { files, nfiles };
+    write_names(out, "char *", "main_files", &main_files);
+    fprintf(out, "int main(void) {\n");
+    fprintf(out, "    for (int i = 0; i < NGLOBALS; i++)\n");
+    fprintf(out, "        E[i] = -1;\n");
+    fprintf(out, "    return aot_main(&(NativeProgram){\n");
+    fprintf(out, "        functions, %d, constants, NCONSTANTS, primitives, NPRIMITIVES,\n",
+            names.len);
+    fprintf(out, "        files, %d, main_files, %d, roots, NROOTS });\n", file_names.len, nfiles);
+    fprintf(out, "}\n");
+    fclose(out);
+    printf("Compiled %d functions to %s\n", names.len, output);
+}
+
+#ifndef MINILISP_NO_JIT
+//======================================================================
+// JIT compiler
+//
+// With --jit, a function is compiled to x86-64 machine code once it has been called JIT_THRESHOLD
+// times. The code is written into pages mapped with mmap, which are then made executable, and it's
+// attached to the function like the code compiled by --compile-c, so that call_func() runs it
+// instead of the body.
+//
+// Only the functions defined at the top level are compiled, and only if their body is made of
+// constants, parameters, global variables, function calls, quote, if, progn, when, unless, and, or
+// and cond. The others are left to the interpreter. Like the code compiled by --compile-c, the
+// compiled code keeps its values in a root frame on the stack, and counts a step on each call.
+// The arithmetic and comparisons of two integers, car and cdr are done inline when the arguments
+// have the right type. Otherwise, the primitive is called, and reports the error.
+//
+// The code assumes that the global variables it refers to keep their bindings, and that the
+// special forms and the primitives it inlines keep their values. These bindings and values, and
+// the other objects GC may move, are kept in jit_roots, a root frame, which the code loads them
+// from. Breaking an assumption changes the epoch, so the code checks it on entry. If the epoch has
+// changed and an assumption no longer holds, the function is deoptimized: its code is detached,
+// the call is run by the interpreter, and the function is not compiled again. The code itself is
+// never freed, since it may still be running.
+//======================================================================
+
+bool jit = false;
+
+#define JIT_MAX_ROOTS 1024
+#define JIT_MAX_ASSUMPTIONS 64
+#define JIT_MAX_SLOTS 256
+
+// The root frame holding the objects the compiled code refers to, from jit_roots[1]
+static void *jit_roots[JIT_MAX_ROOTS + 2];
+static int njit_roots;
+
+// What the code of a function assumes. bind and value are indexes in jit_roots; value is -1 if the
+// binding may hold anything.
+typedef struct {
+    long long epoch;  // The epoch when the assumptions were last found to hold
+    int fn;
+    int nassumptions;
+    struct { int bind, value; } assumptions[JIT_MAX_ASSUMPTIONS];
+} JitInfo;
+
+// The function being compiled, its code so far, and the number of slots of its root frame
+static Obj *jit_fn;
+static JitInfo *jit_info;
+static uint8_t *jit_code;
+static size_t jit_len, jit_cap;
+static int jit_nslots;
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// The condition codes of the jumps. JMP jumps always.
+enum { JMP = -1, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF };
+
+// The compiled code keeps the root frame in r14, and the arguments in r12. The value of v[i] is at
+// r14 + SLOT(i).
+#define SLOT(i) (8 * (1 + (i)))
+
+static void jit_emit(const void *bytes, size_t n) {
+    if (jit_len + n > jit_cap) {
+        jit_cap = (jit_len + n) * 2;
+        jit_code = realloc(jit_code, jit_cap);
+        if (!jit_code)
+            error("Out of memory", 0);
     }
+    memcpy(jit_code + jit_len, bytes, n);
+    jit_len += n;
 }
 
-#define PRIM_ARITHMETIC_OP(PRIM_OP, OP, OPEQ)                       \
-static Obj *PRIM_OP(void *root, Obj **env, Obj **list) {            \
-    Obj *args = eval_list(root, env, list);                         \
-    long long r = args->car->value;                                 \
-    for (Obj *p = args->cdr; p != Nil; p = p->cdr) {                \
-        if (p->car->type != TINT)                                   \
-            error(#OP " takes only numbers", (*list)->line_num);    \
-        r OPEQ p->car->value;                                       \
-    }                                                               \
-    return make_int(root, r);                                       \
-}
+#define JIT_BYTES(...) jit_emit((uint8_t[]){ __VA_ARGS__ }, sizeof((uint8_t[]){ __VA_ARGS__ }))
 
-// (+ <integer> ...)
-PRIM_ARITHMETIC_OP(prim_plus, +, += )
-PRIM_ARITHMETIC_OP(prim_mult, *, *= )
-PRIM_ARITHMETIC_OP(prim_div , /, /= )
-PRIM_ARITHMETIC_OP(prim_modulo, %, %= )
+static void jit_int32(int32_t v) {
+    jit_emit(&v, 4);
+}
 
-// (- <integer> ...)
-static Obj *prim_minus(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-    for (Obj *p = args; p != Nil; p = p->cdr)
-        if (p->car->type != TINT)
-            error("- takes only numbers", (*list)->line_num);
-    if (args->cdr == Nil)
-        return make_int(root, -args->car->value);
-    long long r = args->car->value;
-    for (Obj *p = args->cdr; p != Nil; p = p->cdr)
-        r -= p->car->value;
-    return make_int(root, r);
+static void jit_int64(uint64_t v) {
+    jit_emit(&v, 8);
 }
 
-// (op <integer> <integer>)
-#define PRIM_COMPARISON_OP(PRIM_OP, OP)                             \
-static Obj *PRIM_OP(void *root, Obj **env, Obj **list) {            \
-    Obj *args = eval_list(root, env, list);                         \
-    if (length(args) != 2)                                          \
-        error(#OP " takes only 2 number", (*list)->line_num);       \
-    Obj *x = args->car;                                             \
-    Obj *y = args->cdr->car;                                        \
-    if (x->type != TINT || y->type != TINT)                         \
-        error(#OP " takes only 2 numbers", (*list)->line_num);      \
-    return x->value OP y->value ? True : Nil;                       \
+// mov reg, imm64
+static void jit_mov_imm(int reg, const void *imm) {
+    JIT_BYTES(0x48 | (reg >= 8), 0xB8 + (reg & 7));
+    jit_int64((uintptr_t)imm);
 }
 
-PRIM_COMPARISON_OP(prim_num_eq, ==)
-PRIM_COMPARISON_OP(prim_lt, <)
-PRIM_COMPARISON_OP(prim_lte, <=)
-PRIM_COMPARISON_OP(prim_gt, >)
-PRIM_COMPARISON_OP(prim_gte, >=)
+// mov reg, imm32
+static void jit_mov_imm32(int reg, int32_t imm) {
+    if (reg >= 8)
+        JIT_BYTES(0x41);
+    JIT_BYTES(0xB8 + (reg & 7));
+    jit_int32(imm);
+}
 
-// (not <cell>)
-static Obj *prim_not(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 1)
-        error("not accepts 1 argument", (*list)->line_num);
-    Obj *values = eval_list(root, env, list);
-    return values->car == Nil ? True : Nil;
+// mov dst, src
+static void jit_mov(int dst, int src) {
+    JIT_BYTES(0x48 | (src >= 8) << 2 | (dst >= 8), 0x89, 0xC0 | (src & 7) << 3 | (dst & 7));
 }
 
-extern void process_file(char *fname, Obj **env, Obj **expr);
+// Emits an instruction with operands reg and [base + disp].
+static void jit_mem(int op, int reg, int base, int32_t disp) {
+    JIT_BYTES(0x48 | (reg >= 8) << 2 | (base >= 8), op, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP)
+        JIT_BYTES(0x24);
+    jit_int32(disp);
+}
 
-static Obj *prim_load(void *root, Obj **env, Obj **list) {
-    DEFINE1(root, expr);
-    Obj *args = eval_list(root, env, list);
-    if (args->car->type != TSTRING){
-        error("load: filename must be a string", (*list)->line_num);
-    }
-    char *name = args->car->name;
-    
-    // Save old context and set up new one for error handling
-    jmp_buf old_context;
-    memcpy(&old_context, &context, sizeof(jmp_buf));
-    
-    if (setjmp(context) == 0) {
-        filepos_t calling_file = filepos;
-        process_file(name, env, expr);
-        filepos = calling_file;
-    }
-    
-    // Restore old context
-    memcpy(&context, &old_context, sizeof(jmp_buf));
-    return Nil;
+// mov reg, [base + disp]
+static void jit_load(int reg, int base, int32_t disp) {
+    jit_mem(0x8B, reg, base, disp);
 }
 
-static Obj *handle_function(void *root, Obj **env, Obj **list, int type) {
-    if ((*list)->type != TCELL || !is_list((*list)->car) || (*list)->cdr->type != TCELL)
-        error("Malformed lambda", (*list)->line_num);
-    Obj *p = (*list)->car;
-    for (; p->type == TCELL; p = p->cdr)
-        if (p->car->type != TSYMBOL)
-            error("Parameter must be a symbol", (*list)->line_num);
-    if (p != Nil && p->type != TSYMBOL)
-        error("Parameter must be a symbol", (*list)->line_num);
-    DEFINE2(root, params, body);
-    *params = (*list)->car;
-    *body = (*list)->cdr;
-    return make_function(root, env, type, params, body);
+// mov [base + disp], reg
+static void jit_store(int base, int32_t disp, int reg) {
+    jit_mem(0x89, reg, base, disp);
 }
 
-// (lambda (<symbol> ...) expr ...)
-static Obj *prim_lambda(void *root, Obj **env, Obj **list) {
-    return handle_function(root, env, list, TFUNCTION);
+// lea reg, [base + disp]
+static void jit_lea(int reg, int base, int32_t disp) {
+    jit_mem(0x8D, reg, base, disp);
 }
 
-static Obj *handle_defun(void *root, Obj **env, Obj **list, int type) {
-    if (length(*list) < 3 || (*list)->car->type != TSYMBOL || (*list)->cdr->type != TCELL)
-        error("Malformed defun: correct form is (defun <symbol> (<symbol> ...) expr ...)"
-        , (*list)->line_num);
-    DEFINE3(root, fn, sym, rest);
-    *sym = (*list)->car;
-    *rest = (*list)->cdr;
-    *fn = handle_function(root, env, rest, type);
-    add_variable(root, env, sym, fn);
-    return *fn;
+// cmp a, b
+static void jit_cmp(int a, int b) {
+    JIT_BYTES(0x48 | (b >= 8) << 2 | (a >= 8), 0x39, 0xC0 | (b & 7) << 3 | (a & 7));
 }
 
-// (defun <symbol> (<symbol> ...) expr ...)
-static Obj *prim_defun(void *root, Obj **env, Obj **list) {
-    return handle_defun(root, env, list, TFUNCTION);
+// cmp dword [reg], type
+static void jit_cmp_type(int reg, int type) {
+    if (reg >= 8)
+        JIT_BYTES(0x41);
+    JIT_BYTES(0x81, 0x80 | 7 << 3 | (reg & 7));
+    if ((reg & 7) == RSP)
+        JIT_BYTES(0x24);
+    jit_int32(offsetof(Obj, type));
+    jit_int32(type);
 }
 
-// (define <symbol> expr)
-static Obj *prim_define(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 2 || (*list)->car->type != TSYMBOL)
-        error("Malformed define", (*list)->line_num);
-    DEFINE2(root, sym, value);
-    *sym = (*list)->car;
-    *value = (*list)->cdr->car;
-    *value = eval(root, env, value);
-    add_variable(root, env, sym, value);
-    return *value;
+// Calls the C function, which must not keep any register but the callee-saved ones.
+static void jit_call_c(const void *fn) {
+    jit_mov_imm(RAX, fn);
+    JIT_BYTES(0xFF, 0xD0);
 }
 
-// (defmacro <symbol> (<symbol> ...) expr ...)
-static Obj *prim_defmacro(void *root, Obj **env, Obj **list) {
-    return handle_defun(root, env, list, TMACRO);
+// Emits a jump, and returns the position of its offset, which jit_patch() sets.
+static size_t jit_jump(int cc) {
+    if (cc == JMP)
+        JIT_BYTES(0xE9);
+    else
+        JIT_BYTES(0x0F, 0x80 | cc);
+    jit_int32(0);
+    return jit_len - 4;
 }
 
-// (macroexpand expr)
-static Obj *prim_macroexpand(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 1)
-        error("Malformed macroexpand", (*list)->line_num);
-    DEFINE1(root, body);
-    *body = (*list)->car;
-    return macroexpand(root, env, body);
+// Makes the jump whose offset is at pos go to target.
+static void jit_patch_to(size_t pos, size_t target) {
+    int32_t offset = (int32_t)(target - (pos + 4));
+    memcpy(jit_code + pos, &offset, 4);
 }
 
-// (print ...)
-static Obj *prim_print(void *root, Obj **env, Obj **list) {
-    DEFINE1(root, tmp);
-    *tmp = (*list)->car;
-    print(eval(root, env, tmp));
-    return Nil;
+// Makes the jump go to the current position.
+static void jit_patch(size_t pos) {
+    jit_patch_to(pos, jit_len);
 }
 
+static void jit_use_slot(int t) {
+    if (t + 1 > jit_nslots)
+        jit_nslots = t + 1;
+}
 
-// (println ...)
-static Obj *prim_println(void *root, Obj **env, Obj **list) {
-    prim_print(root, env, list);
-    fputc('\n', stdout);
-    return Nil;
+// Stores rax into v[t].
+static void jit_store_slot(int t) {
+    jit_use_slot(t);
+    jit_store(R14, SLOT(t), RAX);
 }
 
-static Obj *prim_progn(void *root, Obj **env, Obj **list) {
-    return progn(root, env, list);
+// The values left by the code before are not those of the expression being evaluated.
+static void jit_clear_values(void) {
+    jit_mov_imm(RAX, &nvalues);
+    JIT_BYTES(0xC7, 0x00);
+    jit_int32(0);
 }
 
-// (if expr expr expr ...)
-static Obj *prim_if(void *root, Obj **env, Obj **list) {
-    if (length(*list) < 2)
-        error("Malformed if", (*list)->line_num);
-    DEFINE3(root, cond, then, els);
-    *cond = (*list)->car;
-    *cond = eval(root, env, cond);
-    if (*cond != Nil) {
-        *then = (*list)->cdr->car;
-        return eval(root, env, then);
-    }
-    *els = (*list)->cdr->cdr;
-    return *els == Nil ? Nil : progn(root, env, els);
+// Returns the index of the object in jit_roots, adding it if needed, or -1 if it's full.
+static int jit_root(Obj *obj) {
+    Obj **roots = (Obj **)(jit_roots + 1);
+    for (int i = 0; i < njit_roots; i++)
+        if (roots[i] == obj)
+            return i;
+    if (njit_roots == JIT_MAX_ROOTS)
+        return -1;
+    roots[njit_roots] = obj;
+    return njit_roots++;
 }
 
-// (eq expr expr)
-static Obj *prim_eq(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 2)
-        error("eq takes 2 arguments only", (*list)->line_num);
-    Obj *values = eval_list(root, env, list);
-    Obj *first = values->car;
-    Obj *second = values->cdr->car;
-    if (first->type == TSTRING){
-        if (second->type == TSTRING)
-            return strcmp(first->name, second->name) == 0 ? True : Nil;
-        else
-            error("The 2 arguments of eq must be of the same type", (*list)->line_num);
-    } 
-    return first == second ? True : Nil;
+// Loads the object at index i of jit_roots into reg.
+static void jit_load_root(int reg, int i) {
+    jit_mov_imm(reg, &jit_roots[1 + i]);
+    jit_load(reg, reg, 0);
 }
 
-// String primitives
-static Obj *prim_string_concat(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-    
-    // First pass: calculate total length needed
-    size_t total_len = 1;  // Start with 1 for null terminator
-    for (Obj *p = args; p != Nil; p = p->cdr) {
-        if (p->car->type != TSTRING && p->car->type != TINT)
-            error("string-concat arguments must be strings or numbers", 
-            (*list)->line_num);
-        if (p->car->type == TINT) {
-            long long val = p->car->value;
-            char var[22];
-            snprintf(var, sizeof(var), "%lld", val);
-            total_len += strlen(var);
-        }
-        else {
-            total_len += strlen(p->car->name);
-        }
-    }
-    
-    char *buf = malloc(total_len);
-    if (!buf)
-        error("Out of memory in string-concat", (*list)->line_num);
-    buf[0] = '\0';
-    
-    // Second pass: concatenate all strings
-    for (Obj *p = args; p != Nil; p = p->cdr) {
-        if (p->car->type == TINT) {
-            long long val = p->car->value;
-            char var[22];
-            snprintf(var, sizeof(var), "%lld", val);
-            strcat(buf, var);
-        }
-        else {
-            strcat(buf, p->car->name);
-        }
-    }
-    
-    Obj *result = make_string(root, buf);
-    free(buf);
-    return result;
+// Records that the code assumes that the binding stays the global binding of its symbol, and
+// keeps the value if keep_value is true. Returns the index of the binding in jit_roots, or -1.
+static int jit_assume(Obj *bind, bool keep_value) {
+    int b = jit_root(bind);
+    int v = keep_value ? jit_root(bind->cdr) : -1;
+    if (b < 0 || (keep_value && v < 0))
+        return -1;
+    for (int i = 0; i < jit_info->nassumptions; i++)
+        if (jit_info->assumptions[i].bind == b && jit_info->assumptions[i].value == v)
+            return b;
+    if (jit_info->nassumptions == JIT_MAX_ASSUMPTIONS)
+        return -1;
+    jit_info->assumptions[jit_info->nassumptions].bind = b;
+    jit_info->assumptions[jit_info->nassumptions++].value = v;
+    return b;
 }
 
-static Obj *prim_symbol_to_string(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-    if (length(args) != 1)
-        error("symbol->string requires 1 argument", (*list)->line_num);
-    
-    if (args->car->type != TSYMBOL)
-        error("symbol->string argument must be a symbol", (*list)->line_num);
-        
-    return make_string(root, args->car->name);
+// Returns the position of the symbol in the parameters of the function being compiled, or -1.
+static int jit_param(Obj *sym) {
+    int i = 0;
+    for (Obj *p = jit_fn->params; p->type == TCELL; p = p->cdr, i++)
+        if (p->car == sym)
+            return i;
+    return -1;
 }
 
-static Obj *prim_string_to_symbol(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-    if (length(args) != 1)
-        error("string->symbol requires 1 argument", (*list)->line_num);
-    
-    if (args->car->type != TSTRING)
-        error("string->symbol argument must be a string", (*list)->line_num);
-        
-    return intern(root, args->car->name);
+static Obj *jit_global(Obj *sym) {
+    Obj *env = jit_fn->env;
+    return find(&env, sym);
 }
 
-static Obj *prim_exit(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 1)
-        error("exit accepts 1 argument", (*list)->line_num);
-    Obj *values = eval_list(root, env, list);
-    Obj *first = values->car; 
-    if (first->type != TINT)
-        error("* must be an integer", (*list)->line_num);
-    exit(first->value);
+static bool jit_constant(Obj *obj, int t) {
+    jit_clear_values();
+    if (in_heap(obj)) {
+        int i = jit_root(obj);
+        if (i < 0)
+            return false;
+        jit_load_root(RAX, i);
+    } else {
+        jit_mov_imm(RAX, obj);
+    }
+    jit_store_slot(t);
+    return true;
 }
 
-static void add_primitive(void *root, Obj **env, char *name, Primitive *fn) {
-    DEFINE2(root, sym, prim);
-    *sym = intern(root, name);
-    *prim = make_primitive(root, fn);
-    add_variable(root, env, sym, prim);
+static Obj *jit_call(void *root, Obj *fn, Obj **argv, int nargs, int line_num);
+
+// Emits the call of the function in the global binding at index b of jit_roots, or in the
+// parameter at position param if b is -1, with the arguments in v[t], ..., v[t + nargs - 1]. The
+// value is left in rax.
+static void jit_emit_call(int b, int param, int t, int nargs, int line_num) {
+    jit_mov(RDI, R14);
+    if (b >= 0) {
+        jit_load_root(RSI, b);
+        jit_load(RSI, RSI, offsetof(Obj, cdr));
+    } else {
+        jit_load(RSI, R12, 8 * param);
+    }
+    jit_lea(RDX, R14, SLOT(t));
+    jit_mov_imm32(RCX, nargs);
+    jit_mov_imm32(R8, line_num);
+    jit_call_c(jit_call);
 }
 
-static void define_constants(void *root, Obj **env) {
-    DEFINE1(root, sym);
-    *sym = intern(root, "t");
-    add_variable(root, env, sym, &True);
+// Returns the condition of the comparison primitive, or 0 if it's not one.
+static int jit_comparison(Obj *fn) {
+    return fn->subr2 == prim_num_eq ? CC_E : fn->subr2 == prim_lt ? CC_L
+        : fn->subr2 == prim_lte ? CC_LE : fn->subr2 == prim_gt ? CC_G
+        : fn->subr2 == prim_gte ? CC_GE : 0;
 }
 
-static size_t read_file(char *fname, char **text) {
-    size_t length = 0;
-    FILE *f = fopen(fname, "r");
-    if (!f) {
-        printf("Failed to load file %s\n", fname);
-        return 0;
+// Emits the primitive in the binding at index b of jit_roots applied to v[t] and v[t + 1], or to
+// v[t] for car and cdr, inline, with a call of the primitive for the arguments of other types.
+static void jit_inline(Obj *fn, int b, int t, int nargs, int line_num) {
+    jit_load(RAX, R14, SLOT(t));
+    size_t slow[2];
+    if (nargs == 1) {
+        jit_cmp_type(RAX, TCELL);
+        slow[0] = jit_jump(CC_NE);
+        jit_load(RAX, RAX, fn->subr1 == prim_car ? offsetof(Obj, car) : offsetof(Obj, cdr));
+    } else {
+        jit_load(RCX, R14, SLOT(t + 1));
+        jit_cmp_type(RAX, TINT);
+        slow[0] = jit_jump(CC_NE);
+        jit_cmp_type(RCX, TINT);
+        slow[1] = jit_jump(CC_NE);
+        jit_load(RAX, RAX, offsetof(Obj, value));
+        jit_load(RCX, RCX, offsetof(Obj, value));
+        int cc = jit_comparison(fn);
+        if (cc) {
+            jit_cmp(RAX, RCX);
+            jit_mov_imm(RAX, True);
+            size_t done = jit_jump(cc);
+            jit_mov_imm(RAX, Nil);
+            jit_patch(done);
+        } else {
+            if (fn->subr == prim_plus)
+                JIT_BYTES(0x48, 0x01, 0xC8);        // add rax, rcx
+            else if (fn->subr == prim_minus)
+                JIT_BYTES(0x48, 0x29, 0xC8);        // sub rax, rcx
+            else
+                JIT_BYTES(0x48, 0x0F, 0xAF, 0xC1);  // imul rax, rcx
+            jit_mov(RSI, RAX);
+            jit_mov(RDI, R14);
+            jit_call_c(make_int);
+        }
     }
+    size_t done = jit_jump(JMP);
+    for (int i = 0; i < nargs; i++)
+        jit_patch(slow[i]);
+    jit_emit_call(b, -1, t, nargs, line_num);
+    jit_patch(done);
+    jit_store_slot(t);
+    jit_clear_values();
+}
 
-    filepos.filename = fname;
-    fseek(f, 0, SEEK_END);
-    length = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    
-    *text = malloc(length + 1);
-    if (!*text) {
-        puts("Out of memory.");
-        fclose(f);
-        return 0;
-    }
+// Returns true if the primitive is done inline when applied to nargs arguments.
+static bool jit_inlines(Obj *fn, int nargs) {
+    if (fn->type != TPRIMITIVE || is_special_form(fn))
+        return false;
+    if (nargs == 1)
+        return fn->subr1 == prim_car || fn->subr1 == prim_cdr;
+    return nargs == 2 && (fn->subr == prim_plus || fn->subr == prim_minus
+                          || fn->subr == prim_mult || jit_comparison(fn));
+}
 
-    size_t read = fread(*text, 1, length, f);
-    if (read != length) {
-        printf("Failed to read entire file %s\n", fname);
-        free(*text);
-        *text = NULL;
-        fclose(f);
-        return 0;
-    }
+static bool jit_expr(Obj *code, int t);
 
-    (*text)[length] = '\0';
-    fclose(f);
-    return length;
+static bool jit_progn(Obj *list, int t) {
+    if (list == Nil)
+        return jit_constant(Nil, t);
+    for (; list->type == TCELL; list = list->cdr)
+        if (!jit_expr(list->car, t))
+            return false;
+    return list == Nil;
 }
 
-void process_file(char *fname, Obj **env, Obj **expr) {
-    char *text = NULL;
-    size_t len = read_file(fname, &text);
-    if (len == 0) return;
+// Jumps if v[t] is () and cc is CC_E, or if it's not and cc is CC_NE.
+static size_t jit_test(int t, int cc) {
+    jit_load(RAX, R14, SLOT(t));
+    jit_mov_imm(RCX, Nil);
+    jit_cmp(RAX, RCX);
+    return jit_jump(cc);
+}
 
-    // Save old stdin
-    FILE *old_stdin = stdin;
-    // Create a single stream for the entire file
-    FILE *stream = fmemopen(text, len, "r");
-    if (!stream) {
-        free(text);
-        error("Failed to create memory stream for %s", (*expr)->line_num, fname);
-        return;
-    }
+// (if cond then else ...), (when cond expr ...) and (unless cond expr ...)
+static bool jit_if(Obj *args, int t, Primitive *form) {
+    if (!jit_expr(args->car, t))
+        return false;
+    size_t skip = jit_test(t, form == prim_unless ? CC_NE : CC_E);
+    Obj *then = form == prim_if ? args->cdr->car : Nil;
+    Obj *els = form == prim_if ? args->cdr->cdr : Nil;
+    if (!(form == prim_if ? jit_expr(then, t) : jit_progn(args->cdr, t)))
+        return false;
+    size_t done = jit_jump(JMP);
+    jit_patch(skip);
+    if (!jit_progn(els, t))
+        return false;
+    jit_patch(done);
+    return true;
+}
 
-    // Redirect stdin to the memory stream
-    stdin = stream;
-    filepos.filename = fname;
-    filepos.file_len = len;
-    filepos.line_num = 1;
+// (and expr ...) and (or expr ...)
+static bool jit_and_or(Obj *args, int t, bool is_and) {
+    if (args == Nil)
+        return jit_constant(is_and ? True : Nil, t);
+    size_t done[JIT_MAX_SLOTS];
+    int n = 0;
+    for (; args->type == TCELL; args = args->cdr) {
+        if (!jit_expr(args->car, t) || n == JIT_MAX_SLOTS)
+            return false;
+        if (args->cdr != Nil)
+            done[n++] = jit_test(t, is_and ? CC_E : CC_NE);
+    }
+    for (int i = 0; i < n; i++)
+        jit_patch(done[i]);
+    return true;
+}
 
-    int eval_input(void *root, Obj **env, Obj **expr);
-    // Process expressions until we reach end of file
-    while (!feof(stream)) {
-        eval_input(gc_root, env, expr);
+// (cond (test expr ...) ...)
+static bool jit_cond(Obj *clauses, int t) {
+    size_t done[JIT_MAX_SLOTS];
+    int n = 0;
+    for (; clauses->type == TCELL; clauses = clauses->cdr) {
+        Obj *clause = clauses->car;
+        if (clause->type != TCELL || length(clause) < 0 || n == JIT_MAX_SLOTS)
+            return false;
+        if (!jit_expr(clause->car, t))
+            return false;
+        size_t next = jit_test(t, CC_E);
+        if (clause->cdr != Nil && !jit_progn(clause->cdr, t))
+            return false;
+        done[n++] = jit_jump(JMP);
+        jit_patch(next);
     }
+    if (!jit_constant(Nil, t))
+        return false;
+    for (int i = 0; i < n; i++)
+        jit_patch(done[i]);
+    return true;
+}
 
-    // Cleanup
-    stdin = old_stdin;
-    fclose(stream);
-    free(text);
+static bool jit_form(Obj *code, int t) {
+    Obj *head = code->car, *args = code->cdr;
+    int nargs = length(args);
+    if (head->type != TSYMBOL || nargs < 0 || t + nargs >= JIT_MAX_SLOTS)
+        return false;
+    int param = jit_param(head);
+    Obj *bind = param < 0 ? jit_global(head) : NULL;
+    Obj *fn = bind ? bind->cdr : NULL;
+    if (fn && is_special_form(fn)) {
+        if (jit_assume(bind, true) < 0)
+            return false;
+        Primitive *form = fn->fn;
+        if (form == prim_quote)
+            return nargs == 1 && jit_constant(args->car, t);
+        if (form == prim_if)
+            return nargs >= 2 && jit_if(args, t, form);
+        if (form == prim_when || form == prim_unless)
+            return nargs >= 1 && jit_if(args, t, form);
+        if (form == prim_progn)
+            return jit_progn(args, t);
+        if (form == prim_and || form == prim_or)
+            return jit_and_or(args, t, form == prim_and);
+        if (form == prim_cond)
+            return jit_cond(args, t);
+        return false;
+    }
+    // Changing the value of a variable holding a function changes the epoch, but not that of
+    // one holding anything else, which might become a macro.
+    if (param < 0 && (!fn || (fn->type != TPRIMITIVE && fn->type != TFUNCTION)))
+        return false;
+    int i = 0;
+    for (Obj *p = args; p != Nil; p = p->cdr, i++)
+        if (!jit_expr(p->car, t + i))
+            return false;
+    jit_use_slot(t + nargs);
+    if (param >= 0) {
+        jit_emit_call(-1, param, t, nargs, code->line_num);
+        jit_store_slot(t);
+        return true;
+    }
+    bool inline_op = jit_inlines(fn, nargs);
+    int b = jit_assume(bind, inline_op);
+    if (b < 0)
+        return false;
+    if (inline_op) {
+        jit_inline(fn, b, t, nargs, code->line_num);
+        return true;
+    }
+    jit_emit_call(b, -1, t, nargs, code->line_num);
+    jit_store_slot(t);
+    return true;
 }
 
-static void define_primitives(void *root, Obj **env) {
-    add_primitive(root, env, "list", prim_list);
-    add_primitive(root, env, "quote", prim_quote);
-    add_primitive(root, env, "cons", prim_cons);
-    add_primitive(root, env, "car", prim_car);
-    add_primitive(root, env, "cdr", prim_cdr);
-    add_primitive(root, env, "setq", prim_setq);
-    add_primitive(root, env, "setcar", prim_setcar);
-    add_primitive(root, env, "while", prim_while);
-    add_primitive(root, env, "gensym", prim_gensym);
-    add_primitive(root, env, "not", prim_not);
-    add_primitive(root, env, "+", prim_plus);
-    add_primitive(root, env, "-", prim_minus);
-    add_primitive(root, env, "*", prim_mult);
-    add_primitive(root, env, "/", prim_div);
-    add_primitive(root, env, "mod", prim_modulo);
-    add_primitive(root, env, "length", prim_length);
-    add_primitive(root, env, "reverse", prim_reverse);
-    add_primitive(root, env, "<", prim_lt);
-    add_primitive(root, env, "<", prim_lt);
-    add_primitive(root, env, ">", prim_gt);
-    add_primitive(root, env, "<=", prim_lte);
-    add_primitive(root, env, ">=", prim_gte);
-    add_primitive(root, env, "define", prim_define);
-    add_primitive(root, env, "defun", prim_defun);
-    add_primitive(root, env, "defmacro", prim_defmacro);
-    add_primitive(root, env, "macroexpand", prim_macroexpand);
-    add_primitive(root, env, "lambda", prim_lambda);
-    add_primitive(root, env, "atom", prim_atom);
-    add_primitive(root, env, "if", prim_if);
-    add_primitive(root, env, "progn", prim_progn);
-    add_primitive(root, env, "=", prim_num_eq);
-    add_primitive(root, env, "eq", prim_eq);
-    add_primitive(root, env, "print", prim_print);
-    add_primitive(root, env, "println", prim_println);
-    add_primitive(root, env, "string-concat", prim_string_concat);
-    add_primitive(root, env, "symbol->string", prim_symbol_to_string);
-    add_primitive(root, env, "string->symbol", prim_string_to_symbol);
-    add_primitive(root, env, "load", prim_load);
-    add_primitive(root, env, "exit", prim_exit);
+// Emits the code storing the value of the expression into v[t]. It may use the slots above t.
+// Returns false if the expression can't be compiled.
+static bool jit_expr(Obj *code, int t) {
+    if (t >= JIT_MAX_SLOTS)
+        return false;
+    check_stack(code->line_num);
+    // Compiled nodes are compiled from the forms they were made of.
+    if (code->type == TCELL && code->car->type == TNODE)
+        code = code->cdr->car;
+    if (code->type == TCELL)
+        return jit_form(code, t);
+    if (code->type != TSYMBOL)
+        return jit_constant(code, t);
+    int param = jit_param(code);
+    jit_clear_values();
+    if (param >= 0) {
+        jit_load(RAX, R12, 8 * param);
+    } else {
+        Obj *bind = jit_global(code);
+        int b = bind ? jit_assume(bind, false) : -1;
+        if (b < 0)
+            return false;
+        jit_load_root(RAX, b);
+        jit_load(RAX, RAX, offsetof(Obj, cdr));
+    }
+    jit_store_slot(t);
+    return true;
 }
 
-//======================================================================
-// Entry point
-//======================================================================
+// Applies fn to the arguments in argv, which are in a root frame, for the compiled code. The
+// functions with native code are called directly, without making a list of the arguments.
+static Obj *jit_call(void *root, Obj *fn, Obj **argv, int nargs, int line_num) {
+    DEFINE1(root, f);
+    *f = fn;
+    if (fn->type != TFUNCTION || !fn->code || fn->memo)
+        return call_values(root, f, argv, nargs, line_num);
+    if (nargs < length(fn->params))
+        error("Cannot apply function: number of argument does not match", fn->line_num);
+    if (++call_depth > depth_limit)
+        error("Depth limit exceeded", fn->line_num);
+    Obj *r = fn->code(root, argv, nargs, fn->line_num);
+    call_depth--;
+    return r;
+}
 
-extern void *memory;
+// Called on entry to compiled code when the epoch has changed. Returns NULL if the assumptions of
+// the code still hold. Otherwise, deoptimizes the function, and returns the value of the call.
+static Obj *jit_recheck(void *root, Obj **argv, int nargs, JitInfo *info) {
+    Obj **roots = (Obj **)(jit_roots + 1);
+    DEFINE3(root, fn, args, env);
+    *fn = roots[info->fn];
+    *env = (*fn)->env;
+    bool holds = true;
+    for (int i = 0; holds && i < info->nassumptions; i++) {
+        Obj *bind = roots[info->assumptions[i].bind];
+        int v = info->assumptions[i].value;
+        holds = find(env, bind->car) == bind && (v < 0 || bind->cdr == roots[v]);
+    }
+    if (holds) {
+        info->epoch = epoch;
+        return NULL;
+    }
+    (*fn)->code = NULL;
+    *args = memo_list(root, argv, nargs);
+    *env = Nil;
+    return call_body(root, env, fn, args, false);
+}
 
-void init_minilisp(Obj **env) {
-    // Memory allocation
-    extern void *alloc_semispace();
-    memory = alloc_semispace();
+// Returns true if the parameters are a proper list of symbols.
+static bool jit_params(Obj *params) {
+    for (; params->type == TCELL; params = params->cdr)
+        if (params->car->type != TSYMBOL)
+            return false;
+    return params == Nil;
+}
 
-    // Constants and primitives
-    Symbols = Nil;
-    *env = make_env(NULL, &Nil, &Nil);
-    define_constants(NULL, env);
-    define_primitives(NULL, env);
+// Emits the code of the function, and returns false if it can't be compiled.
+static bool jit_body(Obj *fn) {
+    // push rbp; mov rbp, rsp; push rbx; push r12; push r13; push r14; sub rsp, <frame size>
+    JIT_BYTES(0x55, 0x48, 0x89, 0xE5, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x48, 0x81, 0xEC);
+    size_t frame_size = jit_len;
+    jit_int32(0);
+    // mov r14, rsp; mov r12, rsi; mov r13d, edx; mov [r14], rdi; lea rdi, [r14 + 8]
+    JIT_BYTES(0x49, 0x89, 0xE6, 0x49, 0x89, 0xF4, 0x41, 0x89, 0xD5, 0x49, 0x89, 0x3E,
+              0x49, 0x8D, 0x7E, 0x08);
+    // The slots are cleared, and followed by ROOT_END: mov ecx, <slots>; xor eax, eax;
+    // rep stosq; mov rax, -1; stosq
+    JIT_BYTES(0xB9);
+    size_t slot_count = jit_len;
+    jit_int32(0);
+    JIT_BYTES(0x31, 0xC0, 0xF3, 0x48, 0xAB, 0x48, 0xC7, 0xC0, 0xFF, 0xFF, 0xFF, 0xFF, 0x48, 0xAB);
+    // The epoch
+    jit_mov_imm(RAX, &epoch);
+    jit_load(RAX, RAX, 0);
+    jit_mov_imm(RCX, &jit_info->epoch);
+    jit_load(RCX, RCX, 0);
+    jit_cmp(RAX, RCX);
+    size_t recheck = jit_jump(CC_NE);
+    size_t start = jit_len;
+    jit_mov_imm32(RDI, fn->line_num);
+    jit_call_c(aot_enter);
+    jit_nslots = 1;
+    if (!jit_progn(fn->body, 0))
+        return false;
+    jit_load(RAX, R14, SLOT(0));
+    // lea rsp, [rbp - 32]; pop r14; pop r13; pop r12; pop rbx; pop rbp; ret
+    size_t epilogue = jit_len;
+    JIT_BYTES(0x48, 0x8D, 0x65, 0xE0, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0x5D, 0xC3);
+    jit_patch(recheck);
+    jit_mov(RDI, R14);
+    jit_mov(RSI, R12);
+    JIT_BYTES(0x44, 0x89, 0xEA);  // mov edx, r13d
+    jit_mov_imm(RCX, jit_info);
+    jit_call_c(jit_recheck);
+    JIT_BYTES(0x48, 0x85, 0xC0);  // test rax, rax
+    jit_patch_to(jit_jump(CC_NE), epilogue);
+    jit_patch_to(jit_jump(JMP), start);
+    // The frame holds the previous frame, the slots and ROOT_END, and keeps rsp 16-byte aligned.
+    int32_t size = (jit_nslots + 2 + 1) / 2 * 16;
+    memcpy(jit_code + frame_size, &size, 4);
+    memcpy(jit_code + slot_count, &jit_nslots, 4);
+    return true;
 }
 
-int eval_input(void *root, Obj **env, Obj **expr) {
-    if (setjmp(context) == 0) {
-        while (true) {
-            *expr = read_expr(root);         
-            if (!*expr) 
-                return 0;
-            if (*expr == Cparen)
-                error("Stray close parenthesis", (*expr)->line_num);
-            if (*expr == Dot)
-                error("Stray dot", (*expr)->line_num);
-            print(eval(root, env, expr));
-            putc('\n', stdout);
+// Compiles the function to machine code, and attaches the code to it, if it can be compiled.
+static void jit_function(Obj *fn) {
+    if (fn->type != TFUNCTION || fn->code || fn->env->up != Nil || !jit_params(fn->params))
+        return;
+    int saved_roots = njit_roots;
+    jit_fn = fn;
+    jit_info = calloc(1, sizeof(JitInfo));
+    jit_len = 0;
+    jit_info->epoch = epoch;
+    jit_info->fn = jit_root(fn);
+    bool ok = jit_info->fn >= 0 && jit_body(fn);
+    jit_fn = NULL;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (jit_len + page - 1) / page * page;
+    void *mem = ok ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0)
+        : MAP_FAILED;
+    if (mem != MAP_FAILED) {
+        memcpy(mem, jit_code, jit_len);
+        if (mprotect(mem, size, PROT_READ | PROT_EXEC) == 0) {
+            fn->code = (Subr *)mem;
+            return;
         }
+        munmap(mem, size);
     }
-    return 0;
+    // The roots added for the function are dropped.
+    for (; njit_roots > saved_roots; njit_roots--)
+        jit_roots[njit_roots] = NULL;
+    free(jit_info);
+}
+
+// Adds jit_roots to the GC roots.
+static void init_jit(void) {
+    gc_root = add_root_frame(gc_root, JIT_MAX_ROOTS, jit_roots);
 }
+#endif
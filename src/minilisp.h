@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdlib.h>
 
 
@@ -25,17 +26,36 @@ enum {
     // handle the object of this type. Other functions will never see the object of this type.
     TMOVED,
     TSTRING,
+    // An array of objects used by compiled code, e.g. the jump table of a case form. Not visible
+    // from the user.
+    TTABLE,
+    TGENERATOR,
+    TPROMISE,
     // Const objects. They are statically allocated and will never be managed by GC.
     TTRUE,
     TNIL,
     TDOT,
     TCPAREN,
+    // The handler of a compiled node. Compiled code is made of cells whose car is a handler.
+    TNODE,
 };
 
 // Typedef for the primitive function
 struct Obj;
+struct Generator;
 typedef struct Obj *Primitive(void *root, struct Obj **env, struct Obj **args);
 
+// Typedefs for the primitive functions taking evaluated arguments. The arguments are passed in an
+// array on the C stack instead of a list, so that calling a primitive function allocates nothing.
+typedef struct Obj *Subr(void *root, struct Obj **args, int nargs, int line_num);
+typedef struct Obj *Subr1(void *root, struct Obj **x, int line_num);
+typedef struct Obj *Subr2(void *root, struct Obj **x, struct Obj **y, int line_num);
+
+// The arity of a primitive function taking any number of arguments
+#define VARIADIC -1
+// The arity of a special form
+#define SPECIAL_FORM -2
+
 // The object type
 typedef struct Obj {
     // The first word of the object represents the type of the object. Any code that handles object
@@ -59,19 +79,51 @@ typedef struct Obj {
         };
         // Symbol
         char name[1];
-        // Primitive
-        Primitive *fn;
+        // Primitive or node handler
+        struct {
+            union {
+                Primitive *fn;  // Special form or node handler
+                Subr *subr;
+                Subr1 *subr1;
+                Subr2 *subr2;
+            };
+            int arity;
+            char *prim_name;
+        };
         // Function or Macro
         struct {
             struct Obj *params;
             struct Obj *body;
             struct Obj *env;
+            long calls;  // The number of times the function has been called
+            bool stack_frame;  // True if the body cannot capture the environment frame of a call
+            bool open_frame;  // True if the body may define a variable in the frame of a call
+            bool pure;  // True if the function was found pure when memo_epoch was the epoch
+            Subr *code;  // The native code compiled by --compile-c or --jit, or NULL
+            struct Obj *memo;  // The cache of the results of a defun-memo function, or NULL
+            long long memo_epoch;
+        };
+        // Generator. The state of its stack is not managed by GC.
+        struct Generator *generator;
+        // Promise. Until it's forced, forcing it applies thunk to thunk_args. Then thunk is the
+        // value.
+        struct {
+            struct Obj *thunk;
+            struct Obj *thunk_args;
+            bool forced;
+        };
+        // Table. Empty slots are NULL.
+        struct {
+            long len;
+            struct Obj *slots[1];
         };
         // Environment frame. This is a linked list of association lists
-        // containing the mapping from symbols to their value.
+        // containing the mapping from symbols to their value. open is true if the code running
+        // in the frame may still add a variable to it with define.
         struct {
             struct Obj *vars;
             struct Obj *up;
+            bool open;
         };
         // Forwarding pointer
         void *moved;
@@ -87,6 +139,91 @@ typedef struct {
 void error(char *fmt, int line_num, ...);
 
 void init_minilisp(Obj **env);
-int eval_input(void *input, Obj **env, Obj **expr);
+int eval_input(void *root, Obj **env, Obj **expr);
+void run_on_stack(size_t size, void (*fn)(void));
+
+// If true, functions are optimized once they have been called HOT_THRESHOLD times
+#define HOT_THRESHOLD 100
+extern bool optimize_hot;
+
+// The JIT compiler only generates x86-64 code.
+#if !defined(__x86_64__) && !defined(MINILISP_NO_JIT)
+#define MINILISP_NO_JIT
+#endif
+
+// If true, functions are compiled to machine code once they have been called JIT_THRESHOLD times
+#define JIT_THRESHOLD 100
+extern bool jit;
+
+// 1: type declarations are checked, 0: they are trusted
+extern int safety;
+
+// 0: no optimization, 1: constant folding, 2: inlining
+extern int optimize_level;
+// The maximum size of the functions inlined with optimize_level 2
+extern int inline_limit;
+
+// The number of results cached for each function defined with defun-memo
+extern int memo_size;
+
+// The limits of the evaluation of each top-level form: the number of eval steps, the number of
+// bytes allocated and the depth of function calls. 0 means no limit.
+extern long long max_steps, max_alloc;
+extern long max_depth;
+// The time limit of the evaluation of each top-level form in ms, or 0
+extern long timeout_ms;
+// Makes SIGINT abort the evaluation of the current top-level form instead of the process.
+void catch_interrupts(bool on);
+
+// Writes the C translation of the programs to output. See "Ahead-of-time compiler" in minilisp.c.
+void compile_c(char *output, char **files, int nfiles, Obj **env, Obj **expr);
+
+// The following is used by the programs generated by compile_c().
+
+// A function compiled to C. It's attached to the function defined by the defun form whose
+// (name params . body) has the given hash.
+typedef struct {
+    char *name;
+    unsigned long hash;
+    Subr *code;
+} NativeFunction;
+
+typedef struct {
+    char *name;
+    char *text;
+} EmbeddedFile;
+
+typedef struct {
+    NativeFunction *functions;
+    int nfunctions;
+    // The constants of the compiled code as read by the reader, stored in roots[1..]
+    char **constants;
+    int nconstants;
+    // The names of the primitives the compiled code inlines, stored after the constants
+    char **primitives;
+    int nprimitives;
+    // The files the program loads, which are not read from the disk.
+    EmbeddedFile *files;
+    int nfiles;
+    // The files run by main()
+    char **main_files;
+    int nmain_files;
+    // A root frame holding the constants, the primitives and the global variables used by the
+    // compiled code
+    void **roots;
+    int nroots;
+} NativeProgram;
+
+extern Obj *aot_nil, *aot_true;
+extern long long *aot_epoch;
+
+int aot_main(NativeProgram *program);
+void aot_enter(int line_num);
+void aot_step(int line_num);
+Obj *aot_int(void *root, long long value);
+Obj *aot_counter(void *root);
+Obj *aot_global(Obj **cell, long long *cell_epoch, char *name, int line_num);
+void aot_setq(Obj **cell, long long *cell_epoch, char *name, Obj *value, int line_num);
+Obj *aot_call(void *root, Obj *fn, Obj **args, int nargs, int line_num);
 
 #endif // _MINILISP_H_
@@ -62,7 +62,7 @@ void minilisp(char *text, size_t length, bool with_repl, Obj **env, Obj **expr)
         FILE * stream = fmemopen(text, length, "r");
         // Redirect stdin to the in memory stream in order to use getchar()
         stdin = stream;
-        eval_input(text, env, expr);
+        eval_input(gc_root, env, expr);
         free(text);
         // restore stdin
         stdin = old_stdin;
@@ -85,16 +85,18 @@ void minilisp(char *text, size_t length, bool with_repl, Obj **env, Obj **expr)
             stdin = stream;
             
             if (line[0] != '\0' && line[0] != '/') {
-                eval_input(line, env, expr);
+                catch_interrupts(true);
+                eval_input(gc_root, env, expr);
+                catch_interrupts(false);
                 bestlineHistoryAdd(line);
                 bestlineHistorySave("history.txt");
             } else if (line[0] == '/') {
                 if (!strncmp(line, "/memory", 7)){
                     extern size_t mem_nused;
-                    printf("Memory used: %ld / Total: %d\n", mem_nused, MEMORY_SIZE);
+                    printf("Memory used: %zu / Total: %zu\n", mem_nused, memory_size);
                 }
                 else if (!strncmp(line, "/help", 5)){
-                    puts("Type Ctrl-C to quit.");
+                    puts("Type Ctrl-C to quit, or to interrupt the evaluation.");
                     puts("/memory to display the amount of memory used.");
                 }
                 else {
@@ -116,6 +118,8 @@ static char *one_liner = NULL;
 static int num_files = 0;
 static char **filenames;
 static bool with_repl = true;
+static size_t stack_size = 512;   // in MB
+static char *c_output = NULL;
 
 void parse_args(int argc, char **argv) {
 
@@ -124,6 +128,18 @@ void parse_args(int argc, char **argv) {
         {"no-history",  ko_no_argument,         301 }, // disable history
         {"no-repl",     ko_no_argument,         302 }, // disable the REPL
         {"help",        ko_no_argument,         303 }, // show help
+        {"stack-size",  ko_required_argument,   304 }, // size of the control stack
+        {"optimize-hot", ko_no_argument,        305 }, // optimize hot functions
+        {"optimize",    ko_required_argument,   306 }, // optimization level
+        {"inline-limit", ko_required_argument,  307 }, // size of the functions inlined
+        {"compile-c",   ko_required_argument,   308 }, // compile the files to C
+        {"memo-size",   ko_required_argument,   309 }, // size of the defun-memo caches
+        {"safety",      ko_required_argument,   310 }, // whether declarations are checked
+        {"max-steps",   ko_required_argument,   311 }, // limits of each top-level form
+        {"max-alloc",   ko_required_argument,   312 },
+        {"max-depth",   ko_required_argument,   313 },
+        {"timeout",     ko_required_argument,   314 }, // time limit of each top-level form
+        {"jit",         ko_no_argument,         315 }, // compile hot functions to machine code
         {NULL,          0             ,         0   }
     };
 
@@ -145,7 +161,7 @@ void parse_args(int argc, char **argv) {
         (allows distinguishing between missing required argument and unknown option)
     */
     while (true) {
-        int c = ketopt(&option, argc, argv, 0, "-:x:Hrh", long_options);
+        int c = ketopt(&option, argc, argv, 0, "-:x:Hrhs:O:", long_options);
         if (c == -1)
             break;
         int idx = option.longidx;
@@ -174,14 +190,87 @@ void parse_args(int argc, char **argv) {
 
             case 'h':
             case 303: // --help
-                puts("minilisp [-r -x -h] FILE1 FILE2 ...\n");
+                puts("minilisp [-r -x -s -O -h] FILE1 FILE2 ...\n");
                 puts("Run the Lisp files FILE1, FILE2, ... in that order,");
                 puts("and enter the read-eval-print loop once finished.");
                 puts("-r | --no-repl    : don't enter the read-eval-print loop.");
                 puts("-x | --exec       : execute lisp code passed as argument.");
+                puts("-s | --stack-size : size of the control stack in MB (default 512,");
+                puts("                    0 to use the native stack).");
+                puts("--optimize-hot    : optimize the functions called often.");
+                puts("--jit             : compile the functions called often to machine code.");
+                puts("-O | --optimize   : optimization level of the functions (default 0,");
+                puts("                    1 to fold constants, 2 to also inline small functions).");
+                puts("--inline-limit    : maximum size of the functions inlined (default 20).");
+                puts("--safety LEVEL    : 1 to check the type declarations (default), 0 to trust them.");
+                puts("--memo-size       : number of results cached by defun-memo (default 1024).");
+                puts("--max-steps N     : maximum number of eval steps of each top-level form.");
+                puts("--max-alloc BYTES : maximum number of bytes allocated by each top-level form.");
+                puts("--max-depth N     : maximum depth of function calls.");
+                puts("--timeout MS      : maximum time of each top-level form in milliseconds.");
+                puts("--compile-c OUT.c : compile the functions of the files to C instead of");
+                puts("                    running them (see make aot).");
                 puts("-h | --help       : print this help.");
                 exit(0);
 
+            case 's':
+            case 304: // --stack-size MB
+                stack_size = strtoul(option.arg, NULL, 10);
+                break;
+
+            case 305: // --optimize-hot
+#ifdef MINILISP_NO_OPTIMIZE_HOT
+                puts("This minilisp was built without the optimizer (OPTIMIZE_HOT=0).");
+#else
+                optimize_hot = true;
+#endif
+                break;
+
+            case 'O':
+            case 306: // --optimize LEVEL
+                optimize_level = atoi(option.arg);
+                break;
+
+            case 307: // --inline-limit SIZE
+                inline_limit = atoi(option.arg);
+                break;
+
+            case 308: // --compile-c OUT.c
+                c_output = strdup(option.arg);
+                break;
+
+            case 309: // --memo-size SIZE
+                memo_size = atoi(option.arg);
+                break;
+
+            case 310: // --safety LEVEL
+                safety = atoi(option.arg);
+                break;
+
+            case 311: // --max-steps N
+                max_steps = strtoll(option.arg, NULL, 10);
+                break;
+
+            case 312: // --max-alloc BYTES
+                max_alloc = strtoll(option.arg, NULL, 10);
+                break;
+
+            case 313: // --max-depth N
+                max_depth = strtol(option.arg, NULL, 10);
+                break;
+
+            case 314: // --timeout MS
+                timeout_ms = strtol(option.arg, NULL, 10);
+                break;
+
+            case 315: // --jit
+#ifdef MINILISP_NO_JIT
+                puts("This minilisp was built without the JIT compiler (JIT=0).");
+#else
+                jit = true;
+#endif
+                break;
+
             case '?': // unknown option
                 printf("Unknown option '%c'\n", option.opt);
                 break;
@@ -202,18 +291,22 @@ void parse_args(int argc, char **argv) {
     // regular arguments: run files
     num_files = argc - option.ind;
     filenames = (char **) malloc(num_files * sizeof(char *));
-    for (int i = 1; i <= num_files; i++) {
-        filenames[i-1] = strdup(argv[i]);
+    for (int i = 0; i < num_files; i++) {
+        filenames[i] = strdup(argv[option.ind + i]);
     }
 }
 
-int main(int argc, char **argv) {
-
-    parse_args(argc, argv);
+// Runs the files and the REPL. Called on the control stack allocated by run_on_stack().
+static void repl_main(void) {
 
     DEFINE2(gc_root, env, expr);
     init_minilisp(env);
 
+    if (c_output) {
+        compile_c(c_output, filenames, num_files, env, expr);
+        exit(0);
+    }
+
     for (int i = 0; i < num_files; i++) {
         printf("Loading %s\n", filenames[i]);
         void process_file(char *fname, Obj **env, Obj **expr);
@@ -238,6 +331,12 @@ int main(int argc, char **argv) {
 
     size_t len = one_liner ? strlen(one_liner) : 0;
     minilisp(one_liner, len, with_repl, env, expr);
+}
+
+int main(int argc, char **argv) {
+
+    parse_args(argc, argv);
+    run_on_stack(stack_size * 1024 * 1024, repl_main);
 
     return 0;
 }
@@ -7,13 +7,13 @@ function fail() {
 }
 
 function do_run() {
-  error=$(echo "$3" | ./minilisp -r -x "${3}" 2>&1 > /dev/null)
+  error=$(echo "$3" | ./minilisp -r $MINILISP_OPTS -x "${3}" 2>&1 > /dev/null)
   if [ -n "$error" ]; then
     echo FAILED
     fail "$error"
   fi
 
-  result=$(echo "$3" | ./minilisp -r -x "${3}" 2> /dev/null | tail -1)
+  result=$(echo "$3" | ./minilisp -r $MINILISP_OPTS -x "${3}" 2> /dev/null | tail -1)
   if [ "$result" != "$2" ]; then
     echo FAILED
     fail "$2 expected, but got $result"
@@ -28,6 +28,16 @@ function run() {
   echo ok
 }
 
+function run_error() {
+  echo -n "Testing $1 ... "
+  error=$(./minilisp -r -x "$3" 2>&1 > /dev/null)
+  if [[ "$error" != *"$2"* ]]; then
+    echo FAILED
+    fail "$2 expected, but got $error"
+  fi
+  echo ok
+}
+
 # Basic data types
 run integer 1 1
 run integer -1 -1
@@ -38,6 +48,7 @@ run quote '(+ 1 2)' "'(+ 1 2)"
 
 run + 3 '(+ 1 2)'
 run + -2 '(+ 1 -3)'
+run_error + 'takes only numbers' '(+ "a" 1)'
 run '*' 24 '(* 1 2 3 4)'
 run '*' -24 '(* -1 2 3 4)'
 run '/' 6 '(/ 13 2)'
@@ -63,6 +74,7 @@ run reverse "cba" '(reverse "abc")'
 run length 5 '(length 1 2 3 4 5)'
 run length 5 "(length '(1 2 3 4 5))"
 run length 5 '(length "abcde")'
+run length 0 '(length ())'
 
 # List manipulation
 run cons "(a . b)" "(cons 'a 'b)"
@@ -73,6 +85,9 @@ run cdr "(b c)" "(cdr '(a b c))"
 
 run setcar "(x . b)" "(define obj (cons 'a 'b)) (setcar obj 'x) obj"
 
+run atom t "(atom 'a)"
+run atom '()' "(atom '(a b))"
+
 # Comments
 run comment 5 "
   ; 2
@@ -125,6 +140,7 @@ run eq t "(eq 'foo 'foo)"
 run eq t "(eq + +)"
 run eq '()' "(eq 'foo 'bar)"
 run eq '()' "(eq + 'bar)"
+run eq t '(eq 5000 (* 50 100))'
 
 # gensym
 run gensym G__0 '(gensym)'
@@ -142,6 +158,19 @@ run args 15 '(defun f (x y z) (+ x y z)) (f 3 5 7)'
 
 run restargs '(3 5 7)' '(defun f (x . y) (cons x y)) (f 3 5 7)'
 run restargs '(3)'    '(defun f (x . y) (cons x y)) (f 3)'
+run restargs '(2 3)'  '(defun f (x . y) y) (defun g (a) (f a (+ a 1) (+ a 2))) (g 1)'
+run defun-memo 12586269025 '(defun-memo fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 50)'
+run defun-memo 2 '(define k 0) (defun-memo f (n) (setq k (+ k 1)) n) (f 1) (f 1) k'
+run defun-memo 9 '(defun g (x) (* x 2)) (defun-memo f (n) (g n)) (f 3) (defun g (x) (* x 3)) (f 3)'
+run defun-memo 5 '(defun-memo f (l) (car l)) (define l (list 1 2)) (f l) (setcar l 5) (f l)'
+MINILISP_OPTS='--memo-size 2' run defun-memo 6765 '(defun-memo fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 20)'
+# A call whose result is cached allocates nothing.
+run defun-memo 2001 '(defun-memo f (n) (+ n 2000)) (f 1) (with-limits (alloc 1000) (dotimes (i 1000) (f 1))) (f 1)'
+run 'function argument' 9 '(defun ap (fn x) (fn x)) (ap (lambda (n) (* n n)) 3)'
+run 'escaped frame' 7 '(defun g () (lambda () 0)) (defun k (fn) (fn) (fn)) (defun f (x) (k (g)) x) (f 1)
+                       (defmacro g () (quote (lambda () (setq x (+ x 1))))) (f 5)'
+run 'escaped frame' 15 '(defun g () 1) (defun f (x) (let ((y (* x 2))) (g))) (f 1)
+                        (defmacro g () (quote (lambda () (+ x y)))) (define h (f 5)) (h)'
 
 # strings
 run 'string-concat' 'one & two and 3' '(string-concat "one" " & " "two" " and " 3)'
@@ -163,6 +192,15 @@ run counter 3 '
   (counter)
   (counter)'
 
+run 'shared variable' 2 '(defun f () (let ((x 1)) (let ((g (lambda () x))) (setq x 2) (g)))) (f)'
+run 'shadowed variable' 2 '(defun f (x) (let ((x 2)) (lambda () x))) (define h (f 1)) (h)'
+run 'macro in closure' 3 "(defmacro m () 'x) (defun f (x) (lambda () (m))) (define h (f 3)) (h)"
+run 'local function' 7 '(defun f () (define g (lambda () (h))) (define h (lambda () 7)) (g)) (f)'
+run 'global shadowed later' 5 '(define x 1) (defun f () (define g (lambda () x)) (g) (define x 5) (g)) (f)'
+run 'let shadowed later' 6 '(define x 1) (let ((a 1)) (define g (lambda () (+ a x))) (g) (define x 5) (g))'
+
+run print 'hello world()' '(print "hello" "world")'
+
 run progn 'I own 10 cents()' '(progn (print "I own ") 
                               (defun add(x y)(+ x y))
                               (print (add 3 7)) 
@@ -177,6 +215,20 @@ run while 45 "
     (setq i (+ i 1)))
   sum"
 
+run dotimes 45 '(define s 0) (dotimes (i 10) (setq s (+ s i))) s'
+run dotimes 3 '(dotimes (i 3 i))'
+run dotimes 10 '(defun f (n) (let ((s 0)) (dotimes (i n s) (setq s (+ s i))))) (f 5)'
+# The counter of 1000 iterations would take more than 1000 bytes if it were allocated.
+MINILISP_OPTS='--max-alloc 1000' run dotimes '()' '(dotimes (i 1000) ())'
+# Past the small integers, the counter is updated in place as long as the body can't keep it.
+MINILISP_OPTS='--max-alloc 1000' run dotimes '()' '(dotimes (i 100000) ())'
+MINILISP_OPTS='--max-alloc 10000' run dotimes 1 '(define n 0) (dotimes (i 100000) (when (= i 99999) (setq n 1))) n'
+run dotimes 1200 '(define k ()) (dotimes (i 2000) (when (= i 1200) (setq k i))) k'
+run dotimes '(1200 1)' '(define k ()) (dotimes (i 2000) (when (= i 1200) (setq k (let ((+ list)) (+ i 1))))) k'
+run dotimes '(1200 1)' '(define k ()) (dotimes (i 2000) (when (= i 1200) (setq + list)) (when (= i 1200) (setq k (+ i 1)))) k'
+run dolist '(3 2 1)' "(define s ()) (dolist (x '(1 2 3) s) (setq s (cons x s)))"
+run dolist '()' "(dolist (x '(1 2) x))"
+
 # Macros
 run macro 42 "
   (defun list (x . y) (cons x y))
@@ -190,6 +242,164 @@ run macroexpand '(if (= x 0) (print x))' "
   (defmacro if-zero (x then) (list 'if (list '= x 0) then))
   (macroexpand (if-zero x (print x)))"
 
+run 'macro cache' 10 "
+  (defmacro inc (var) (list 'setq var (list '+ var 1)))
+  (define i 0)
+  (while (< i 10) (inc i))
+  i"
+
+run 'macro cache' '(1 2)' "
+  (defmacro m () 1)
+  (defun f () (m))
+  (define x (f))
+  (defmacro m () 2)
+  (list x (f))"
+
+# Compiled code
+run 'global variable' 5 '(define x 1) (defun f () x) (f) (define x 5) (f)'
+run 'redefined function' 3 '(defun f (x) (+ x 1)) (f 1) (setq + -) (f 4)'
+run 'redefined function' 10 '(defun f (x) (+ x 1)) (defun g () (f 1)) (g) (setq f (lambda (x) (* x 10))) (g)'
+run 'redefined function' 2 '(defun f (x) (+ x 1)) (defun g () (f 1)) (g) (defun f (x) (* x 2)) (g)'
+run 'local define' 4 '(defun f (x) (define y 2) (+ x y)) (f 1) (f 2)'
+run 'redefined special form' '(t 7)' '(defun f () (if t 7)) (f) (define if list) (f)'
+
+# Optimized code
+MINILISP_OPTS=--optimize-hot run 'hot function' 200 '(defun f (x) (+ x 1)) (define i 0) (while (< i 200) (setq i (f i))) i'
+MINILISP_OPTS=--optimize-hot run 'hot function' 6 '(defun f (x) (+ x 1)) (define i 0) (while (< i 200) (setq i (f i))) (setq + *) (f 6)'
+MINILISP_OPTS=--optimize-hot run 'hot function' '(3 (4))' '(defun f (x) (cdr (car x))) (define i 0) (while (< i 200) (f (list (list i i))) (setq i (+ i 1))) (list (car (f (list (list 2 3)))) (f (list (list 3 4))))'
+run declare 3 '(defun f (x y) (declare (fixnum x y)) (+ x y)) (f 1 2)'
+MINILISP_OPTS=--optimize-hot run declare 5050 '(defun f (n) (declare (fixnum n)) (let ((s 0)) (while (> n 0) (setq s (+ s n)) (setq n (- n 1))) s))
+                                     (define i 0) (define r 0) (while (< i 200) (setq r (f 100)) (setq i (+ i 1))) r'
+MINILISP_OPTS=--optimize-hot run declare z '(defun f (x) (declare (fixnum x)) (if (= x 0) (setq x "z") (+ x 1)))
+                                     (define i 0) (while (< i 200) (f 3) (setq i (+ i 1))) (f 0)'
+MINILISP_OPTS='--optimize-hot --safety 0' run declare 6 '(defun f (x) (declare (fixnum x)) (+ x 1)) (define i 0) (while (< i 200) (f 3) (setq i (+ i 1))) (f 5)'
+MINILISP_OPTS=--jit run jit 6765 '(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 20)'
+MINILISP_OPTS=--jit run jit '(() a ())' '(defun f (x) (when (> x 1) (unless (> x 5) (quote a)))) (dotimes (i 200) (f i)) (list (f 0) (f 3) (f 9))'
+MINILISP_OPTS=--jit run jit 2 '(defun f (x y) (cond ((= x 0) y) ((and (> x 5) (< x 100)) (f (- x 1) (cons x y))) ((or (= x 1) (= x 2)) (f (- x 1) y)) (t (f (- x 1) (+ 2 (if (< x 110) 0 1)))))) (f 300 1)'
+MINILISP_OPTS=--jit run jit '(100000 200000 300000 400000 500000 a)' '(defun f (n l) (if (= n 0) l (f (- n 1) (cons (* n 100000) l)))) (dotimes (i 200) (f 3 ())) (f 5 (quote (a)))'
+MINILISP_OPTS=--jit run jit 'Malformed car' "(defun f (x) (car x)) (dotimes (i 200) (f '(1))) (catch 'error (f 1))"
+MINILISP_OPTS='--jit --max-depth 1000' run jit 'Depth limit exceeded' "(defun f (n) (if (= n 0) 0 (+ 1 (f (- n 1))))) (f 200) (catch 'error (f 2000))"
+MINILISP_OPTS=--jit run deoptimization 4 '(defun f (x) (+ x 1)) (dotimes (i 200) (f i)) (setq + -) (f 5)'
+MINILISP_OPTS=--jit run deoptimization 2 '(defun g (x) x) (defun f (x) (g x)) (dotimes (i 200) (f i)) (defun g (x) (* x 2)) (f 1)'
+MINILISP_OPTS=--jit run deoptimization 11 '(define k 3) (defun f (x) (+ x k)) (dotimes (i 200) (f i)) (define k 10) (f 1)'
+MINILISP_OPTS=-O1 run 'constant folding' 15 '(defun f () (+ (* 2 3) (- 10 1))) (f)'
+MINILISP_OPTS=-O1 run 'constant folding' -1 '(defun f () (+ 1 2)) (f) (setq + -) (f)'
+MINILISP_OPTS=-O1 run 'constant folding' -1 '(defun f (+) (+ 1 2)) (f -)'
+MINILISP_OPTS=-O1 run 'constant folding' b "(defun f () (if (< 2 1) 'a 'b)) (f)"
+MINILISP_OPTS=-O1 run 'constant folding' '(t 2 3)' '(defun f () (if (< 1 2) (+ 1 1) 3)) (f) (define if list) (f)'
+MINILISP_OPTS=-O1 run 'constant folding' 7 '(defun f () "doc" 1 2 (+ 3 4)) (f)'
+MINILISP_OPTS=-O2 run inlining 1 '(defun g (x y) (- x y)) (defun h (x y) (g y x)) (h 1 2)'
+MINILISP_OPTS=-O2 run inlining 20 '(defun g (x) (+ x 1)) (defun h (y) (g y)) (h 1) (defun g (x) (* x 10)) (h 2)'
+MINILISP_OPTS=-O2 run inlining 11 '(define y 10) (defun g (x) (+ x y)) (defun h (y) (g y)) (h 1)'
+MINILISP_OPTS=-O2 run inlining 7 '(defun f (x) (g x)) (defun g (x) (if (= x 0) 7 (f (- x 1)))) (f 10)'
+MINILISP_OPTS='-O2 --inline-limit 0' run inlining 2 '(defun g (x) (+ x 1)) (defun h (y) (g y)) (h 1)'
+
+# Let
+run let 3 '(let ((x 1) (y 2)) (+ x y))'
+run let 25 '(let x 5 (* x x))'
+run let 10 '(define x 10) (let ((x 1) (y x)) y)'
+run let* 2 '(let* ((x 1) (y (+ x 1))) y)'
+run letrec t '(letrec ((ev (lambda (n) (if (= n 0) t (od (- n 1)))))
+                       (od (lambda (n) (if (= n 0) () (ev (- n 1))))))
+                (ev 10))'
+run 'let in function' '(4 6)' '(defun f (n) (let ((x n) (y (* n 2))) (setq x (+ x 1)) (list x y))) (f 3)'
+run 'let closure' 7 '(defun mk (n) (let ((c n)) (lambda () (setq c (+ c 1)) c))) (define g (mk 5)) (g) (g)'
+run 'let define' 6 '(let ((x 1)) (define y 5) (+ x y))'
+
+# Conditionals
+run and t '(and)'
+run and '()' '(and 1 () (car ()))'
+run and 2 '(and 1 2)'
+run or 2 '(or () 2 (car ()))'
+run when 2 '(when t 1 2)'
+run when '()' '(when () (car ()))'
+run unless 5 '(unless () 5)'
+run cond 3 '(cond ((= 1 2) 1) ((= 1 1) 2 3) (t 4))'
+run cond 5 '(cond (() 1) (5))'
+run cond '()' '(cond (() 1))'
+run case '(low low three sym str other)' "(defun f (x) (case x ((1 2) 'low) (3 'three) ((a b) 'sym) (\"s\" 'str) (t 'other)))
+                                          (list (f 1) (f 2) (f 3) (f 'b) (f \"s\") (f 9))"
+run case '()' '(case 5 (1 2))'
+run case 2 "(define k 'b) (case k (a 1) (b 2) (otherwise 3))"
+
+run generator '(1 2 () t)' '(define g (make-generator (lambda (yield) (yield 1) (yield 2))))
+                             (list (next g) (next g) (next g) (done? g))'
+run generator 4950 '(define g (make-generator (lambda (yield) (dotimes (i 100) (yield i)))))
+                    (define s 0) (define x (next g)) (while (not (done? g)) (setq s (+ s x)) (setq x (next g))) s'
+run generator '(10 21)' '(define g (make-generator (lambda (yield) (define h (make-generator (lambda (y) (y 10) (y 20))))
+                                                   (yield (next h)) (yield (+ (next h) 1)))))
+                         (list (next g) (next g))'
+run generator 1 '(dotimes (i 3000) (next (make-generator (lambda (yield) (yield i))))) 1'
+
+run delay '(1 1 1 5)' '(define k 0) (define p (delay (setq k (+ k 1)))) (list (force p) (force p) k (force 5))'
+run stream '(225 144 81 36 9)' '(defun ints (n) (cons-stream n (ints (+ n 1))))
+                                (stream-fold (lambda (acc x) (cons x acc)) ()
+                                  (stream-take 5 (stream-filter (lambda (x) (= 0 (mod x 3)))
+                                                   (stream-map (lambda (x) (* x x)) (ints 1)))))'
+run stream 3 '(define k 0) (defun ints (n) (cons-stream (setq k (+ k 1)) (ints (+ n 1))))
+              (stream-fold + 0 (stream-take 3 (ints 0))) k'
+run stream 6 '(stream-fold + 0 (stream-map car (quote ((1) (2) (3)))))'
+
+run with-limits 3 '(with-limits (steps 10 alloc 1000 depth 5) (+ 1 2))'
+run with-timeout 3 '(with-timeout 10000 (+ 1 2))'
+MINILISP_OPTS='--timeout 10000' run timeout 5050 '(define s 0) (dotimes (i 101) (setq s (+ s i))) s'
+MINILISP_OPTS='--max-steps 1000 --max-depth 50' run limits 40 '(defun f (n) (if (= n 0) 0 (+ 1 (f (- n 1))))) (f 40)'
+
+run quasiquote '(p 1 a b q)' '(define x 1) (define y (quote (a b))) `(p ,x ,@y q)'
+run quasiquote '((a . 1) (1 2) (a (quasiquote (b (unquote (c 1))))))' \
+  '(define x 1) (list `(a . ,x) `(1 ,@() 2) `(a `(b ,(c ,x))))'
+run quasiquote t '(defun f (x) `(a b ,x c d)) (eq (cdr (cdr (cdr (f 1)))) (cdr (cdr (cdr (f 2)))))'
+run quasiquote 5 '(defmacro my-unless (c e) `(if ,c () ,e)) (my-unless () 5)'
+
+run catch 2 "(catch 'a (+ 1 (throw 'a 2)))"
+run catch 1 "(catch 'a (catch 'b (throw 'a 1)) 2)"
+run catch '(Malformed car 3)' "(list (catch 'error (car 1)) (catch 'error 3))"
+run catch 42 "(defun f (n) (if (= n 0) (throw 'done 42) (+ 1 (f (- n 1))))) (catch 'done (f 1000))"
+run catch '(1 9 t)' "(define g (make-generator (lambda (yield) (yield 1) (throw 'out 9))))
+                     (define x (next g)) (list x (catch 'out (next g)) (done? g))"
+
+run apply 6 "(apply + '(1 2 3))"
+run apply 10 "(apply + 1 2 '(3 4))"
+run apply '(2 3)' "(apply (lambda (a . r) r) 1 2 '(3))"
+run funcall 16 '(funcall (lambda (x) (* x x)) 4)'
+run funcall 2 '(define k 0) (defun inc () (setq k (+ k 1))) (defun-memo f (n) (funcall inc) n) (f 1) (f 1) k'
+
+run values '(3 2)' '(defun divmod (a b) (values (/ a b) (mod a b))) (multiple-value-bind (q r) (divmod 17 5) (list q r))'
+run values 2 '(+ 1 (values 1 2))'
+run values '(1 () ())' '(multiple-value-bind (a b c) 1 (list a b c))'
+run values '(1 ())' '(multiple-value-bind (a b) (car (list (values 1 2))) (list a b))'
+run values '(2 ())' '(defun ints (n) (cons-stream n (ints (+ n 1))))
+  (multiple-value-bind (a b) (stream-fold (lambda (acc x) (values x 9)) 0 (stream-take 2 (ints 1)))
+    (list a b))'
+run values '(1 ())' '(multiple-value-bind (a b) (force (delay (values 1 2))) (list a b))'
+run values '(1 2)' '(multiple-value-bind (a b) (funcall values 1 2) (list a b))'
 
 # Sum from 0 to 10
-run recursion 55 '(defun f (x) (if (= x 0) 0 (+ (f (+ x -1)) x))) (f 10)'
\ No newline at end of file
+run recursion 55 '(defun f (x) (if (= x 0) 0 (+ (f (+ x -1)) x))) (f 10)'
+run 'deep recursion' 3000 '(defun f (x) (if (= x 0) 0 (+ (f (- x 1)) 1))) (f 3000)'
+# Past the end of the default control stack, which -s 0 would turn into a crash
+MINILISP_OPTS= run 'deep recursion' 'Stack overflow' "(defun f () (+ 1 (f))) (catch 'error (f))"
+run 'deep list' 3000 '(defun f (x) (if (= x 0) () (cons (f (- x 1)) ()))) (define l (f 3000)) (define n 0) (while l (setq l (car l)) (setq n (+ n 1))) n'
+
+# Ahead-of-time compilation
+function run_aot() {
+  echo -n "Testing $1 (compiled) ... "
+  dir=$(mktemp -d)
+  echo "$3" > $dir/prog.lisp
+  ./minilisp --compile-c $dir/prog.c $dir/prog.lisp > /dev/null
+  ${CC:-gcc} -std=gnu99 -Isrc -o $dir/prog $dir/prog.c src/gc.c src/minilisp.c || fail "build failed"
+  result=$(MINILISP_ALWAYS_GC=1 $dir/prog 2> /dev/null | tail -1)
+  rm -rf $dir
+  if [ "$result" != "$2" ]; then
+    echo FAILED
+    fail "$2 expected, but got $result"
+  fi
+  echo ok
+}
+
+run_aot recursion 55 '(defun f (x) (if (= x 0) 0 (+ (f (- x 1)) x))) (f 10)'
+run_aot loops '(6 (c b a))' '(defun f (n) (let ((s 0) (l ())) (dotimes (i n) (setq s (+ s i))) (dolist (x (quote (a b c))) (setq l (cons x l))) (list s l))) (f 4)'
+run_aot 'loop counter' 1501 '(defun f (n) (let ((k 0)) (dotimes (i n) (when (= i 1500) (setq k (+ i 1)))) k)) (f 2000)'
+run_aot 'loop counter' '(1999 1998)' '(defun f (n) (let ((l ())) (dotimes (i n) (when (> i 1997) (setq l (cons i l)))) l)) (f 2000)'
+run_aot 'interpreted callee' 9 '(defun g (x) (lambda () x)) (defun f (x) ((g (* x x)))) (f 3)'
+run_aot 'redefined function' 2 '(defun g (x) x) (defun f (x) (g x)) (f 1) (defun g (x) (* x 2)) (f 1)'